@@ -12,9 +12,15 @@ single integral atomic.
 #define ntuplebuf_ntuplebuf_h
 
 #include <cstddef>
+#include <cstdint>
 #include <climits>
 #include <type_traits>
 #include <atomic>
+#include <chrono>
+
+#include "ntuplebuf_wait.hpp"
+#include "ntuplebuf_stats.hpp"
+#include "ntuplebuf_time.hpp"
 
 /*
 #if TEST_RACES_ntuplebuf_ms
@@ -31,10 +37,18 @@ single integral atomic.
 #   define  YELD_ntuplebuf
 #endif
 
+// (may be defined as 128 e.g. for targets prefetching cache lines in pairs)
+#ifndef CACHE_LINE_ntuplebuf
+#   define  CACHE_LINE_ntuplebuf 64
+#endif
+
 
 namespace ntuplebuf {
 
 
+constexpr size_t cache_line_size = CACHE_LINE_ntuplebuf;
+
+
 constexpr int counter_bitsize(unsigned v){
     for(size_t i=0; i < sizeof(v) * CHAR_BIT; ++i){
         if(v < ((unsigned)1 << i)){
@@ -45,16 +59,517 @@ constexpr int counter_bitsize(unsigned v){
 }
 
 
-template<typename ControlCodeT, unsigned NBUFS>  // ToDo:  + panic/warning handler?
+constexpr unsigned control_bitsize(unsigned nbufs){ // refcounts of all buffers + current buffer number
+    return (nbufs + 1) * counter_bitsize(nbufs);
+}
+
+
+/*
+128-bit control word (up to 24 buffers).
+
+std::atomic<unsigned __int128> is not lock-free with gcc (it calls libatomic), so the control word
+uses double-width CAS via __sync builtins, which are always inlined (x86-64 cmpxchg16b requires -mcx16).
+Every operation is a full barrier, so memory order arguments are ignored.
+There is no plain 16-byte atomic load, so load() is a CAS too (it writes the cache line).
+ */
+#if defined(__SIZEOF_INT128__)
+__extension__ typedef unsigned __int128 uint128_t;
+#   if defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16) && !defined(DWCAS_ntuplebuf)
+#       define  DWCAS_ntuplebuf 1
+#   endif
+#endif
+
+#ifndef DWCAS_ntuplebuf
+#   define  DWCAS_ntuplebuf 0
+#endif
+
+#if DWCAS_ntuplebuf
+struct AtomicUint128
+{
+    static constexpr bool is_always_lock_free = true;
+
+    constexpr AtomicUint128(uint128_t v = 0): v_(v) {}
+
+    AtomicUint128(const AtomicUint128&) = delete;
+    AtomicUint128& operator=(const AtomicUint128&) = delete;
+
+    bool is_lock_free() const{ return true; }
+
+    uint128_t load(std::memory_order = std::memory_order_seq_cst) const{
+        return __sync_val_compare_and_swap(&v_, (uint128_t)0, (uint128_t)0);
+    }
+
+    bool compare_exchange_strong(
+            uint128_t& expected,
+            uint128_t desired,
+            std::memory_order = std::memory_order_seq_cst,
+            std::memory_order = std::memory_order_seq_cst
+    ){
+        uint128_t prev = __sync_val_compare_and_swap(&v_, expected, desired);
+        if(prev == expected){
+            return true;
+        }
+        expected = prev;
+        return false;
+    }
+
+    bool compare_exchange_weak(
+            uint128_t& expected,
+            uint128_t desired,
+            std::memory_order success = std::memory_order_seq_cst,
+            std::memory_order failure = std::memory_order_seq_cst
+    ){
+        return compare_exchange_strong(expected, desired, success, failure);
+    }
+
+    void store(uint128_t v, std::memory_order = std::memory_order_seq_cst){
+        exchange(v);
+    }
+
+    uint128_t exchange(uint128_t v, std::memory_order = std::memory_order_seq_cst){
+        uint128_t cur = load();
+        while(!compare_exchange_strong(cur, v)){
+        }
+        return cur;
+    }
+
+private:
+    alignas(16) mutable uint128_t v_; // (mutable: load() is a CAS)
+};
+#endif
+
+
+// atomic type used for the control word of type T
+template<typename T>
+struct ControlAtomic
+{
+    typedef std::atomic<T> type;
+
+#   if defined(__cpp_lib_atomic_is_always_lock_free)
+    static constexpr bool always_lock_free = std::atomic<T>::is_always_lock_free;
+#   elif defined(__GNUC__)
+    static constexpr bool always_lock_free = __atomic_always_lock_free(sizeof(T), 0);
+#   else
+    static constexpr bool always_lock_free = (sizeof(T) <= sizeof(void*));
+#   endif
+};
+
+#if DWCAS_ntuplebuf
+template<>
+struct ControlAtomic<uint128_t>
+{
+    typedef AtomicUint128 type;
+    static constexpr bool always_lock_free = AtomicUint128::is_always_lock_free;
+};
+#endif
+
+
+template<typename T>
+struct is_control_code
+{
+    static constexpr bool value = (std::is_integral<T>::value && std::is_unsigned<T>::value)
+#   if defined(__SIZEOF_INT128__)
+        || std::is_same<T, uint128_t>::value // (not integral in strict ISO mode)
+#   endif
+        ;
+};
+
+
+/*
+AutoControlCode as ControlCodeT: the control engine takes the smallest always lock-free unsigned type
+that holds the control word for NBUFS buffers (e.g. uint8_t for a triple buffer, uint128_t
+for 16..24 buffers if double-width CAS is available).
+ */
+struct AutoControlCode {};
+
+template<typename T, unsigned NBUFS>
+struct ControlCodeFits
+{
+    static constexpr bool value = ControlAtomic<T>::always_lock_free
+            && control_bitsize(NBUFS) <= sizeof(T) * CHAR_BIT;
+};
+
+template<unsigned NBUFS, typename T, typename... Ts>
+struct SmallestControlCode
+{
+    typedef typename std::conditional<
+        ControlCodeFits<T, NBUFS>::value,
+        T,
+        typename SmallestControlCode<NBUFS, Ts...>::type
+    >::type type;
+};
+
+template<unsigned NBUFS, typename T>
+struct SmallestControlCode<NBUFS, T>
+{
+    typedef T type; // the last resort (the engine reports if NBUFS does not fit)
+};
+
+template<typename ControlCodeT, unsigned NBUFS>
+struct ResolveControlCode
+{
+    typedef ControlCodeT type;
+};
+
+template<unsigned NBUFS>
+struct ResolveControlCode<AutoControlCode, NBUFS>
+{
+    typedef typename SmallestControlCode<NBUFS, uint8_t, uint16_t, uint32_t, uint64_t
+#       if DWCAS_ntuplebuf
+        , uint128_t
+#       endif
+    >::type type;
+};
+
+
+/*
+Memory ordering policies for the control word.
+
+Every operation of NTupleBufferControl is "load, then CAS loop" on the single atomic control word,
+so the only synchronization that matters is between successful CASes (RMWs) on that atomic.
+All RMWs on one atomic are totally ordered (modification order) and every RMW reads the
+latest value in that order, so each successful CAS continues the release sequence of all
+previous ones. Hence:
+
+ - a successful acq_rel CAS acquires everything released by all previous operations:
+   a reader which got a bufnum sees all the data written before the commit that published it,
+   and a writer which got a free buffer sees reading of that buffer (by previous owners) completed
+   (the readers released it with their dec_ref CAS);
+ - the initial load and a failed CAS only produce the "expected" value for the next attempt,
+   the value is never used to access data, so relaxed is enough for them;
+ - error returns (e.g. count underrun, no free buffer) do not access data at all.
+
+seq_cst adds a single total order with seq_cst operations on OTHER atomics only. The buffer does not
+rely on that, but user code might (e.g. it uses buffer state as a flag together with another atomic),
+so MemOrderSeqCst is kept as the default.
+*/
+
+struct MemOrderSeqCst
+{
+    static constexpr std::memory_order load = std::memory_order_seq_cst;
+    static constexpr std::memory_order cas_success = std::memory_order_seq_cst;
+    static constexpr std::memory_order cas_failure = std::memory_order_seq_cst;
+    static constexpr bool wait = true; // (see NoWait)
+};
+
+struct MemOrderAcqRel
+{
+    static constexpr std::memory_order load = std::memory_order_relaxed;
+    static constexpr std::memory_order cas_success = std::memory_order_acq_rel;
+    static constexpr std::memory_order cas_failure = std::memory_order_relaxed;
+    static constexpr bool wait = true; // (see NoWait)
+};
+
+/*
+Waiting for new data (wait_for_update(), start_reading_wait(), wait_async()) costs every commit
+a check of the wait point: a seq_cst fence (unless the publishing RMW is seq_cst) and a seq_cst load,
+even while nobody waits. A buffer that never waits takes its policy wrapped in NoWait
+(e.g. NoWait<MemOrderAcqRel>): commits do not touch the wait point at all, the control structure
+has no wait point, and calls of the waiting functions do not compile.
+ */
+template<typename MemOrder>
+struct NoWait
+    : public MemOrder
+{
+    static constexpr bool wait = false;
+};
+
+
+/*
+Generation (sequence number of commit) of every buffer, kept aside of the control word.
+The writer stamps its buffer before the (release) commit, the reader reads the stamp of a buffer
+it references, so relaxed accesses are sufficient. Generation 0 means "never committed".
+ */
+template<unsigned NBUFS>
+struct Generations
+{
+    typedef uint64_t gen_t;
+
+    gen_t stamp(int bufnum){
+        gen_t g = next_.fetch_add(1, std::memory_order_relaxed);
+        gens_[bufnum - 1].store(g, std::memory_order_relaxed);
+        return g;
+    }
+
+    gen_t get(int bufnum) const{
+        return (bufnum > 0)? gens_[bufnum - 1].load(std::memory_order_relaxed) : 0;
+    }
+
+private:
+    std::atomic<gen_t> next_ = {1};
+    std::atomic<gen_t> gens_[NBUFS] = {};
+};
+
+
+/*
+Order of a commit in multi-producer "latest value" mode (see commit_ordered()).
+seq is e.g. a timestamp or a sequence number of the message, producer (id) breaks ties of seq;
+orders are compared lexicographically. Order {0, 0} means "never committed".
+ */
+struct CommitOrder
+{
+    uint64_t seq;
+    uint32_t producer;
+
+    bool newer_than(const CommitOrder& o) const{
+        return seq > o.seq || (seq == o.seq && producer > o.producer);
+    }
+};
 
-struct NTupleBufferControl
+// orders of buffers, kept aside of the control word (accessed as Generations)
+template<unsigned NBUFS>
+struct CommitOrders
 {
+    void set(int bufnum, CommitOrder o){
+        seqs_[bufnum - 1].store(o.seq, std::memory_order_relaxed);
+        producers_[bufnum - 1].store(o.producer, std::memory_order_relaxed);
+    }
+
+    CommitOrder get(int bufnum) const{
+        CommitOrder o = {0, 0};
+        if(bufnum > 0){
+            o.seq = seqs_[bufnum - 1].load(std::memory_order_relaxed);
+            o.producer = producers_[bufnum - 1].load(std::memory_order_relaxed);
+        }
+        return o;
+    }
+
 private:
+    std::atomic<uint64_t> seqs_[NBUFS] = {};
+    std::atomic<uint32_t> producers_[NBUFS] = {};
+};
+
+
+
+// index of the lowest set bit (v != 0)
+template<typename T>
+inline int lowest_bit(T v){
+#if defined(__GNUC__)
+    return (sizeof(T) <= sizeof(unsigned))? __builtin_ctz((unsigned)v)
+        : (sizeof(T) <= sizeof(unsigned long long))? __builtin_ctzll((unsigned long long)v)
+        : ((unsigned long long)v != 0)? __builtin_ctzll((unsigned long long)v)
+        : 64 + __builtin_ctzll((unsigned long long)(v >> 32 >> 32)); // (no shift warning for narrow T)
+#else
+    int i = 0;
+    for(; (v & 1) == 0; v >>= 1){
+        ++i;
+    }
+    return i;
+#endif
+}
+
+
+/*
+Field arithmetic of the control word: NBUFS reference counters followed by the current buffer number,
+count_bitsize bits each.
+
+The kernels are branchless SWAR (they run inside the CAS window, so every cycle widens it):
+ - find_new: the classic "has zero field" detector ((x - lsbs) & ~x & msbs); its lowest flag is exact
+   (borrows only propagate above a zero field), a sentinel above the counters makes "not found" fall
+   out of the same lowest_bit();
+ - inc_ref/dec_ref: add/subtract of a precomputed unit of the field, masked out on overrun/underrun.
+   A counter never exceeds NBUFS < 2^count_bitsize, so neither can carry/borrow into the next field.
+
+*_loop functions are the original field-by-field versions (reference for tests and benchmarks).
+ */
+template<typename ControlCodeT, unsigned NBUFS>
+struct ControlWordFields
+{
+    static constexpr int count_bitsize = counter_bitsize(NBUFS);
+    static constexpr ControlCodeT count_mask = ((ControlCodeT)1 << count_bitsize) - 1;
+
+    static constexpr ControlCodeT make_lsbs(){
+        ControlCodeT r = 0;
+        for(unsigned i = 0; i < NBUFS; ++i){
+            r |= (ControlCodeT)1 << (i * count_bitsize);
+        }
+        return r;
+    }
+
+    static constexpr ControlCodeT lsbs = make_lsbs(); // lowest bit of every counter
+    static constexpr ControlCodeT msbs = lsbs << (count_bitsize - 1); // highest bit of every counter
+    static constexpr ControlCodeT not_found = (ControlCodeT)1 << (NBUFS * count_bitsize + count_bitsize - 1);
+
+    struct Units{ // indexed by bufnum (0: no buffer)
+        ControlCodeT unit[NBUFS + 1];
+        unsigned char shift[NBUFS + 1];
+    };
+
+    static constexpr Units make_units(){
+        Units u = {};
+        for(unsigned b = 1; b <= NBUFS; ++b){
+            u.shift[b] = (unsigned char)((b - 1) * count_bitsize);
+            u.unit[b] = (ControlCodeT)1 << u.shift[b];
+        }
+        return u;
+    }
+
+    static constexpr Units units = make_units();
+
+
+    static ControlCodeT get_count(ControlCodeT cco, int buf_idx){
+        return (cco >> (buf_idx * count_bitsize)) & count_mask;
+    }
+
+    static void set_count(ControlCodeT& cco, int buf_idx, ControlCodeT val){
+        int pos = buf_idx * count_bitsize;
+        ControlCodeT m = count_mask << pos;
+        cco = (cco & ~m) | (m & (val << pos));
+    }
+
+    static int  // returns bufnum (1-based) of a buffer with zero count, 0 if not found
+    find_new(ControlCodeT cco){
+        ControlCodeT zeros = (ControlCodeT)((ControlCodeT)(cco - lsbs) & (ControlCodeT)~cco & msbs) | not_found;
+        unsigned idx = (unsigned)lowest_bit(zeros) / count_bitsize; // NBUFS if not found
+        return (int)((idx + 1) & (0u - (unsigned)(idx < NBUFS)));
+    }
+
+    static int // new count, 0 if bufnum is 0, -2 on count overrun (cco unchanged then)
+    inc_ref(ControlCodeT& cco, int bufnum){
+        unsigned b = (bufnum > 0)? (unsigned)bufnum : 0;
+        ControlCodeT count = (cco >> units.shift[b]) & count_mask;
+        bool ok = count < NBUFS;
+        cco += units.unit[b] & (ControlCodeT)(0 - (ControlCodeT)ok);
+        int res = ok? (int)count + 1 : -2;
+        return (b != 0)? res : 0;
+    }
+
+    static int // new count, 0 if bufnum is 0, -2 on count underrun (cco unchanged then)
+    dec_ref(ControlCodeT& cco, int bufnum){
+        unsigned b = (bufnum > 0)? (unsigned)bufnum : 0;
+        ControlCodeT count = (cco >> units.shift[b]) & count_mask;
+        bool ok = count != 0;
+        cco -= units.unit[b] & (ControlCodeT)(0 - (ControlCodeT)ok);
+        int res = ok? (int)count - 1 : -2;
+        return (b != 0)? res : 0;
+    }
+
+
+    static int find_new_loop(ControlCodeT cco){
+        ControlCodeT m = count_mask;
+        for(unsigned i =0; i < NBUFS; ++i){
+            if((cco & m) == 0){
+                return i + 1 ; // convert index to 1-based
+            }
+
+            m = m << count_bitsize;
+        }
+
+        return 0; // not found
+    }
+
+    static int inc_ref_loop(ControlCodeT& cco, int bufnum){
+        if(bufnum <= 0){
+            return 0;
+        }
+
+        int buf_idx = bufnum -1;
+        ControlCodeT count = get_count(cco, buf_idx);
+        if(count >= NBUFS){
+            return -2; // count overrun
+        }
+
+        count++;
+        set_count(cco, buf_idx, count);
+
+        return (int) count;
+    }
+
+    static int dec_ref_loop(ControlCodeT& cco, int bufnum){
+        if(bufnum <= 0){
+            return 0;
+        }
+
+        int buf_idx = bufnum -1;
+        ControlCodeT count = get_count(cco, buf_idx);
+        if(count == 0){
+            return -2; // count underrun
+        }
+
+        count--;
+        set_count(cco, buf_idx, count);
+
+        return (int) count;
+    }
+};
+
+template<typename ControlCodeT, unsigned NBUFS>
+constexpr typename ControlWordFields<ControlCodeT, NBUFS>::Units ControlWordFields<ControlCodeT, NBUFS>::units;
+
+
+// wait point of a control structure that never waits (see NoWait)
+struct NoWaitPoint
+{
+    void notify(bool){}
+};
+
+
+/*
+Side data of a control structure: everything but the control word(s).
+ */
+template<unsigned NBUFS, bool WAIT = true>
+struct ControlSide
+{
+    Generations<NBUFS> gens;
+    CommitOrders<NBUFS> orders;
+    typename std::conditional<WAIT, WaitPoint, NoWaitPoint>::type waitp;
+    unsigned wait_spin = 0;
+#ifdef STATS_ntuplebuf
+    StatsReadFlags<NBUFS> read_flags;
+    StatsRows stats;
+#endif
+#ifdef TIMESTAMPS_ntuplebuf
+    CommitTimes<NBUFS> times;
+#endif
+};
+
+
+/*
+Storage of a control structure: the control word(s) and the side data are members of the structure,
+or (REF) they are kept elsewhere and the structure only refers to them, e.g. NTupleBufferBank packs
+control words of all its topics in one array and their side data in another one.
+ */
+template<typename Word, typename Side, bool REF>
+struct ControlStorage
+{
+    Word& word(){ return word_; }
+    const Word& word() const{ return word_; }
+    Side& side(){ return side_; }
+    const Side& side() const{ return side_; }
+
+    Word word_ = {};
+    Side side_;
+};
+
+template<typename Word, typename Side>
+struct ControlStorage<Word, Side, true>
+{
+    ControlStorage(Word& word, Side& side): word_(&word), side_(&side) {}
+
+    Word& word() const{ return *word_; }
+    Side& side() const{ return *side_; }
+
+    Word* word_;
+    Side* side_;
+};
+
+
+template<
+    typename ControlCodeSpec, // unsigned integral type, uint128_t or AutoControlCode
+    unsigned NBUFS,
+    typename MemOrder, // memory ordering policy (see above)
+    bool REF // control word and side data are referenced (see ControlStorage)
+>  // ToDo:  + panic/warning handler?
+
+struct NTupleBufferControlImpl
+{
+private:
+    typedef typename ResolveControlCode<ControlCodeSpec, NBUFS>::type ControlCodeT;
 
 
 #ifdef DBG_STATUS_ntuplebuf
     void PRINT_CSTATUS_ntuplebuf(const char* headstr, ControlCodeT cc){
-        std::cout << headstr << " Current: " << this->get_current(cc) << " buf(count):";
+        std::cout << headstr << " Current: " << (unsigned)this->get_current(cc) << " buf(count):";
         for(unsigned i =0; i < NBUFS; ++i){
             std::cout << "  " << (i + 1) << "(" << this->bufcount(cc, i + 1) << ")";
         }
@@ -68,6 +583,18 @@ private:
 
 public:
     using CCodeT = ControlCodeT;
+    using MemOrderPolicy = MemOrder;
+    using gen_t = typename Generations<NBUFS>::gen_t;
+    static constexpr uint32_t engine_id = 1; // (shared memory layouts record it, see ntuplebuf_shm.hpp)
+
+    using Word = typename ControlAtomic<ControlCodeT>::type; // the control word
+    using Side = ControlSide<NBUFS, MemOrder::wait>;
+    using Ref = NTupleBufferControlImpl<ControlCodeSpec, NBUFS, MemOrder, true>;
+
+    NTupleBufferControlImpl() = default;
+
+    // REF: control structure of the word and side data kept by the caller
+    NTupleBufferControlImpl(Word& word, Side& side): store_(word, side) {}
 
     enum: ControlCodeT{
         NumOfBuffers = NBUFS,
@@ -76,20 +603,20 @@ public:
     };
 
     static_assert(
-            std::is_integral<ControlCodeT>::value,
+            is_control_code<ControlCodeT>::value,
             "ControlCodeT shall be unsigned integral type"
     );
 
-    static_assert(
-            std::is_unsigned<ControlCodeT>::value,
-            "ControlCodeT shall be unsigned"
-    );
-
     static_assert( // space for buffers refcounts and current buffer number
-            (NBUFS + 1)  * count_bitsize <= sizeof(ControlCodeT) * CHAR_BIT,
+            control_bitsize(NBUFS) <= sizeof(ControlCodeT) * CHAR_BIT,
             "NBUFS too large for ControlCodeT"
     );
 
+    static_assert(
+            ControlAtomic<ControlCodeT>::always_lock_free,
+            "atomic ControlCodeT is not lock-free (128-bit control word requires double-width CAS, e.g. -mcx16)"
+    );
+
 
    struct Transaction {
         int errcode;
@@ -114,6 +641,98 @@ public:
     }
 
 
+    // the same as above, also return generation of the buffer (0 if no data)
+
+    int start_reading(int* p_bufnum_prev, gen_t* p_gen){
+        int res = start_reading_impl(p_bufnum_prev, false);
+        if(res >= 0 && p_gen != nullptr){
+            *p_gen = side().gens.get(res);
+        }
+        return res;
+    }
+
+    int pop(int* p_bufnum_prev, gen_t* p_gen){
+        int res = start_reading_impl(p_bufnum_prev, true);
+        if(res >= 0 && p_gen != nullptr){
+            *p_gen = side().gens.get(res);
+        }
+        return res;
+    }
+
+
+    // "Read-once" start_reading(): returns 0 if current generation is *p_gen_seen (already processed
+    // by the caller); *p_bufnum_prev is left referenced in that case.
+    // If the caller still references the current buffer, the check costs just a load of the control word.
+    int // returns positive (1-based number) if new data, 0 if no (new) data, negative on error
+    start_reading_once(
+            int* p_bufnum_prev, // as for start_reading()
+            gen_t* p_gen_seen   // generation processed last time (0 initially); updated on new data
+    ){
+        if(p_bufnum_prev == nullptr || p_gen_seen == nullptr){
+            return -5;
+        }
+
+        int prev_bufnum = *p_bufnum_prev;
+
+        YELD_ntuplebuf
+
+        if(prev_bufnum > 0 && (int)get_current(word().load(MemOrder::load)) == prev_bufnum
+                && side().gens.get(prev_bufnum) == *p_gen_seen
+        ){
+            return 0; // still current and referenced (so its generation can not change)
+        }
+
+        gen_t gen = 0;
+        int res = start_reading(p_bufnum_prev, &gen);
+        if(res <= 0 || gen == *p_gen_seen){
+            return (res < 0)? res : 0;
+        }
+
+        *p_gen_seen = gen;
+        return res;
+    }
+
+
+    // generation of the buffer referenced by the caller (0 if bufnum is 0)
+    gen_t generation(int bufnum) const{
+        return (bufnum > 0 && bufnum <= (int)NBUFS)? side().gens.get(bufnum) : 0;
+    }
+
+    // order of the buffer referenced by the caller (as set by commit_ordered(), {0, 0} otherwise)
+    CommitOrder order(int bufnum) const{
+        return side().orders.get((bufnum > 0 && bufnum <= (int)NBUFS)? bufnum : 0);
+    }
+
+    // commit time of the buffer referenced by the caller (see ntuplebuf_time.hpp; 0 unless TIMESTAMPS_ntuplebuf)
+    uint64_t commit_time(int bufnum) const{
+#ifdef TIMESTAMPS_ntuplebuf
+        return side().times.get((bufnum > 0 && bufnum <= (int)NBUFS)? bufnum : 0);
+#else
+        (void)bufnum;
+        return 0;
+#endif
+    }
+
+#ifdef TIMESTAMPS_ntuplebuf
+    // age and commit interval histograms, time of the last commit
+    const CommitTimes<NBUFS>& times() const{ return side().times; }
+#endif
+
+#ifdef STATS_ntuplebuf
+    // events of this control structure (see ntuplebuf_stats.hpp)
+    const StatsRows& stats() const{ return side().stats; }
+#endif
+
+
+    // true if nobody references the buffer (it is not current either).
+    // Only a writer can take such buffer, so the answer is stable for the (single) writer;
+    // acquire: reading by the last owner happens before.
+    bool is_free(int bufnum){
+        return (bufnum > 0 && bufnum <= (int)NBUFS)
+            && get_count(word().load(std::memory_order_acquire), bufnum - 1) == 0;
+    }
+
+
     // Optional function that releases the consumed buffer after reading is over.
     // Call it if you want to release the buffer before the next start_reading() call.
     // start_reading() also releases the previous buffer, so usually
@@ -133,7 +752,7 @@ public:
             return (bufnum == 0)? 0 : -14;
         }
 
-        ControlCodeT cco = cco_.load();
+        ControlCodeT cco = word().load(MemOrder::load);
         for(;;){
             ControlCodeT new_cco = cco;
 
@@ -144,10 +763,12 @@ public:
 
             YELD_ntuplebuf
 
-            if(cco_.compare_exchange_strong(cco, new_cco)){
+            if(word().compare_exchange_strong(cco, new_cco, MemOrder::cas_success, MemOrder::cas_failure)){
                 *p_bufnum = 0;
                 return count;
             }
+
+            stats_count(StatsPage::CAS_RETRY);
         }
 
         return -100;// unreachable (calm compiler warning)
@@ -173,7 +794,7 @@ public:
             return (bufnum == 0)? 0 : -22;
         }
 
-        ControlCodeT cco = cco_.load();
+        ControlCodeT cco = word().load(MemOrder::load);
         for(;;){
             ControlCodeT new_cco = cco;
 
@@ -195,10 +816,12 @@ public:
 
             YELD_ntuplebuf
 
-            if(cco_.compare_exchange_strong(cco, new_cco)){
+            if(word().compare_exchange_strong(cco, new_cco, MemOrder::cas_success, MemOrder::cas_failure)){
                 *p_bufnum = 0;
                 return count;
             }
+
+            stats_count(StatsPage::CAS_RETRY);
         }
 
         return -100;// unreachable (calm compiler warning)
@@ -214,8 +837,13 @@ public:
         }
 
         int prev_bufnum =  *p_bufnum_working;
+        uint64_t t_commit = 0;
+        if(prev_bufnum > 0){
+            side().gens.stamp(prev_bufnum);
+            t_commit = time_stamp(prev_bufnum);
+        }
 
-        ControlCodeT cco = cco_.load();
+        ControlCodeT cco = word().load(MemOrder::load);
         for(;;){
             ControlCodeT new_cco = cco;
 
@@ -231,6 +859,7 @@ public:
 
             int new_bufnum = find_new(new_cco);
             if(new_bufnum < 1){
+                stats_count(StatsPage::NO_FREE_SLOT);
                 return -35; // not found
             }
 
@@ -238,10 +867,18 @@ public:
 
             YELD_ntuplebuf
 
-            if(cco_.compare_exchange_strong(cco, new_cco)){ //  weak would be sufficient?
+            if(word().compare_exchange_strong(cco, new_cco, MemOrder::cas_success, MemOrder::cas_failure)){ //  weak would be sufficient?
+                if(prev_bufnum > 0){
+                    stat_replaced((int)get_current(cco)); // (cco: the word replaced)
+                    time_published(t_commit);
+                    notify_waiters();
+                }
+                stat_taken(new_bufnum);
                 *p_bufnum_working = (int)new_bufnum;
                 return (int)new_bufnum;
             }
+
+            stats_count(StatsPage::CAS_RETRY);
         }
 
         return -100;// unreachable (calm compiler warning)
@@ -249,13 +886,14 @@ public:
 
     Transaction start_transaction(){
         Transaction rett = {-1, 0, 0};
-        ControlCodeT cco = cco_.load();
+        ControlCodeT cco = word().load(MemOrder::load);
         for(;;){
             ControlCodeT new_cco = cco;
 
             int old_bufnum = get_current(new_cco);
             int new_bufnum = find_new(new_cco);
             if(new_bufnum < 1){
+                stats_count(StatsPage::NO_FREE_SLOT);
                 rett.errcode = -80; // not found
                 return rett;
             }
@@ -280,14 +918,17 @@ public:
                         << "\n";
 #           endif
 
-            if(cco_.compare_exchange_strong(cco, new_cco)){
+            if(word().compare_exchange_strong(cco, new_cco, MemOrder::cas_success, MemOrder::cas_failure)){
                 rett.errcode = 0;
                 rett.old_buf = old_bufnum;
                 rett.new_buf = new_bufnum;
+                stat_taken(new_bufnum);
 
                 PRINT_CSTATUS_ntuplebuf("start_transaction", new_cco);
                 return rett;
             }
+
+            stats_count(StatsPage::CAS_RETRY);
         }
 
         return rett;// unreachable (calm compiler warning)
@@ -297,7 +938,13 @@ public:
      int // returns 0 on success, 1 on failure, negative on error
      commit_transaction(Transaction tra, bool force){
         bool success = true; // optimistic
-        ControlCodeT cco = cco_.load();
+        uint64_t t_commit = 0;
+        if(tra.new_buf > 0){
+            side().gens.stamp(tra.new_buf); // (just garbage on failure)
+            t_commit = time_stamp(tra.new_buf);
+        }
+
+        ControlCodeT cco = word().load(MemOrder::load);
         for(;;){
             ControlCodeT new_cco = cco;
 
@@ -333,7 +980,14 @@ public:
 #           endif
 
 
-            if(cco_.compare_exchange_strong(cco, new_cco)){
+            if(word().compare_exchange_strong(cco, new_cco, MemOrder::cas_success, MemOrder::cas_failure)){
+                if(success){
+                    stat_replaced(cur_bufnum);
+                    time_published(t_commit);
+                    notify_waiters();
+                }else{
+                    stats_count(StatsPage::COLLISION);
+                }
 
                 PRINT_CSTATUS_ntuplebuf(
                         success? "commit_transaction_succeeds" : "commit_transaction_failed",
@@ -341,6 +995,76 @@ public:
                 );
                 return success? 0 : 1;
             }
+
+            stats_count(StatsPage::CAS_RETRY);
+        }
+
+        return 1;// unreachable (calm compiler warning)
+    }
+
+
+    // Multi-producer "latest value" commit of transaction (for several producers of the same topic,
+    // e.g. redundant sensors): the new buffer becomes current only if its order is newer than the order
+    // of the current buffer. The check and the publication are the same CAS, so readers never see
+    // an older value after a newer one.
+    // The order of the current buffer is read while it is referenced (tra.old_buf), so it can not change;
+    // if another commit has replaced it, the reference moves to the new current and the check repeats.
+    // Equal order is rejected (the same message again). Note: consume()/pop() clear the current buffer,
+    // so the next commit is accepted whatever its order is.
+    int // returns 0 on success, 1 if rejected (not newer than current), negative on error
+    commit_ordered(Transaction tra, CommitOrder order){
+        if(bufnum_valid(tra.old_buf) < 0 || bufnum_valid(tra.new_buf) <= 0){
+            return -87;
+        }
+
+        side().orders.set(tra.new_buf, order);
+        side().gens.stamp(tra.new_buf); // (just garbage if rejected)
+        uint64_t t_commit = time_stamp(tra.new_buf);
+
+        ControlCodeT cco = word().load(MemOrder::load);
+        for(;;){
+            ControlCodeT new_cco = cco;
+
+            int cur_bufnum = get_current(new_cco);
+            bool moved = cur_bufnum != tra.old_buf;
+            bool success = !moved && (cur_bufnum == 0 || order.newer_than(side().orders.get(cur_bufnum)));
+
+            if(dec_ref(new_cco, tra.old_buf) < 0){ // release tra.old_buf
+                return -88;
+            }
+
+            if(moved){
+                // reference the new current instead (and compare with it on the next iteration)
+                if(inc_ref(new_cco, cur_bufnum) < 0){
+                    return -89;
+                }
+            }else if(success){
+                dec_ref(new_cco, cur_bufnum); // release ex-current (the same as tra.old_buf, so still referenced)
+                set_current(new_cco, tra.new_buf);
+            }else if(dec_ref(new_cco, tra.new_buf) < 0){ // release new buffer (garbage if rejected)
+                return -86;
+            }
+
+            YELD_ntuplebuf
+
+            if(word().compare_exchange_strong(cco, new_cco, MemOrder::cas_success, MemOrder::cas_failure)){
+                if(moved){
+                    tra.old_buf = cur_bufnum;
+                    cco = new_cco;
+                    continue;
+                }
+
+                if(success){
+                    stat_replaced(cur_bufnum);
+                    time_published(t_commit);
+                    notify_waiters();
+                }else{
+                    stats_count(StatsPage::ORDER_REJECTED);
+                }
+                return success? 0 : 1;
+            }
+
+            stats_count(StatsPage::CAS_RETRY);
         }
 
         return 1;// unreachable (calm compiler warning)
@@ -360,7 +1084,10 @@ public:
             return 0; // nothing to commit
         }
 
-        ControlCodeT cco = cco_.load();
+        side().gens.stamp(prev_bufnum);
+        uint64_t t_commit = time_stamp(prev_bufnum);
+
+        ControlCodeT cco = word().load(MemOrder::load);
         for(;;){
             ControlCodeT new_cco = cco;
 
@@ -375,16 +1102,79 @@ public:
 
             YELD_ntuplebuf
 
-            if(cco_.compare_exchange_strong(cco, new_cco)){ //  weak would be sufficient?
+            if(word().compare_exchange_strong(cco, new_cco, MemOrder::cas_success, MemOrder::cas_failure)){ //  weak would be sufficient?
+                stat_replaced((int)cur_bufnum);
+                time_published(t_commit);
+                notify_waiters();
                 *p_bufnum_working = 0; // just clear
                 return 0;
             }
+
+            stats_count(StatsPage::CAS_RETRY);
         }
 
         return -100;// unreachable (calm compiler warning)
     }
 
 
+    // Blocking wait for new data.
+    // Waits until the current buffer is neither "no data" nor bufnum_seen (the latter should still be
+    // referenced by the caller, so it can not become current again meanwhile).
+    // Polls the control word set_wait_spin() times before parking (see ntuplebuf_wait.hpp).
+    int // returns 1 if updated, 0 on timeout
+    wait_for_update(
+            int bufnum_seen,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        static_assert(MemOrder::wait, "the buffer does not wait (NoWait memory order policy)");
+        return side().waitp.wait(
+                [&](){
+                    int cur = (int)get_current(word().load(std::memory_order_seq_cst));
+                    return cur != 0 && cur != bufnum_seen;
+                },
+                timeout,
+                side().wait_spin
+        );
+    }
+
+    // Asynchronous wait for new data (the same condition as of wait_for_update()): the node fires once,
+    // in the thread of the producer publishing the update (see WaitNode in ntuplebuf_wait.hpp).
+    int // returns 1 if the node is queued, 0 if updated already (the node is not queued then)
+    wait_async(WaitNode* node, int bufnum_seen){
+        static_assert(MemOrder::wait, "the buffer does not wait (NoWait memory order policy)");
+        return side().waitp.add_node(
+                node,
+                [&](){
+                    int cur = (int)get_current(word().load(std::memory_order_seq_cst));
+                    return cur != 0 && cur != bufnum_seen;
+                }
+        )? 1 : 0;
+    }
+
+    // returns true if the queued node is taken back (it will not fire), false if it has fired (or fires now)
+    bool cancel_wait_async(WaitNode* node){ return side().waitp.remove_node(node); }
+
+    // start_reading() preceded by wait_for_update(*p_bufnum_prev, timeout);
+    // on timeout returns the same as start_reading() does (i.e. the same buffer or no data)
+    int // returns positive (1-based number) on success, 0 if no data, negative on error
+    start_reading_wait(
+           int* p_bufnum_prev, // pointer to previous bufnum (1- based, may be 0 if no previous data)
+           std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        if(p_bufnum_prev == nullptr){
+            return -4;
+        }
+
+        wait_for_update(*p_bufnum_prev, timeout);
+        return start_reading(p_bufnum_prev);
+    }
+
+    // number of polls before a waiting reader parks (0: park at once)
+    void set_wait_spin(unsigned spin){
+        side().wait_spin = spin;
+    }
+
+
 private:
     // everywhere below:
     // bufnum is 1-based number of a buffer;
@@ -397,7 +1187,7 @@ private:
                                // it will be released and  set to new bufnum
             bool consume = false  // i.e. clear current
     ){
-        ControlCodeT cco = cco_.load();
+        ControlCodeT cco = word().load(MemOrder::load);
         for(;;){
             ControlCodeT new_cco = cco;
             ControlCodeT cur_bufnum = get_current(new_cco);
@@ -430,17 +1220,26 @@ private:
                 }
             }
 
+            stat_read((int)cur_bufnum); // (before CAS: the writer checks the flag after its own CAS)
+
             YELD_ntuplebuf
 
-            if(cco_.compare_exchange_strong(cco, new_cco)){ //  weak would be sufficient?
+            if(word().compare_exchange_strong(cco, new_cco, MemOrder::cas_success, MemOrder::cas_failure)){ //  weak would be sufficient?
                 if(p_bufnum_prev != nullptr){
                     *p_bufnum_prev = (int)cur_bufnum;
                 }
 
                 PRINT_CSTATUS_ntuplebuf("start_reading", new_cco);
 
+                if(cur_bufnum == 0){
+                    stats_count(StatsPage::NO_DATA);
+                }else{
+                    time_read((int)cur_bufnum);
+                }
                 return (int)cur_bufnum;
             }
+
+            stats_count(StatsPage::CAS_RETRY);
         }
 
         return -100;// unreachable (calm compiler warning)
@@ -454,15 +1253,10 @@ private:
         return (bufnum < 0 || bufnum > (int)NBUFS)? -1 : bufnum;
     }
 
-    ControlCodeT get_count(ControlCodeT cco, int buf_idx){
-        return (cco >> (buf_idx * count_bitsize)) & count_mask;
-    }
+    typedef ControlWordFields<ControlCodeT, NBUFS> Fields;
 
-    void set_count(ControlCodeT& cco, int buf_idx, ControlCodeT val){
-        int pos = buf_idx * count_bitsize;
-        ControlCodeT m = count_mask << pos;
-        cco = (cco & ~m) | (m & (val << pos));
-    }
+    ControlCodeT get_count(ControlCodeT cco, int buf_idx){ return Fields::get_count(cco, buf_idx); }
+    void set_count(ControlCodeT& cco, int buf_idx, ControlCodeT val){ Fields::set_count(cco, buf_idx, val); }
 
     int bufcount(ControlCodeT cco, int bufnum){
         if(bufnum < 1){
@@ -476,56 +1270,65 @@ private:
     void set_current(ControlCodeT& cco, ControlCodeT val){ set_count(cco, NBUFS, val);}
 
     int  // returns bufnum (1-based) 0 if not found
-    find_new(ControlCodeT cco){
-        ControlCodeT m = count_mask;
-        for(unsigned i =0; i < NBUFS; ++i){
-            if((cco & m) == 0){
-                return i + 1 ; // convert index to 1-based
-            }
+    find_new(ControlCodeT cco){ return Fields::find_new(cco); }
 
-            m = m << count_bitsize;
-        }
+    int inc_ref(ControlCodeT& cco, int bufnum){ return Fields::inc_ref(cco, bufnum); }
+    int dec_ref(ControlCodeT& cco, int bufnum){ return Fields::dec_ref(cco, bufnum); }
 
-        return 0; // not found
+
+    void notify_waiters(){
+        side().waitp.notify(MemOrder::cas_success == std::memory_order_seq_cst);
     }
 
-    int inc_ref(ControlCodeT& cco, int bufnum){
-        if(bufnum <= 0){
-            return 0;
-        }
 
-        int buf_idx = bufnum -1;
-        ControlCodeT count = get_count(cco, buf_idx);
-        if(count >= NBUFS){
-            return -2; // count overrun
+    // "has been read" flags for StatsPage::OVERWRITTEN_UNREAD (nothing unless STATS_ntuplebuf)
+#ifdef STATS_ntuplebuf
+    void stat_taken(int bufnum){ side().read_flags.taken(bufnum); }
+    void stat_read(int bufnum){ side().read_flags.read(bufnum); }
+    void stat_replaced(int bufnum){
+        if(side().read_flags.replaced(bufnum)){
+            stats_count(StatsPage::OVERWRITTEN_UNREAD);
         }
+    }
 
-        count++;
-        set_count(cco, buf_idx, count);
-
-        return (int) count;
+    void stats_count(StatsPage::Event ev){ // the page of the process and the counters of this structure
+        ntuplebuf::stats_count(ev);
+        side().stats.count(ev);
     }
+#else
+    void stat_taken(int){}
+    void stat_read(int){}
+    void stat_replaced(int){}
+    void stats_count(StatsPage::Event){}
+#endif
 
-    int dec_ref(ControlCodeT& cco, int bufnum){
-        if(bufnum <= 0){
-            return 0;
-        }
+    // commit timestamps and histograms (nothing unless TIMESTAMPS_ntuplebuf)
+#ifdef TIMESTAMPS_ntuplebuf
+    uint64_t time_stamp(int bufnum){ return side().times.stamp(bufnum); }
+    void time_published(uint64_t t){ side().times.published(t); }
+    void time_read(int bufnum){ side().times.read(bufnum); }
+#else
+    uint64_t time_stamp(int){ return 0; }
+    void time_published(uint64_t){}
+    void time_read(int){}
+#endif
 
-        int buf_idx = bufnum -1;
-        ControlCodeT count = get_count(cco, buf_idx);
-        if(count == 0){
-            return -2; // count underrun
-        }
 
-        count--;
-        set_count(cco, buf_idx, count);
+    Word& word(){ return store_.word(); }
+    const Word& word() const{ return store_.word(); }
+    Side& side(){ return store_.side(); }
+    const Side& side() const{ return store_.side(); }
 
-        return (int) count;
-    }
+    ControlStorage<Word, Side, REF> store_;
+};
 
 
-    std::atomic<ControlCodeT> cco_ = {0};
-};
+template<
+    typename ControlCodeSpec, // unsigned integral type, uint128_t or AutoControlCode
+    unsigned NBUFS,
+    typename MemOrder = MemOrderSeqCst // memory ordering policy (see above)
+>
+using NTupleBufferControl = NTupleBufferControlImpl<ControlCodeSpec, NBUFS, MemOrder, false>;
 
 
 
@@ -0,0 +1,400 @@
+#ifndef ntuplebuf_bank_hpp
+#define ntuplebuf_bank_hpp
+
+/*
+Bank of many n-tuple buffers (topics, e.g. thousands of signals) of the same message size.
+
+Structure of arrays instead of one NTupleBufferDynAlloc per topic:
+    - control words of all topics in one dense array (e.g. 4 bytes per topic for NTupleBufferControl
+      with unsigned control word, 16 topics per cache line; NTupleBufferControlFA adds its reference
+      counters: (NBUFS + 1) * sizeof(ControlCodeT) per topic);
+    - side data of the control structures (generations, commit orders, wait points, ...) in another array,
+      so they do not dilute the control words;
+    - message buffers of all topics in one arena (topic t owns slots t * NBUFS ... t * NBUFS + NBUFS - 1);
+    - "changed" bitmaps, one bit per topic, set by every commit.
+
+get_control(topic) returns the control structure of the topic (ControlCode::Ref: refers to the word
+and the side data of the topic, cheap to make on every call).
+
+A consumer scans its bitmap (64 topics per word, empty words are skipped by a plain load)
+and visits only the topics committed since its previous scan (see for_each_changed()).
+The bit is set after the commit is published and cleared (exchange) before the topic is read,
+so a commit is never lost: a commit racing with the scan sets the bit again for the next one.
+Every consumer that needs all changes uses its own bitmap (nconsumers passed to the constructor);
+consumers sharing a bitmap share the changes (each change is visited by one of them).
+
+The per-topic API is the one of NTupleBufferDynAlloc (without waiting and ordered commits)
+with the topic number as the first argument.
+ */
+
+#include "ntuplebuf.hpp"
+#include "ntuplebuf_slot.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <algorithm> // std::min, std::max
+
+
+namespace ntuplebuf {
+
+
+template<
+    typename ControlCodeT,
+    unsigned NBUFS,
+    typename MemOrder = MemOrderSeqCst,
+    template<typename, unsigned, typename> class ControlEngine = NTupleBufferControl
+>
+struct NTupleBufferBank
+{
+    typedef int errcode_t;
+    typedef  ControlEngine<ControlCodeT, NBUFS, MemOrder> ControlCode;
+    typedef typename ControlCode::Ref ControlRef;
+    typedef typename ControlCode::Word ControlWord;
+    typedef typename ControlCode::Side ControlSide;
+    typedef typename ControlCode::Transaction CCTransaction;
+    typedef typename ControlCode::gen_t gen_t;
+
+    struct TypelessTransacion{
+      errcode_t errcode;
+      void* old_buf;
+      void* new_buf;
+    };
+
+
+    NTupleBufferBank(
+            size_t ntopics,
+            size_t data_size,
+            unsigned nconsumers = 1, // number of "changed" bitmaps
+            size_t slot_align = alignof(std::max_align_t)
+    )
+        : ntopics_(ntopics), data_size_(data_size), nconsumers_(std::max(nconsumers, 1u))
+    {
+        size_t algn = std::max(slot_align, alignof(std::max_align_t));
+        sz1buf_ = ((data_size + algn -1) / algn) * algn;
+        raw_ = new uint8_t[ntopics * NBUFS * sz1buf_ + algn](); // zero-initialized
+        data_ = raw_ + (algn - (uintptr_t)raw_ % algn) % algn;
+
+        words_ = new ControlWord[ntopics](); // (zero: no data)
+        sides_ = new ControlSide[ntopics];
+
+        nwords_ = (ntopics + 63) / 64;
+        changed_ = new std::atomic<uint64_t>[nconsumers_ * nwords_];
+        for(size_t i = 0; i < nconsumers_ * nwords_; ++i){
+            changed_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    NTupleBufferBank(const NTupleBufferBank&) = delete;
+    NTupleBufferBank& operator=(const NTupleBufferBank&) = delete;
+
+    ~NTupleBufferBank(){
+        delete[] changed_;
+        delete[] sides_;
+        delete[] words_;
+        delete[] raw_;
+    }
+
+    size_t topics() const{ return ntopics_; }
+    size_t get_data_size() const{ return data_size_; }
+
+    ControlRef get_control(size_t topic){ return ControlRef(words_[topic], sides_[topic]); }
+
+
+    // reader side (the same as NTupleBufferDynAlloc for the topic):
+
+    errcode_t start_reading(size_t topic, void** pptr){ // pptr shall point to previous pointer (or nullptr)
+        return start_reading(topic, pptr, nullptr);
+    }
+
+    errcode_t start_reading(size_t topic, void** pptr, gen_t* p_gen){
+        int bufnum = ptr2bufnum(topic, *pptr);
+        auto res = er(get_control(topic).start_reading(&bufnum, p_gen));
+        if(res >= 0){
+            *pptr = bufnum2ptr(topic, bufnum);
+        }
+        return res;
+    }
+
+    int start_reading_once(size_t topic, void** pptr, gen_t* p_gen_seen){ // 1: new message, 0: already seen
+        int bufnum = ptr2bufnum(topic, *pptr);
+        int res = get_control(topic).start_reading_once(&bufnum, p_gen_seen);
+        if(res >= 0){
+            *pptr = bufnum2ptr(topic, bufnum);
+        }
+        return (res > 0)? 1 : res;
+    }
+
+    errcode_t pop(size_t topic, void** pptr){
+        int bufnum = ptr2bufnum(topic, *pptr);
+        auto res = er(get_control(topic).pop(&bufnum));
+        if(res >= 0){
+            *pptr = bufnum2ptr(topic, bufnum);
+        }
+        return res;
+    }
+
+    errcode_t free(size_t topic, void** pptr){
+        int bufnum = ptr2bufnum(topic, *pptr);
+        auto res = er(get_control(topic).free(&bufnum));
+        if(res >= 0){
+           *pptr = nullptr;
+        }
+        return res;
+    }
+
+    errcode_t consume(size_t topic, void** pptr){ // free() + clear current if still the same
+        int bufnum = ptr2bufnum(topic, *pptr);
+        auto res = er(get_control(topic).consume(&bufnum));
+        if(res >= 0){
+           *pptr = nullptr;
+        }
+        return res;
+    }
+
+    gen_t generation(size_t topic, void* ptr){ return get_control(topic).generation(ptr2bufnum(topic, ptr)); }
+    uint64_t commit_time(size_t topic, void* ptr){ return get_control(topic).commit_time(ptr2bufnum(topic, ptr)); }
+
+
+    // calls f(topic) for every topic committed since the previous call with the same consumer
+    // (and clears its bits); f is called in ascending topic order
+    template<typename Func>
+    size_t // returns the number of topics visited
+    for_each_changed(unsigned consumer, Func f){
+        std::atomic<uint64_t>* words = changed_ + consumer * nwords_;
+        size_t n = 0;
+
+        for(size_t w = 0; w < nwords_; ++w){
+            if(words[w].load(std::memory_order_relaxed) == 0){
+                continue; // (no RMW on unchanged words)
+            }
+
+            uint64_t bits = words[w].exchange(0, std::memory_order_acquire);
+            while(bits != 0){
+                f(w * 64 + (size_t)lowest_bit(bits));
+                bits &= bits - 1;
+                ++n;
+            }
+        }
+
+        return n;
+    }
+
+    bool changed(unsigned consumer, size_t topic) const{ // (without clearing)
+        return (changed_[consumer * nwords_ + topic / 64].load(std::memory_order_acquire) >> (topic % 64)) & 1;
+    }
+
+
+    // writer side:
+
+    errcode_t start_writing(size_t topic, void** pptr){ // commits the previous buffer (if any)
+        int bufnum = ptr2bufnum(topic, *pptr);
+        bool committing = bufnum > 0;
+        auto res = er(get_control(topic).start_writing(&bufnum));
+        if(res >= 0 || bufnum == 0){ // (bufnum == 0 on error: committed, but no free buffer)
+            *pptr = bufnum2ptr(topic, bufnum);
+            if(committing){
+                mark_changed(topic);
+            }
+        }
+        return res;
+    }
+
+    errcode_t commit(size_t topic, void** pptr){
+        int bufnum = ptr2bufnum(topic, *pptr);
+        bool committing = bufnum > 0;
+        auto res = er(get_control(topic).commit(&bufnum));
+        if(res >= 0){
+            *pptr = nullptr;
+            if(committing){
+                mark_changed(topic);
+            }
+        }
+        return res;
+    }
+
+    TypelessTransacion start_transaction(size_t topic){
+        CCTransaction tr = get_control(topic).start_transaction();
+        TypelessTransacion ret = {
+                tr.errcode,
+                bufnum2ptr(topic, tr.old_buf),
+                bufnum2ptr(topic, tr.new_buf),
+        };
+        return ret;
+    }
+
+    int // returns 0 on success, 1 on failure (see NTupleBufferControl::commit_transaction()), negative on error
+    commit_transaction(size_t topic, TypelessTransacion& tra, bool force){
+        if(tra.errcode != 0){
+            return -91;
+        }
+
+        CCTransaction cctra = {
+                0,
+                ptr2bufnum(topic, tra.old_buf),
+                ptr2bufnum(topic, tra.new_buf)
+        };
+
+        int res = get_control(topic).commit_transaction(cctra, force);
+        if(res == 0){
+            mark_changed(topic);
+        }
+        return res;
+    }
+
+
+protected:
+
+    errcode_t er(int fr){return std::min(0, fr);}
+
+    // after the commit (release): whoever sees the bit sees the commit
+    void mark_changed(size_t topic){
+        uint64_t bit = (uint64_t)1 << (topic % 64);
+        for(size_t c = 0; c < nconsumers_; ++c){
+            // (always RMW: skipping it when the bit looks set could lose the commit to a racing scan)
+            changed_[c * nwords_ + topic / 64].fetch_or(bit, std::memory_order_release);
+        }
+    }
+
+    uint8_t* topic_data(size_t topic){ return data_ + topic * NBUFS * sz1buf_; }
+
+    int ptr2bufnum(size_t topic, void* ptr){
+        uint8_t* p = (uint8_t*)ptr;
+        return (p == nullptr)? 0 : ((p - topic_data(topic)) / sz1buf_ + 1);
+    }
+
+    void* bufnum2ptr(size_t topic, int bufnum){
+        return (bufnum != 0)
+            ? topic_data(topic) + sz1buf_* (bufnum -1)
+            : nullptr;
+    }
+
+    size_t ntopics_;
+    size_t data_size_;
+    size_t nconsumers_;
+    size_t sz1buf_ = 1; // size of 1 buffer
+    size_t nwords_ = 0; // of one bitmap
+    uint8_t* data_ = nullptr;
+    uint8_t* raw_ = nullptr; // (as allocated)
+    ControlWord* words_ = nullptr;  // [ntopics_]
+    ControlSide* sides_ = nullptr;  // [ntopics_]
+    std::atomic<uint64_t>* changed_ = nullptr; // [nconsumers_][nwords_]
+};
+
+
+/**
+ * Bank of typed topics.
+ * The type shall be default constructible
+ */
+template<
+    typename ControlCodeT,
+    unsigned NBUFS,
+    typename DataT,
+    typename MemOrder = MemOrderSeqCst,
+    template<typename, unsigned, typename> class ControlEngine = NTupleBufferControl,
+    typename SlotPolicy = SlotReconstruct // (see ntuplebuf_slot.hpp)
+>
+struct NTupleBufferBankTyped
+    : public NTupleBufferBank<ControlCodeT, NBUFS, MemOrder, ControlEngine>
+{
+    typedef NTupleBufferBank<ControlCodeT, NBUFS, MemOrder, ControlEngine> Base;
+    typedef typename Base::errcode_t errcode_t;
+    typedef typename Base::TypelessTransacion TypelessTransacion;
+    typedef typename Base::gen_t gen_t;
+
+    struct TypedTransacion{
+      errcode_t errcode;
+      DataT* old_buf;
+      DataT* new_buf;
+    };
+
+
+    explicit NTupleBufferBankTyped(size_t ntopics, unsigned nconsumers = 1)
+    : Base(ntopics, sizeof(DataT), nconsumers, alignof(DataT))
+    {
+        for(size_t i = 0 ; i < ntopics * NBUFS; ++i){
+            new(Base::data_ + i * Base::sz1buf_) DataT; // call placement new
+        }
+    }
+
+    ~NTupleBufferBankTyped(){
+        for(size_t i = 0 ; i < Base::ntopics_ * NBUFS; ++i){
+            (static_cast<DataT*>(
+                    static_cast<void*>(
+                            Base::data_ + i * Base::sz1buf_
+            ))) -> DataT::~DataT(); // placement destruct
+        }
+    }
+
+    errcode_t start_reading(size_t topic, DataT** pptr){
+        return Base::start_reading(topic, ppD2V(pptr));
+    }
+
+    errcode_t start_reading(size_t topic, DataT** pptr, gen_t* p_gen){
+        return Base::start_reading(topic, ppD2V(pptr), p_gen);
+    }
+
+    int start_reading_once(size_t topic, DataT** pptr, gen_t* p_gen_seen){
+        return Base::start_reading_once(topic, ppD2V(pptr), p_gen_seen);
+    }
+
+    errcode_t pop(size_t topic, DataT** pptr){
+        return Base::pop(topic, ppD2V(pptr));
+    }
+
+    errcode_t free(size_t topic, DataT** pptr){
+        return Base::free(topic, ppD2V(pptr));
+    }
+
+    errcode_t consume(size_t topic, DataT** pptr){
+        return Base::consume(topic, ppD2V(pptr));
+    }
+
+    errcode_t start_writing(size_t topic, DataT** pptr){
+        auto res = Base::start_writing(topic, ppD2V(pptr));
+        if(res >= 0){
+            SlotPolicy::on_write(*pptr);
+        }
+        return res;
+    }
+
+    errcode_t commit(size_t topic, DataT** pptr){
+        return Base::commit(topic, ppD2V(pptr));
+    }
+
+    TypedTransacion start_transaction(size_t topic){
+        TypelessTransacion tr = Base::start_transaction(topic);
+        TypedTransacion ret = {
+                tr.errcode,
+                static_cast<DataT*>(tr.old_buf),
+                static_cast<DataT*>(tr.new_buf)
+        };
+
+        if(tr.errcode == 0){
+            SlotPolicy::on_transaction(ret.new_buf, ret.old_buf);
+        }
+
+        return ret;
+    }
+
+    errcode_t commit_transaction(size_t topic, TypedTransacion& tra, bool force){
+        if(tra.errcode != 0){
+            return -92;
+        }
+
+        TypelessTransacion tr = {
+                tra.errcode,
+                tra.old_buf,
+                tra.new_buf,
+        };
+
+        return Base::commit_transaction(topic, tr, force);
+    }
+
+private:
+    // the "function" just casts Data** to void** :
+    static void** ppD2V(DataT** ppd){return static_cast<void**>(static_cast<void*>(ppd));}
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,928 @@
+#ifndef ntuplebuf_bench_hpp
+#define ntuplebuf_bench_hpp
+
+/*
+Micro-benchmarks for ntuple buffer operations.
+Shall not be included together with ntuplebuf_test.hpp (the test redefines YELD_ntuplebuf
+to serialize threads, so the numbers would be meaningless).
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#   include <pthread.h>
+#   include <sched.h>
+#endif
+
+// YELD_ntuplebuf precedes every atomic RMW attempt of the control engines, so it counts them
+// (attempts per operation - 1 = retries):
+static thread_local unsigned long ntb_bench_rmw_attempts = 0;
+#define YELD_ntuplebuf ++ntb_bench_rmw_attempts;
+
+#include "ntuplebuf_dyn.hpp"
+#include "ntuplebuf_fa.hpp"
+#include "ntuplebuf_relay.hpp"
+#include "ntuplebuf_bank.hpp"
+
+
+struct NtbBenchBase{
+    using Clock = std::chrono::steady_clock;
+
+    // runs f() n times, returns nanoseconds per call
+    template<typename Func>
+    static double ns_per_op(unsigned long n, Func f){
+        auto t0 = Clock::now();
+        for(unsigned long i = 0; i < n; ++i){
+            f();
+        }
+        auto t1 = Clock::now();
+        return std::chrono::duration<double, std::nano>(t1 - t0).count() / (double)n;
+    }
+
+    static void report(const std::string& name, double ns){
+        std::cout << name << ":  " << ns << " ns/op  "
+                  << (ns > 0 ? 1e9 / ns : 0.0) << " ops/s\n";
+    }
+
+    // pins calling thread to core (modulo number of cores); no-op where not supported
+    static void pin_to_core(unsigned core){
+#       ifdef __linux__
+        unsigned ncores = std::thread::hardware_concurrency();
+        if(ncores == 0){
+            return;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core % ncores, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#       else
+        (void)core;
+#       endif
+    }
+
+    // touches one byte per cache line (so message size matters for readers)
+    static unsigned touch(const void* p, size_t size){
+        const volatile uint8_t* b = static_cast<const volatile uint8_t*>(p);
+        unsigned sum = 0;
+        for(size_t i = 0; i < size; i += 64){
+            sum += b[i];
+        }
+        return sum;
+    }
+};
+
+
+// Cost of the memory ordering policies: producer (start_writing) and consumer (start_reading + free)
+// operations, uncontended and with background readers polling the same control word.
+template<typename ControlCodeT, unsigned NBUFS, typename MemOrder>
+struct NtbBenchMemOrder
+    : public NtbBenchBase
+{
+    typedef ntuplebuf::NTupleBufferControl<ControlCodeT, NBUFS, MemOrder> Control;
+
+    void run(const std::string& policy_name, unsigned bg_readers, unsigned long n){
+        std::atomic<bool> stop = {false};
+        std::vector<std::thread> bg;
+        for(unsigned i = 0; i < bg_readers; ++i){
+            bg.emplace_back([&](){
+                int b = 0;
+                while(!stop.load(std::memory_order_relaxed)){
+                    ctl_.start_reading(&b);
+                }
+                ctl_.free(&b);
+            });
+        }
+
+        std::string head = policy_name + " bg_readers=" + std::to_string(bg_readers);
+
+        int wb = 0;
+        report(head + " start_writing", ns_per_op(n, [&](){ ctl_.start_writing(&wb); }));
+
+        int rb = 0;
+        report(head + " start_reading+free", ns_per_op(n, [&](){
+            ctl_.start_reading(&rb);
+            ctl_.free(&rb);
+        }));
+
+        stop.store(true);
+        for(auto& t: bg){
+            t.join();
+        }
+        ctl_.commit(&wb);
+    }
+
+private:
+    Control ctl_;
+};
+
+
+int ntuplebuf_bench_memorder(unsigned long n = 2000000){
+    std::cout << "\n===== memory order policies =====\n";
+
+    for(unsigned bg: {0u, 2u}){
+        NtbBenchMemOrder<unsigned long, 7, ntuplebuf::MemOrderSeqCst>().run("seq_cst", bg, n);
+        NtbBenchMemOrder<unsigned long, 7, ntuplebuf::MemOrderAcqRel>().run("acq_rel", bg, n);
+        NtbBenchMemOrder<unsigned long, 7, ntuplebuf::NoWait<ntuplebuf::MemOrderAcqRel>>().run("acq_rel no wait", bg, n);
+    }
+
+    return 0;
+}
+
+
+struct NtbBenchConfig{
+    unsigned duration_ms = 100; // per measured case
+    std::vector<size_t> msg_sizes = {64, 4096, 65536};
+    unsigned max_readers = 4; // (also limited by NBUFS - 2)
+};
+
+
+/*
+One measured case: a producer thread (core 0) and `readers` consumer threads (cores 1, 2, ...)
+work on the same buffer for cfg.duration_ms. Every thread counts its own operations,
+so ns/op is the per-thread cost of one operation (pair) under that contention.
+ */
+template<typename ControlCodeT, unsigned NBUFS>
+struct NtbBenchDyn
+    : public NtbBenchBase
+{
+    typedef ntuplebuf::NTupleBufferDynAlloc<ControlCodeT, NBUFS> Buffer;
+
+    enum ProducerMode{
+        P_SIMPLE,  // start_writing
+        COMMIT,    // start_writing + commit
+        TRANSACT   // start_transaction + commit_transaction
+    };
+
+    enum ConsumerMode{
+        C_SIMPLE,  // start_reading
+        FREE,      // start_reading + free
+        CONSUME,   // start_reading + consume
+        POP        // pop
+    };
+
+    static const char* pm_name(ProducerMode pm){
+        static const char* names[] = {"start_writing", "start_writing+commit", "transaction"};
+        return names[pm];
+    }
+
+    static const char* cm_name(ConsumerMode cm){
+        static const char* names[] = {"start_reading", "start_reading+free", "start_reading+consume", "pop"};
+        return names[cm];
+    }
+
+    static void run_case(
+            const char* cc_name, const NtbBenchConfig& cfg, size_t size, unsigned readers,
+            ProducerMode pm, ConsumerMode cm
+    ){
+        Buffer buf(size);
+        std::atomic<bool> stop = {false};
+        std::atomic<unsigned> ready = {0};
+        std::vector<unsigned long> ops(readers + 1, 0);
+        std::vector<double> ns(readers + 1, 0.0);
+        std::vector<int> errors(readers + 1, 0);
+
+        auto timed = [&](unsigned idx, unsigned core, auto op){
+            pin_to_core(core);
+            ready++;
+            while(ready.load() <= readers){ // start all threads together
+                std::this_thread::yield();
+            }
+
+            unsigned long n = 0;
+            auto t0 = Clock::now();
+            while(!stop.load(std::memory_order_relaxed)){
+                int res = op();
+                if(res < 0){
+                    errors[idx] = res;
+                    break;
+                }
+                ++n;
+            }
+            auto t1 = Clock::now();
+            ops[idx] = n;
+            ns[idx] = n? std::chrono::duration<double, std::nano>(t1 - t0).count() / (double)n : 0.0;
+        };
+
+        std::vector<std::thread> threads;
+
+        threads.emplace_back([&](){
+            void* p = nullptr;
+            timed(0, 0, [&]() -> int {
+                if(pm == TRANSACT){
+                    for(;;){
+                        auto tra = buf.start_transaction();
+                        if(tra.errcode < 0){
+                            return tra.errcode;
+                        }
+                        if(tra.old_buf != nullptr){
+                            std::memcpy(tra.new_buf, tra.old_buf, size);
+                        }
+                        *static_cast<uint8_t*>(tra.new_buf) += 1;
+                        int res = buf.commit_transaction(tra, false);
+                        if(res <= 0){
+                            return res; // success or error
+                        }
+                        // collision: retry
+                    }
+                }
+
+                int res = buf.start_writing(&p);
+                if(res < 0){
+                    return res;
+                }
+                std::memset(p, (int)res, size);
+                return (pm == COMMIT)? buf.commit(&p) : 0;
+            });
+            buf.commit(&p);
+        });
+
+        for(unsigned r = 0; r < readers; ++r){
+            threads.emplace_back([&, r](){
+                void* p = nullptr;
+                unsigned sum = 0;
+                timed(r + 1, r + 1, [&]() -> int {
+                    int res = (cm == POP)? buf.pop(&p) : buf.start_reading(&p);
+                    if(res < 0){
+                        return res;
+                    }
+                    if(p != nullptr){
+                        sum += touch(p, size);
+                    }
+                    switch(cm){
+                    case FREE:
+                        return buf.free(&p);
+                    case CONSUME:
+                        return buf.consume(&p);
+                    default:
+                        return 0;
+                    }
+                });
+                buf.free(&p);
+                sink_ += sum;
+            });
+        }
+
+        while(ready.load() <= readers){
+            std::this_thread::yield();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(cfg.duration_ms));
+        stop.store(true);
+        for(auto& t: threads){
+            t.join();
+        }
+
+        double cons_ns = 0;
+        unsigned long cons_ops = 0;
+        int err = errors[0];
+        for(unsigned r = 1; r <= readers; ++r){
+            cons_ns += ns[r];
+            cons_ops += ops[r];
+            if(errors[r] < 0){
+                err = errors[r];
+            }
+        }
+        if(readers > 0){
+            cons_ns /= readers;
+        }
+
+        double secs = cfg.duration_ms / 1000.0;
+        std::cout
+            << cc_name << "," << NBUFS << "," << size << "," << readers << ","
+            << pm_name(pm) << "," << cm_name(cm) << ","
+            << ns[0] << "," << (unsigned long)(ops[0] / secs) << ","
+            << cons_ns << "," << (unsigned long)(cons_ops / secs) << ","
+            << err << "\n";
+    }
+
+    static void run_all(const char* cc_name, const NtbBenchConfig& cfg){
+        for(size_t size: cfg.msg_sizes){
+            for(unsigned readers = 1; readers <= cfg.max_readers && readers + 2 <= NBUFS; ++readers){
+                for(int pm = P_SIMPLE; pm <= TRANSACT; ++pm){
+                    for(int cm = C_SIMPLE; cm <= POP; ++cm){
+                        run_case(cc_name, cfg, size, readers, (ProducerMode)pm, (ConsumerMode)cm);
+                    }
+                }
+            }
+        }
+    }
+
+    static std::atomic<unsigned> sink_; // keeps reader loads alive
+};
+
+template<typename ControlCodeT, unsigned NBUFS>
+std::atomic<unsigned> NtbBenchDyn<ControlCodeT, NBUFS>::sink_ = {0};
+
+
+// runs NtbBenchDyn for NBUFS in [NB, NBMAX]
+template<typename ControlCodeT, unsigned NB, unsigned NBMAX>
+struct NtbBenchSweep{
+    static void run(const char* cc_name, const NtbBenchConfig& cfg){
+        NtbBenchDyn<ControlCodeT, NB>::run_all(cc_name, cfg);
+        NtbBenchSweep<ControlCodeT, NB + 1, NBMAX>::run(cc_name, cfg);
+    }
+};
+
+template<typename ControlCodeT, unsigned NBMAX>
+struct NtbBenchSweep<ControlCodeT, NBMAX, NBMAX>{
+    static void run(const char* cc_name, const NtbBenchConfig& cfg){
+        NtbBenchDyn<ControlCodeT, NBMAX>::run_all(cc_name, cfg);
+    }
+};
+
+
+int ntuplebuf_bench(const NtbBenchConfig& cfg = NtbBenchConfig()){
+    std::cout << "\n===== ntuple buffer operations =====\n"
+        << "ccode,nbufs,msg_size,readers,producer_op,consumer_op,"
+        << "prod_ns_op,prod_ops_s,cons_ns_op,cons_ops_s,error\n";
+
+    NtbBenchSweep<unsigned, 3, 7>::run("unsigned", cfg);
+    NtbBenchSweep<unsigned long, 3, 15>::run("unsigned long", cfg);
+
+    return 0;
+}
+
+
+/*
+Contention of control engines: `readers` threads poll (start_reading + free) while the producer
+publishes (start_writing + commit). Reports atomic RMW attempts per operation (1.0 means no retries)
+and ns/op for both sides.
+ */
+template<
+    template<typename, unsigned, typename> class ControlEngine,
+    typename ControlCodeT = unsigned long,
+    unsigned NBUFS = 15
+>
+struct NtbBenchRetries
+    : public NtbBenchBase
+{
+    typedef ControlEngine<ControlCodeT, NBUFS, ntuplebuf::MemOrderAcqRel> Control;
+
+    static void run(const char* engine_name, unsigned readers, unsigned duration_ms){
+        Control ctl;
+        std::atomic<bool> stop = {false};
+        std::atomic<unsigned> ready = {0};
+        std::vector<unsigned long> ops(readers + 1, 0);
+        std::vector<unsigned long> attempts(readers + 1, 0);
+        std::vector<double> ns(readers + 1, 0.0);
+
+        auto timed = [&](unsigned idx, auto op){
+            pin_to_core(idx);
+            ready++;
+            while(ready.load() <= readers){
+                std::this_thread::yield();
+            }
+
+            unsigned long n = 0;
+            ntb_bench_rmw_attempts = 0;
+            auto t0 = Clock::now();
+            while(!stop.load(std::memory_order_relaxed)){
+                op();
+                ++n;
+            }
+            auto t1 = Clock::now();
+            ops[idx] = n;
+            attempts[idx] = ntb_bench_rmw_attempts;
+            ns[idx] = n? std::chrono::duration<double, std::nano>(t1 - t0).count() / (double)n : 0.0;
+        };
+
+        std::vector<std::thread> threads;
+        threads.emplace_back([&](){
+            int b = 0;
+            timed(0, [&](){
+                ctl.start_writing(&b);
+                ctl.commit(&b);
+            });
+        });
+
+        for(unsigned r = 1; r <= readers; ++r){
+            threads.emplace_back([&, r](){
+                int b = 0;
+                timed(r, [&](){
+                    ctl.start_reading(&b);
+                    ctl.free(&b);
+                });
+            });
+        }
+
+        while(ready.load() <= readers){
+            std::this_thread::yield();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms));
+        stop.store(true);
+        for(auto& t: threads){
+            t.join();
+        }
+
+        unsigned long cons_ops = 0;
+        unsigned long cons_attempts = 0;
+        double cons_ns = 0;
+        for(unsigned r = 1; r <= readers; ++r){
+            cons_ops += ops[r];
+            cons_attempts += attempts[r];
+            cons_ns += ns[r];
+        }
+
+        // per operation pair (2 operations):
+        auto per_op = [](unsigned long att, unsigned long n){ return n? (double)att / (2.0 * n) : 0.0; };
+
+        std::cout
+            << engine_name << "," << readers << ","
+            << per_op(attempts[0], ops[0]) << "," << ns[0] << ","
+            << per_op(cons_attempts, cons_ops) << "," << cons_ns / readers << "\n";
+    }
+};
+
+
+int ntuplebuf_bench_retries(unsigned duration_ms = 200){
+    std::cout << "\n===== control engines under contention =====\n"
+        << "engine,readers,prod_rmw_per_op,prod_ns_pair,cons_rmw_per_op,cons_ns_pair\n";
+
+    for(unsigned readers: {1u, 2u, 4u, 8u, 12u}){
+        NtbBenchRetries<ntuplebuf::NTupleBufferControl>::run("cas", readers, duration_ms);
+        NtbBenchRetries<ntuplebuf::NTupleBufferControlFA>::run("fetch_add", readers, duration_ms);
+    }
+
+    return 0;
+}
+
+
+// Control word width: auto-selected (smallest lock-free) vs. fixed 32/64-bit vs. 128-bit (double-width CAS)
+// control words for the same number of buffers (CSV as for ntuplebuf_bench_retries).
+int ntuplebuf_bench_ccode(unsigned duration_ms = 200){
+    using namespace ntuplebuf;
+    std::cout << "\n===== control word width =====\n"
+        << "auto(3 buffers): " << sizeof(NTupleBufferControl<AutoControlCode, 3>::CCodeT) * CHAR_BIT << " bits\n"
+        << "engine,readers,prod_rmw_per_op,prod_ns_pair,cons_rmw_per_op,cons_ns_pair\n";
+
+    NtbBenchRetries<NTupleBufferControl, AutoControlCode, 3>::run("auto_3", 1, duration_ms);
+    NtbBenchRetries<NTupleBufferControl, uint32_t, 3>::run("u32_3", 1, duration_ms);
+    NtbBenchRetries<NTupleBufferControl, uint64_t, 3>::run("u64_3", 1, duration_ms);
+
+    for(unsigned readers: {1u, 4u, 12u}){
+        NtbBenchRetries<NTupleBufferControl, uint64_t, 15>::run("u64_15", readers, duration_ms);
+#       if DWCAS_ntuplebuf
+        NtbBenchRetries<NTupleBufferControl, uint128_t, 15>::run("u128_15", readers, duration_ms);
+#       endif
+    }
+
+#   if DWCAS_ntuplebuf
+    NtbBenchRetries<NTupleBufferControl, AutoControlCode, 24>::run("u128_24", 22, duration_ms);
+#   endif
+
+    return 0;
+}
+
+
+// Field kernels of the control word (SWAR vs. loop versions) on random words,
+// so that the loop versions can not benefit from branch prediction.
+template<typename ControlCodeT, unsigned NBUFS>
+struct NtbBenchFields
+    : public NtbBenchBase
+{
+    typedef ntuplebuf::ControlWordFields<ControlCodeT, NBUFS> F;
+
+    static void run(const std::string& name, unsigned long n){
+        std::vector<ControlCodeT> words(4096);
+        std::vector<int> bufnums(4096);
+        unsigned long long r = 88172645463325252ull;
+        for(size_t i = 0; i < words.size(); ++i){
+            ControlCodeT cco = 0;
+            for(unsigned f = 0; f <= NBUFS; ++f){
+                r ^= r << 13; r ^= r >> 7; r ^= r << 17; // xorshift
+                cco |= (ControlCodeT)((r % (NBUFS + 1)) & F::count_mask) << (f * F::count_bitsize);
+            }
+            words[i] = cco;
+            bufnums[i] = (int)(r % NBUFS) + 1;
+        }
+
+        size_t mask = words.size() - 1;
+        size_t i = 0;
+        int acc = 0;
+
+        report(name + " find_new swar", ns_per_op(n, [&](){ acc += F::find_new(words[++i & mask]); }));
+        report(name + " find_new loop", ns_per_op(n, [&](){ acc += F::find_new_loop(words[++i & mask]); }));
+        report(name + " inc+dec swar", ns_per_op(n, [&](){
+            ControlCodeT c = words[++i & mask];
+            acc += F::inc_ref(c, bufnums[i & mask]) + F::dec_ref(c, bufnums[(i + 1) & mask]) + (int)(c & 1);
+        }));
+        report(name + " inc+dec loop", ns_per_op(n, [&](){
+            ControlCodeT c = words[++i & mask];
+            acc += F::inc_ref_loop(c, bufnums[i & mask]) + F::dec_ref_loop(c, bufnums[(i + 1) & mask]) + (int)(c & 1);
+        }));
+
+        sink_ += (unsigned)acc;
+    }
+
+    static std::atomic<unsigned> sink_;
+};
+
+template<typename ControlCodeT, unsigned NBUFS>
+std::atomic<unsigned> NtbBenchFields<ControlCodeT, NBUFS>::sink_ = {0};
+
+
+int ntuplebuf_bench_fields(unsigned long n = 20000000){
+    std::cout << "\n===== control word field kernels =====\n";
+
+    NtbBenchFields<uint8_t, 3>::run("u8/3", n);
+    NtbBenchFields<uint32_t, 7>::run("u32/7", n);
+    NtbBenchFields<uint64_t, 15>::run("u64/15", n);
+#   if defined(__SIZEOF_INT128__)
+    NtbBenchFields<ntuplebuf::uint128_t, 24>::run("u128/24", n);
+#   endif
+
+    return 0;
+}
+
+
+// Slot policies with heap-owning messages: start_writing + fill + commit and
+// start_transaction + modify + commit_transaction (single thread, so allocation cost dominates).
+struct NtbBenchSlotMsg{
+    unsigned count = 0;
+    std::string name;
+    std::vector<int> samples;
+};
+
+struct NtbBenchSlotReset{
+    void operator()(NtbBenchSlotMsg& m) const{ m.samples.clear(); } // (keeps capacity)
+};
+
+template<typename SlotPolicy>
+struct NtbBenchSlots
+    : public NtbBenchBase
+{
+    typedef ntuplebuf::NTupleBufferDynAllocTyped<
+        unsigned, 3, NtbBenchSlotMsg, ntuplebuf::MemOrderSeqCst, ntuplebuf::NTupleBufferControl, SlotPolicy
+    > Buf;
+
+    static void run(const std::string& name, unsigned long n){
+        Buf buf;
+        NtbBenchSlotMsg* p = nullptr;
+        unsigned count = 0;
+
+        report(name + " write+commit", ns_per_op(n, [&](){
+            buf.start_writing(&p);
+            p->count = ++count;
+            p->name.assign(100, 'n');
+            p->samples.assign(256, (int)count);
+            buf.commit(&p);
+        }));
+
+        report(name + " transaction", ns_per_op(n, [&](){
+            auto tra = buf.start_transaction();
+            if(tra.old_buf != nullptr && !std::is_same<SlotPolicy, ntuplebuf::SlotCopyFromOld>::value){
+                *tra.new_buf = *tra.old_buf; // (assignment reuses the capacity of a recycled object)
+            }
+            tra.new_buf->count = ++count;
+            tra.new_buf->samples[count & 255] = (int)count;
+            buf.commit_transaction(tra, false);
+        }));
+    }
+};
+
+
+int ntuplebuf_bench_slots(unsigned long n = 1000000){
+    std::cout << "\n===== slot policies (100 chars + 256 ints per message) =====\n";
+
+    NtbBenchSlots<ntuplebuf::SlotReconstruct>::run("reconstruct", n);
+    NtbBenchSlots<ntuplebuf::SlotRecycle<NtbBenchSlotReset>>::run("recycle", n);
+    NtbBenchSlots<ntuplebuf::SlotCopyFromOld>::run("copy from old", n);
+
+    return 0;
+}
+
+
+// Large message transactions changing a small part of the message: whole copy of the old message
+// vs. copy-on-write chunks (single thread; the chunked cost shall follow the changed size).
+int ntuplebuf_bench_chunks(unsigned long n = 2000){
+    std::cout << "\n===== chunked transactions (4 MB message, 4 KB chunks) =====\n";
+
+    const size_t size = 4 << 20;
+    ntuplebuf::NTupleBufferDynAlloc<unsigned, 4> buf(size, 4096);
+    buf.set_chunk_size(4096);
+    unsigned count = 0;
+
+    NtbBenchBase::report("whole copy, 4 KB changed", NtbBenchBase::ns_per_op(n, [&](){
+        auto tra = buf.start_transaction();
+        if(tra.old_buf != nullptr){
+            std::memcpy(tra.new_buf, tra.old_buf, size);
+        }
+        ++count;
+        std::memset((uint8_t*)tra.new_buf + (count % 1024) * 4096, (int)count, 4096);
+        buf.commit_transaction(tra, false);
+    }));
+
+    for(size_t changed: {4096ul, 65536ul, 1ul << 20}){
+        NtbBenchBase::report(
+                "chunked, " + std::to_string(changed >> 10) + " KB changed",
+                NtbBenchBase::ns_per_op(n, [&](){
+                    auto tra = buf.start_chunked_transaction();
+                    size_t off = (++count * changed) % size; // (the chunks changed NBUFS - 1 commits ago are copied too)
+                    std::memset(buf.write_chunks(tra, off, changed), (int)count, changed);
+                    buf.commit_chunked_transaction(tra, false);
+                })
+        );
+    }
+
+    return 0;
+}
+
+
+// "What changed since the last cycle" over 20000 topics with 200 of them committed per cycle:
+// polling every topic (start_reading_once) vs. the "changed" bitmap of the bank.
+int ntuplebuf_bench_bank(unsigned long cycles = 2000){
+    std::cout << "\n===== bank: 20000 topics, 200 changed per cycle =====\n";
+
+    const size_t ntopics = 20000;
+    const size_t nchanged = 200;
+    ntuplebuf::NTupleBufferBank<unsigned, 3> bank(ntopics, 64);
+    std::vector<ntuplebuf::NTupleBufferBank<unsigned, 3>::gen_t> gens(ntopics, 0);
+    std::vector<void*> ptrs(ntopics, nullptr);
+    size_t next = 0;
+    unsigned long visited = 0;
+
+    auto commit_some = [&](){
+        for(size_t i = 0; i < nchanged; ++i){
+            size_t topic = (next += 7919) % ntopics; // (scattered)
+            void* p = nullptr;
+            bank.start_writing(topic, &p);
+            bank.commit(topic, &p);
+        }
+    };
+
+    double ns_commit = NtbBenchBase::ns_per_op(cycles, commit_some);
+
+    double ns_poll = NtbBenchBase::ns_per_op(cycles, [&](){
+        commit_some();
+        for(size_t t = 0; t < ntopics; ++t){
+            if(bank.start_reading_once(t, &ptrs[t], &gens[t]) > 0){
+                ++visited;
+            }
+        }
+    });
+
+    bank.for_each_changed(0, [](size_t){});
+    double ns_bitmap = NtbBenchBase::ns_per_op(cycles, [&](){
+        commit_some();
+        bank.for_each_changed(0, [&](size_t t){
+            bank.start_reading(t, &ptrs[t]);
+            ++visited;
+        });
+    });
+
+    NtbBenchBase::report("poll all topics", ns_poll - ns_commit);
+    NtbBenchBase::report("changed bitmap", ns_bitmap - ns_commit);
+
+    for(size_t t = 0; t < ntopics; ++t){
+        bank.free(t, &ptrs[t]);
+    }
+    return visited == 0;
+}
+
+
+/*
+Slot layout: small messages (so that neighbouring slots share cache lines with max_align_t alignment)
+read by several consumers while the producer writes continuously; slot alignment and prefetch vary.
+ns per consumer start_reading + touch + free.
+ */
+struct NtbBenchLayout
+    : public NtbBenchBase
+{
+    typedef ntuplebuf::NTupleBufferDynAlloc<unsigned long, 7> Buffer;
+
+    static void run(size_t msg_size, size_t slot_align, unsigned prefetch, unsigned readers, unsigned duration_ms){
+        Buffer buf(msg_size, slot_align);
+        buf.set_prefetch_lines(prefetch);
+
+        std::atomic<bool> stop = {false};
+        std::atomic<unsigned> ready = {0};
+        std::vector<double> ns(readers, 0.0);
+
+        std::vector<std::thread> threads;
+        threads.emplace_back([&](){
+            pin_to_core(0);
+            ++ready;
+            void* p = nullptr;
+            unsigned char v = 0;
+            while(!stop.load(std::memory_order_relaxed)){
+                buf.start_writing(&p);
+                std::memset(p, ++v, msg_size);
+                buf.commit(&p);
+            }
+        });
+
+        for(unsigned r = 0; r < readers; ++r){
+            threads.emplace_back([&, r](){
+                pin_to_core(r + 1);
+                ++ready;
+                while(ready.load() <= readers){
+                    std::this_thread::yield();
+                }
+
+                void* p = nullptr;
+                unsigned sum = 0;
+                unsigned long n = 0;
+                auto t0 = Clock::now();
+                while(!stop.load(std::memory_order_relaxed)){
+                    buf.start_reading(&p);
+                    if(p != nullptr){
+                        sum += touch(p, msg_size);
+                    }
+                    buf.free(&p);
+                    ++n;
+                }
+                auto t1 = Clock::now();
+                ns[r] = n? std::chrono::duration<double, std::nano>(t1 - t0).count() / (double)n : 0.0;
+                sink_ += sum;
+            });
+        }
+
+        while(ready.load() <= readers){
+            std::this_thread::yield();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms));
+        stop.store(true);
+        for(auto& t: threads){
+            t.join();
+        }
+
+        double avg = 0;
+        for(double x: ns){
+            avg += x;
+        }
+
+        std::cout << msg_size << "," << slot_align << "," << prefetch << "," << readers << ","
+                  << avg / readers << "\n";
+    }
+
+    static std::atomic<unsigned> sink_;
+};
+
+std::atomic<unsigned> NtbBenchLayout::sink_ = {0};
+
+
+int ntuplebuf_bench_layout(unsigned duration_ms = 200){
+    std::cout << "\n===== slot layout =====\n"
+        << "msg_size,slot_align,prefetch_lines,readers,cons_ns_op\n";
+
+    for(size_t msg_size: {16u, 48u, 200u}){
+        for(size_t slot_align: {(size_t)alignof(std::max_align_t), ntuplebuf::cache_line_size, (size_t)128, (size_t)4096}){
+            for(unsigned prefetch: {0u, 2u}){
+                NtbBenchLayout::run(msg_size, slot_align, prefetch, 4, duration_ms);
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+Fan-out through relays: root buffer -> 4 relays -> 16 sub-relays -> consumers (up to 13 per sub-relay).
+Per-consumer cost of start_reading + free and RMW attempts per operation (contention on group words),
+and the producer's cost of start_writing + commit on the root word, as the number of consumers grows.
+ */
+struct NtbBenchFanout
+    : public NtbBenchBase
+{
+    typedef ntuplebuf::NTupleBufferDynAlloc<unsigned long, 15> Root;
+    typedef ntuplebuf::NTupleBufferRelay<Root, unsigned long, 15> Relay1;
+    typedef ntuplebuf::NTupleBufferRelay<Relay1, unsigned long, 15> Relay2;
+
+    enum{ N_RELAYS1 = 4, N_RELAYS2 = 16, GROUP_SIZE = 13 };
+
+    static void run(unsigned consumers, unsigned duration_ms){
+        Root root(64);
+        std::vector<std::unique_ptr<Relay1>> relays1;
+        std::vector<std::unique_ptr<Relay2>> relays2;
+        for(unsigned i = 0; i < N_RELAYS1; ++i){
+            relays1.emplace_back(new Relay1(root));
+        }
+        for(unsigned i = 0; i < N_RELAYS2; ++i){
+            relays2.emplace_back(new Relay2(*relays1[i % N_RELAYS1]));
+        }
+
+        consumers = std::min(consumers, (unsigned)(N_RELAYS2 * GROUP_SIZE));
+
+        std::atomic<bool> stop = {false};
+        std::atomic<unsigned> ready = {0};
+        std::vector<unsigned long> ops(consumers + 1, 0);
+        std::vector<unsigned long> attempts(consumers + 1, 0);
+        std::vector<double> ns(consumers + 1, 0.0);
+
+        auto timed = [&](unsigned idx, auto op){
+            pin_to_core(idx);
+            ready++;
+            while(ready.load() <= consumers){
+                std::this_thread::yield();
+            }
+
+            unsigned long n = 0;
+            ntb_bench_rmw_attempts = 0;
+            auto t0 = Clock::now();
+            while(!stop.load(std::memory_order_relaxed)){
+                op();
+                ++n;
+            }
+            auto t1 = Clock::now();
+            ops[idx] = n;
+            attempts[idx] = ntb_bench_rmw_attempts;
+            ns[idx] = n? std::chrono::duration<double, std::nano>(t1 - t0).count() / (double)n : 0.0;
+        };
+
+        std::vector<std::thread> threads;
+        auto relay_loop = [&](auto* relay){
+            while(!stop.load(std::memory_order_relaxed)){
+                relay->update_wait(std::chrono::milliseconds(1));
+            }
+        };
+        for(auto& r: relays1){
+            threads.emplace_back([&, r = r.get()](){ relay_loop(r); });
+        }
+        for(auto& r: relays2){
+            threads.emplace_back([&, r = r.get()](){ relay_loop(r); });
+        }
+
+        threads.emplace_back([&](){
+            void* p = nullptr;
+            unsigned long v = 0;
+            timed(0, [&](){
+                root.start_writing(&p);
+                std::memcpy(p, &++v, sizeof(v));
+                root.commit(&p);
+            });
+        });
+
+        for(unsigned c = 1; c <= consumers; ++c){
+            threads.emplace_back([&, c](){
+                Relay2& group = *relays2[(c - 1) % N_RELAYS2];
+                void* p = nullptr;
+                unsigned sum = 0;
+                timed(c, [&](){
+                    group.start_reading(&p);
+                    if(p != nullptr){
+                        sum += touch(p, 64);
+                    }
+                    group.free(&p);
+                });
+                sink_ += sum;
+            });
+        }
+
+        while(ready.load() <= consumers){
+            std::this_thread::yield();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms));
+        stop.store(true);
+        for(auto& t: threads){
+            t.join();
+        }
+
+        unsigned long cons_ops = 0;
+        unsigned long cons_attempts = 0;
+        double cons_ns = 0;
+        for(unsigned c = 1; c <= consumers; ++c){
+            cons_ops += ops[c];
+            cons_attempts += attempts[c];
+            cons_ns += ns[c];
+        }
+
+        unsigned long lagged = 0;
+        for(auto& r: relays2){
+            lagged += r->lagged();
+        }
+
+        auto per_op = [](unsigned long att, unsigned long n){ return n? (double)att / (2.0 * n) : 0.0; };
+
+        std::cout
+            << consumers << ","
+            << per_op(attempts[0], ops[0]) << "," << ns[0] << ","
+            << per_op(cons_attempts, cons_ops) << "," << cons_ns / consumers << ","
+            << lagged << "\n";
+    }
+
+    static std::atomic<unsigned> sink_;
+};
+
+std::atomic<unsigned> NtbBenchFanout::sink_ = {0};
+
+
+int ntuplebuf_bench_fanout(unsigned duration_ms = 300){
+    std::cout << "\n===== fan-out through relays =====\n"
+        << "consumers,prod_rmw_per_op,prod_ns_pair,cons_rmw_per_op,cons_ns_pair,relay_lagged\n";
+
+    for(unsigned consumers: {13u, 52u, 104u, 208u}){
+        NtbBenchFanout::run(consumers, duration_ms);
+    }
+
+    return 0;
+}
+
+
+#endif
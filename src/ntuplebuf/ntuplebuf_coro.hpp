@@ -0,0 +1,147 @@
+#ifndef ntuplebuf_coro_hpp
+#define ntuplebuf_coro_hpp
+
+/*
+C++20 coroutine reader of an ntuple buffer (NTupleBufferDynAlloc, NTupleBufferDynAllocTyped, NTupleBufferShm):
+co_await next() suspends the coroutine until a newer message is committed, then it is resumed
+on the executor with the read handle referencing the message.
+
+    NTupleBufferCoReader<decltype(buf), Pool> reader(buf, pool);  // Pool: void post(std::coroutine_handle<>)
+    for(;;){
+        int res = co_await reader.next();  // 1: new message in reader.handle(), negative: error
+        if(res < 0) break;
+        if(res > 0) use(reader.handle().get());
+    }
+
+The waiting coroutine queues a WaitNode of the control engine (see wait_async()); the producer publishing
+the update posts it to the executor in its commit(), with no syscall on the buffer side (a pool queueing
+the coroutine in memory of the process adds none either, if its worker is awake). While nobody waits,
+commits cost nothing more than before. InlineExecutor resumes the coroutine in the producer's commit().
+
+next() returns 0 (nothing new, co_await again) only if the new message was taken by pop() / consume()
+of another consumer before the resumed coroutine referenced it.
+A coroutine suspended in next() shall not be destroyed while producers commit (destroying it cancels the wait).
+
+Compiled only where coroutines are available (CORO_ntuplebuf is defined then).
+ */
+
+#include "ntuplebuf.hpp"
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#   if __has_include(<coroutine>)
+#       define CORO_ntuplebuf
+#   endif
+#endif
+
+#ifdef CORO_ntuplebuf
+
+#include <coroutine>
+
+
+namespace ntuplebuf {
+
+
+struct InlineExecutor
+{
+    void post(std::coroutine_handle<> h){ h.resume(); }
+};
+
+
+template<typename Buffer, typename Executor = InlineExecutor>
+struct NTupleBufferCoReader
+{
+    typedef int errcode_t;
+    typedef typename Buffer::ReadHandle ReadHandle;
+    typedef typename Buffer::gen_t gen_t;
+
+    struct NextAwaiter
+        : public WaitNode
+    {
+        explicit NextAwaiter(NTupleBufferCoReader* reader)
+            : reader_(reader)
+        {
+            fire = &NextAwaiter::on_fire;
+        }
+
+        NextAwaiter(const NextAwaiter&) = delete;
+        NextAwaiter& operator=(const NextAwaiter&) = delete;
+
+        ~NextAwaiter(){
+            if(queued_){
+                reader_->control().cancel_wait_async(this);
+            }
+        }
+
+        bool await_ready(){
+            res_ = reader_->read();
+            return res_ != 0;
+        }
+
+        bool await_suspend(std::coroutine_handle<> h){
+            co_ = h;
+            queued_ = true;
+            if(reader_->control().wait_async(this, reader_->h_.bufnum()) == 0){
+                queued_ = false;
+                return false; // updated meanwhile: resume at once
+            }
+            return true; // (the awaiter may be gone already: on_fire() may have resumed the coroutine)
+        }
+
+        errcode_t await_resume(){
+            return (res_ != 0)? res_ : reader_->read();
+        }
+
+    private:
+        static void on_fire(WaitNode* n){ // (the producer's thread)
+            NextAwaiter* self = static_cast<NextAwaiter*>(n);
+            self->queued_ = false;
+            self->reader_->exec_.post(self->co_);
+        }
+
+        NTupleBufferCoReader* reader_;
+        std::coroutine_handle<> co_;
+        errcode_t res_ = 0;
+        bool queued_ = false;
+    };
+
+
+    NTupleBufferCoReader(Buffer& buf, Executor& exec)
+        : buf_(buf), exec_(exec)
+    {}
+
+    NTupleBufferCoReader(const NTupleBufferCoReader&) = delete;
+    NTupleBufferCoReader& operator=(const NTupleBufferCoReader&) = delete;
+
+    // co_await next(): 1 if a newer message is referenced by handle(), 0 if nothing new, negative on error
+    NextAwaiter next(){ return NextAwaiter(this); }
+
+    ReadHandle& handle(){ return h_; } // (keeps the message referenced until the next read)
+
+
+private:
+    typename Buffer::ControlCode& control(){ return buf_.get_control(); }
+
+    errcode_t read(){
+        int res = buf_.start_reading(h_);
+        if(res < 0){
+            return res;
+        }
+        if(h_ && h_.generation() > seen_){
+            seen_ = h_.generation();
+            return 1;
+        }
+        return 0;
+    }
+
+    Buffer& buf_;
+    Executor& exec_;
+    ReadHandle h_;
+    gen_t seen_ = 0;
+};
+
+
+} // namespace
+
+#endif // CORO_ntuplebuf
+
+#endif
@@ -4,26 +4,39 @@
 /*
 N-tuple buffer with dynamically allocated memory for messages.
 The memory is allocated at construction time as zero-initialized byte array.
-Every message buffer is aligned as std::max_align_t, so it is suitable for
-almost all data types
+Every message buffer is aligned as std::max_align_t by default, so it is suitable for
+almost all data types. Larger slot alignment (cache line, page) may be passed to constructor
+to keep messages from sharing cache lines.
+The control structure occupies its own cache line(s), so CASes on it do not bounce
+the line with data pointers needed by readers.
  */
 
 
 #include "ntuplebuf.hpp"
+#include "ntuplebuf_handle.hpp"
+#include "ntuplebuf_slot.hpp"
 #include <cstddef>
-#include  <algorithm> // std::min
+#include <cstdint>
+#include <cstring> // std::memcpy
+#include  <algorithm> // std::min, std::max
 
 namespace ntuplebuf {
 
 /**
  * Buffer data as byte array (typeless)
  */
-template<typename ControlCodeT, unsigned NBUFS>
+template<
+    typename ControlCodeT,
+    unsigned NBUFS,
+    typename MemOrder = MemOrderSeqCst,
+    template<typename, unsigned, typename> class ControlEngine = NTupleBufferControl // or NTupleBufferControlFA
+>
 struct NTupleBufferDynAlloc
 {
     typedef int errcode_t;
-    typedef  NTupleBufferControl<ControlCodeT, NBUFS> ControlCode;
+    typedef  ControlEngine<ControlCodeT, NBUFS, MemOrder> ControlCode;
     typedef typename ControlCode::Transaction CCTransaction;
+    typedef typename ControlCode::gen_t gen_t;
 
     struct TypelessTransacion{
       errcode_t errcode;
@@ -31,25 +44,45 @@ struct NTupleBufferDynAlloc
       void* new_buf;
     };
 
-    NTupleBufferDynAlloc(size_t data_size)
+    struct ChunkedTransaction{ // (see set_chunk_size())
+      errcode_t errcode;
+      void* old_buf;
+      void* new_buf;
+      uint64_t version; // of chunks written by the transaction
+    };
+
+    // handles keep both bufnum and pointer (see ntuplebuf_handle.hpp)
+    typedef NTupleBufferReadHandle<NTupleBufferDynAlloc, void> ReadHandle;
+    typedef NTupleBufferWriteHandle<NTupleBufferDynAlloc, void> WriteHandle;
+
+    NTupleBufferDynAlloc(
+            size_t data_size,
+            size_t slot_align = alignof(std::max_align_t) // power of 2, e.g. cache_line_size or 4096
+    )
         : data_size_(data_size) // size of one buffer as passed to ctor
     {
-        size_t algn = alignof(std::max_align_t); // provide maximum alignment
+        size_t algn = std::max(slot_align, alignof(std::max_align_t)); // provide (at least) maximum alignment
         sz1buf_ = ((data_size + algn -1) / algn) * algn; //size of one buffer (as allocated)
-        data_ = new uint8_t[NBUFS * sz1buf_](); // zero-initialized
+        raw_ = new uint8_t[NBUFS * sz1buf_ + algn](); // zero-initialized
+        data_ = raw_ + (algn - (uintptr_t)raw_ % algn) % algn;
     }
 
     ~NTupleBufferDynAlloc(){
-        delete[] data_;
+        delete[] raw_;
+        delete[] chunk_vers_;
     }
 
     size_t get_data_size(){ return data_size_; };
 
+    // number of cache lines of a buffer prefetched by start_reading/start_writing & Co (0 disables)
+    void set_prefetch_lines(unsigned n){ prefetch_lines_ = n; }
+
     errcode_t start_reading(void** pptr){ // pptr shall point to previous pointer to buffer (or nullptr)
         int bufnum = ptr2bufnum(*pptr);
         auto res = er(control.start_reading(&bufnum));
         if(res >= 0){
             *pptr = bufnum2ptr(bufnum);
+            prefetch(*pptr, false);
         }
         return res;
     }
@@ -59,10 +92,79 @@ struct NTupleBufferDynAlloc
         auto res = er(control.pop(&bufnum));
         if(res >= 0){
             *pptr = bufnum2ptr(bufnum);
+            prefetch(*pptr, false);
         }
         return res;
     }
 
+    // the same as above, also return generation (commit sequence number) of the buffer
+
+    errcode_t start_reading(void** pptr, gen_t* p_gen){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control.start_reading(&bufnum, p_gen));
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+            prefetch(*pptr, false);
+        }
+        return res;
+    }
+
+    errcode_t pop(void** pptr, gen_t* p_gen){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control.pop(&bufnum, p_gen));
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+            prefetch(*pptr, false);
+        }
+        return res;
+    }
+
+    // "read-once" start_reading() (see NTupleBufferControl::start_reading_once());
+    // *pptr is not changed if the current generation is already seen
+    int // returns 1 if new data, 0 if no (new) data, negative on error
+    start_reading_once(void** pptr, gen_t* p_gen_seen){
+        int bufnum = ptr2bufnum(*pptr);
+        int res = control.start_reading_once(&bufnum, p_gen_seen);
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+        }
+        if(res > 0){
+            prefetch(*pptr, false);
+        }
+        return (res > 0)? 1 : res;
+    }
+
+    gen_t generation(void* ptr){ return control.generation(ptr2bufnum(ptr)); }
+    uint64_t commit_time(void* ptr){ return control.commit_time(ptr2bufnum(ptr)); } // (see ntuplebuf_time.hpp)
+    CommitOrder order(void* ptr){ return control.order(ptr2bufnum(ptr)); }
+
+    ControlCode& get_control(){ return control; } // (e.g. commit time histograms: get_control().times())
+
+    // blocking variant of start_reading(): waits for a buffer other than *pptr to be committed
+    // (see NTupleBufferControl::start_reading_wait())
+    errcode_t start_reading_wait(
+            void** pptr,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control.start_reading_wait(&bufnum, timeout));
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+            prefetch(*pptr, false);
+        }
+        return res;
+    }
+
+    int // returns 1 if updated, 0 on timeout
+    wait_for_update(
+            void* ptr_seen,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        return control.wait_for_update(ptr2bufnum(ptr_seen), timeout);
+    }
+
+    void set_wait_spin(unsigned spin){ control.set_wait_spin(spin); }
+
     errcode_t free(void** pptr){
         int bufnum = ptr2bufnum(*pptr);
         auto res = er(control.free(&bufnum));
@@ -86,6 +188,10 @@ struct NTupleBufferDynAlloc
         auto res = er(control.start_writing(&bufnum));
         if(res >= 0){
             *pptr = bufnum2ptr(bufnum);
+            prefetch(*pptr, true);
+            invalidate_chunks(bufnum);
+        }else if(bufnum == 0){
+            *pptr = nullptr; // committed, but no free buffer (NTupleBufferControlFA)
         }
         return res;
     }
@@ -108,6 +214,9 @@ struct NTupleBufferDynAlloc
                 bufnum2ptr(tr.new_buf),
         };
 
+        prefetch(ret.old_buf, false);
+        prefetch(ret.new_buf, true);
+        invalidate_chunks(tr.new_buf);
         return ret;
     }
 
@@ -127,12 +236,196 @@ struct NTupleBufferDynAlloc
         return res;
     }
 
+    // multi-producer "latest value" commit: rejected (returns 1) unless order is newer than the current one
+    // (see NTupleBufferControl::commit_ordered())
+    errcode_t commit_ordered(TypelessTransacion& tra, CommitOrder order){
+        if(tra.errcode != 0){
+            return -91;
+        }
+
+        CCTransaction cctra = {
+                0,
+                ptr2bufnum(tra.old_buf),
+                ptr2bufnum(tra.new_buf)
+        };
+
+        return control.commit_ordered(cctra, order);
+    }
+
+
+    /*
+    Copy-on-write transactions of large messages.
+    Messages are divided into chunks of chunk_size bytes; every slot keeps the version of each of its chunks
+    (the same version means the same contents). The writer declares the ranges it writes by write_chunks(),
+    commit_chunked_transaction() copies the other chunks from the old message, skipping the chunks which
+    the new buffer already holds from an earlier generation. So the cost of a transaction depends on
+    how much of the message changed since the new buffer was written last time, not on the message size
+    (with NBUFS buffers a slot is reused every NBUFS - 1 commits or so).
+    start_writing() and start_transaction() invalidate the chunks of their buffer (writer may change anything).
+    set_chunk_size() shall be called before writing (or while no writer is active).
+    */
+
+    errcode_t set_chunk_size(size_t chunk_size){ // power of 2
+        if(chunk_size == 0 || (chunk_size & (chunk_size - 1)) != 0){
+            return -93;
+        }
+
+        chunk_shift_ = (unsigned)lowest_bit(chunk_size);
+        nchunks_ = (data_size_ + chunk_size - 1) >> chunk_shift_;
+
+        delete[] chunk_vers_;
+        chunk_vers_ = new uint64_t[NBUFS * nchunks_ + 1]; // (+ 1: no zero size array)
+        for(unsigned b = 1; b <= NBUFS; ++b){
+            invalidate_chunks(b); // (contents of buffers are unknown)
+        }
+        return 0;
+    }
+
+    ChunkedTransaction start_chunked_transaction(){
+        if(chunk_vers_ == nullptr){
+            ChunkedTransaction err = {-94, nullptr, nullptr, 0};
+            return err;
+        }
+
+        CCTransaction tr = control.start_transaction();
+        ChunkedTransaction ret = {
+                tr.errcode,
+                bufnum2ptr(tr.old_buf),
+                bufnum2ptr(tr.new_buf),
+                next_chunk_ver_.fetch_add(1, std::memory_order_relaxed)
+        };
+        return ret;
+    }
+
+    // declares [offset, offset + size) as written by the transaction; the chunks of the range are brought
+    // up to the old message first, so the range may be written partially
+    void* // returns pointer to offset in the new buffer (nullptr on error)
+    write_chunks(ChunkedTransaction& tra, size_t offset, size_t size){
+        if(tra.errcode != 0 || offset > data_size_ || size > data_size_ - offset){
+            return nullptr;
+        }
+
+        if(size > 0){
+            sync_chunks(tra, offset >> chunk_shift_, ((offset + size - 1) >> chunk_shift_) + 1, true);
+        }
+        return (uint8_t*)tra.new_buf + offset;
+    }
+
+    int // returns 0 on success, 1 on failure (see commit_transaction()), negative on error
+    commit_chunked_transaction(ChunkedTransaction& tra, bool force){
+        if(tra.errcode != 0){
+            return -91;
+        }
+
+        sync_chunks(tra, 0, nchunks_, false); // the chunks not written
+
+        CCTransaction cctra = {
+                0,
+                ptr2bufnum(tra.old_buf),
+                ptr2bufnum(tra.new_buf)
+        };
+
+        return control.commit_transaction(cctra, force);
+    }
+
+
+    // the same with handles (no pointer <-> bufnum conversion, the handle releases itself):
+
+    errcode_t start_reading(ReadHandle& h){ return read_h(h, this, HOps::READ); }
+    errcode_t pop(ReadHandle& h){ return read_h(h, this, HOps::POP); }
+    int start_reading_once(ReadHandle& h){ return read_h(h, this, HOps::ONCE); } // 1: new message, 0: already seen
+
+    errcode_t start_reading_wait(
+            ReadHandle& h,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        return read_h(h, this, HOps::WAIT, timeout);
+    }
+
+    errcode_t free(ReadHandle& h){ return release_h(h, false); }
+    errcode_t consume(ReadHandle& h){ return release_h(h, true); }
+
+    errcode_t start_writing(WriteHandle& h){ return write_h(h, this); }
+    errcode_t commit(WriteHandle& h){ return commit_h(h); }
+    errcode_t free(WriteHandle& h){ return release_h(h, false); } // drop without publishing
+
 
 
 protected:
 
+    typedef NTupleBufferHandleOps HOps;
+
+    template<typename H, typename O>
+    int read_h(H& h, O* owner, HOps::ReadMode mode, std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()){
+        int res = HOps::read(h, owner, control, mode, timeout, [this](int b){ return bufnum2ptr(b); });
+        if(res >= 0){
+            prefetch(h.get(), false);
+        }
+        return res;
+    }
+
+    template<typename H>
+    errcode_t release_h(H& h, bool consume){ return HOps::release(h, control, consume); }
+
+    template<typename H, typename O>
+    errcode_t write_h(H& h, O* owner){
+        int res = HOps::write(h, owner, control, [this](int b){ return bufnum2ptr(b); });
+        if(res >= 0){
+            prefetch(h.get(), true);
+            invalidate_chunks(h.bufnum());
+        }
+        return res;
+    }
+
+    template<typename H>
+    errcode_t commit_h(H& h){ return HOps::commit(h, control); }
+
+
     errcode_t er(int fr){return std::min(0, fr);}
 
+    uint64_t* chunk_vers(int bufnum){ return chunk_vers_ + (bufnum - 1) * nchunks_; }
+
+    void invalidate_chunks(int bufnum){
+        if(chunk_vers_ != nullptr && bufnum > 0){
+            std::fill_n(chunk_vers(bufnum), nchunks_, next_chunk_ver_.fetch_add(1, std::memory_order_relaxed));
+        }
+    }
+
+    // brings chunks [first, end) of the new buffer up to the old message (except the ones written
+    // by the transaction), marks them written if mark; runs of adjacent chunks are copied by one memcpy.
+    // Versions of the old buffer are stable while it is referenced by the transaction.
+    void sync_chunks(ChunkedTransaction& tra, size_t first, size_t end, bool mark){
+        uint64_t* nv = chunk_vers(ptr2bufnum(tra.new_buf));
+        const uint64_t* ov = (tra.old_buf != nullptr)? chunk_vers(ptr2bufnum(tra.old_buf)) : nullptr;
+
+        size_t run = end; // first chunk of the run to copy (end: no run)
+        for(size_t c = first; c < end; ++c){
+            if(ov != nullptr && nv[c] != tra.version && nv[c] != ov[c]){
+                nv[c] = ov[c];
+                if(run == end){
+                    run = c;
+                }
+            }else if(run != end){
+                copy_chunks(tra, run, c);
+                run = end;
+            }
+
+            if(mark){
+                nv[c] = tra.version;
+            }
+        }
+
+        if(run != end){
+            copy_chunks(tra, run, end);
+        }
+    }
+
+    void copy_chunks(ChunkedTransaction& tra, size_t first, size_t end){
+        size_t from = first << chunk_shift_;
+        size_t to = std::min(end << chunk_shift_, data_size_);
+        std::memcpy((uint8_t*)tra.new_buf + from, (const uint8_t*)tra.old_buf + from, to - from);
+    }
+
     int ptr2bufnum(void* ptr){
         uint8_t* p = (uint8_t*)ptr;
         return (p == nullptr)? 0 : ((p - data_) / sz1buf_ + 1);
@@ -144,24 +437,59 @@ protected:
             : nullptr;
     }
 
+    void prefetch(void* ptr, bool for_write){
+#       if defined(__GNUC__)
+        if(ptr == nullptr){
+            return;
+        }
+        size_t n = std::min((size_t)prefetch_lines_, (sz1buf_ + cache_line_size - 1) / cache_line_size);
+        for(size_t i = 0; i < n; ++i){
+            if(for_write){
+                __builtin_prefetch((uint8_t*)ptr + i * cache_line_size, 1, 3);
+            }else{
+                __builtin_prefetch((uint8_t*)ptr + i * cache_line_size, 0, 3);
+            }
+        }
+#       else
+        (void)ptr;
+        (void)for_write;
+#       endif
+    }
+
+    // read-mostly data first, the control structure on its own cache line(s) then
     size_t data_size_;
     size_t sz1buf_; // size of 1 buffer
-    ControlCode control;
     uint8_t* data_ = nullptr;
+    uint8_t* raw_ = nullptr; // (as allocated)
+    unsigned prefetch_lines_ = 2;
+    uint64_t* chunk_vers_ = nullptr; // [NBUFS][nchunks_] versions of chunks (see set_chunk_size())
+    size_t nchunks_ = 0;
+    unsigned chunk_shift_ = 0;
+    std::atomic<uint64_t> next_chunk_ver_ = {1};
+    alignas(cache_line_size) ControlCode control;
+    char control_pad_[cache_line_size - sizeof(ControlCode) % cache_line_size]; // nothing else on the last line
 };
 
 
 /**
  * Buffer data as type.
- * The type shall be default constructible
+ * The type shall be default constructible (and copy assignable for SlotCopyFromOld)
  */
-template<typename ControlCodeT, unsigned NBUFS, typename DataT>
+template<
+    typename ControlCodeT,
+    unsigned NBUFS,
+    typename DataT,
+    typename MemOrder = MemOrderSeqCst,
+    template<typename, unsigned, typename> class ControlEngine = NTupleBufferControl,
+    typename SlotPolicy = SlotReconstruct // or SlotRecycle<>, SlotCopyFromOld (see ntuplebuf_slot.hpp)
+>
 struct NTupleBufferDynAllocTyped
-    : public NTupleBufferDynAlloc<ControlCodeT, NBUFS>
+    : public NTupleBufferDynAlloc<ControlCodeT, NBUFS, MemOrder, ControlEngine>
 {
-    typedef NTupleBufferDynAlloc<ControlCodeT, NBUFS> Base;
+    typedef NTupleBufferDynAlloc<ControlCodeT, NBUFS, MemOrder, ControlEngine> Base;
     typedef typename Base::errcode_t errcode_t;
     typedef typename Base::TypelessTransacion TypelessTransacion;
+    typedef typename Base::gen_t gen_t;
 
     struct TypedTransacion{
       errcode_t errcode;
@@ -169,9 +497,13 @@ struct NTupleBufferDynAllocTyped
       DataT* new_buf;
     };
 
+    typedef NTupleBufferHandleOps HOps;
+    typedef NTupleBufferReadHandle<NTupleBufferDynAllocTyped, DataT> ReadHandle;
+    typedef NTupleBufferWriteHandle<NTupleBufferDynAllocTyped, DataT> WriteHandle;
+
 
-    NTupleBufferDynAllocTyped()
-    : Base(sizeof(DataT))
+    NTupleBufferDynAllocTyped(size_t slot_align = alignof(std::max_align_t))
+    : Base(sizeof(DataT), std::max(slot_align, alignof(DataT)))
     {
         for(unsigned i=0 ; i < NBUFS; ++i){
             new(Base::data_ + i * Base::sz1buf_) DataT; // call placement new
@@ -195,6 +527,25 @@ struct NTupleBufferDynAllocTyped
         return Base::pop(ppD2V(pptr));
     }
 
+    errcode_t start_reading(DataT** pptr, gen_t* p_gen){
+        return Base::start_reading(ppD2V(pptr), p_gen);
+    }
+
+    errcode_t pop(DataT** pptr, gen_t* p_gen){
+        return Base::pop(ppD2V(pptr), p_gen);
+    }
+
+    int start_reading_once(DataT** pptr, gen_t* p_gen_seen){
+        return Base::start_reading_once(ppD2V(pptr), p_gen_seen);
+    }
+
+    errcode_t start_reading_wait(
+            DataT** pptr,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        return Base::start_reading_wait(ppD2V(pptr), timeout);
+    }
+
     errcode_t free(DataT** pptr){
         return Base::free(ppD2V(pptr));
     }
@@ -205,8 +556,8 @@ struct NTupleBufferDynAllocTyped
 
     errcode_t start_writing(DataT** pptr){
         auto res = Base::start_writing(ppD2V(pptr));
-        if(res > 0){
-            reconstruct(*pptr);
+        if(res >= 0){
+            SlotPolicy::on_write(*pptr);
         }
         return res;
     }
@@ -215,6 +566,31 @@ struct NTupleBufferDynAllocTyped
         return Base::commit(ppD2V(pptr));
     }
 
+    errcode_t start_reading(ReadHandle& h){ return Base::read_h(h, this, HOps::READ); }
+    errcode_t pop(ReadHandle& h){ return Base::read_h(h, this, HOps::POP); }
+    int start_reading_once(ReadHandle& h){ return Base::read_h(h, this, HOps::ONCE); }
+
+    errcode_t start_reading_wait(
+            ReadHandle& h,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        return Base::read_h(h, this, HOps::WAIT, timeout);
+    }
+
+    errcode_t free(ReadHandle& h){ return Base::release_h(h, false); }
+    errcode_t consume(ReadHandle& h){ return Base::release_h(h, true); }
+
+    errcode_t start_writing(WriteHandle& h){
+        auto res = Base::write_h(h, this);
+        if(res >= 0){
+            SlotPolicy::on_write(h.get());
+        }
+        return res;
+    }
+
+    errcode_t commit(WriteHandle& h){ return Base::commit_h(h); }
+    errcode_t free(WriteHandle& h){ return Base::release_h(h, false); }
+
     TypedTransacion start_transaction(){
         TypelessTransacion tr = Base::start_transaction();
         TypedTransacion ret = {
@@ -224,8 +600,8 @@ struct NTupleBufferDynAllocTyped
         };
 
         if(tr.errcode == 0){
-            // recreate object in newly allocated buffer:
-            this->reconstruct(ret.new_buf);
+            // prepare object in newly allocated buffer (see ntuplebuf_slot.hpp):
+            SlotPolicy::on_transaction(ret.new_buf, ret.old_buf);
         }
 
         return ret;
@@ -247,16 +623,24 @@ struct NTupleBufferDynAllocTyped
         return res;
     }
 
+    errcode_t commit_ordered(TypedTransacion& tra, CommitOrder order){
+        if(tra.errcode != 0){
+            return -92;
+        }
 
-private:
-    // the "function" just casts Data** to void** :
-    static void** ppD2V(DataT** ppd){return static_cast<void**>(static_cast<void*>(ppd));}
+        TypelessTransacion tr = {
+                tra.errcode,
+                tra.old_buf,
+                tra.new_buf,
+        };
 
-    void reconstruct(DataT* pd){
-        pd -> DataT::~DataT(); // destruct previous data
-        new(pd) DataT; // (placement) construct new data
+        return Base::commit_ordered(tr, order);
     }
 
+
+private:
+    // the "function" just casts Data** to void** :
+    static void** ppD2V(DataT** ppd){return static_cast<void**>(static_cast<void*>(ppd));}
 };
 
 } // namespace
@@ -0,0 +1,153 @@
+#ifndef ntuplebuf_eventfd_hpp
+#define ntuplebuf_eventfd_hpp
+
+/*
+Pollable notification of new data (Linux eventfd), for consumers driven by epoll / poll / select
+which can not block in wait_for_update().
+
+The consumer arms the notifier, which queues a one-shot WaitNode at the buffer's wait point
+(see wait_async()); the first commit after that writes the eventfd, later commits find nobody waiting
+and cost nothing, until the consumer arms the notifier again. So a burst of commits makes one wakeup
+and one syscall in the producer (on the edge "waiter present"), and none while nobody is armed.
+
+    NTupleBufferEventFd<decltype(buf)> notifier(buf);
+    epoll_ctl(ep, EPOLL_CTL_ADD, notifier.fd(), &ev);   // EPOLLIN
+
+    for(;;){                                            // event loop
+        if(notifier.arm(h) == 0){                       // h: the read handle (or the buffer number seen)
+            read_all();                                 // new data already: nothing armed
+            continue;
+        }
+        epoll_wait(ep, ...);                            // sockets, timers, ...
+        if(fd of notifier is readable){
+            notifier.ack();
+            read_all();                                 // start_reading(h) ...
+        }
+    }
+
+One consumer thread per notifier (arm() / ack() / disarm() are not thread safe among themselves).
+ */
+
+#include "ntuplebuf.hpp"
+
+#ifdef __linux__
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+namespace ntuplebuf {
+
+
+template<typename Buffer>
+struct NTupleBufferEventFd
+{
+    typedef int errcode_t;
+
+    explicit NTupleBufferEventFd(Buffer& buf)
+        : buf_(buf)
+    {
+        node_.fire = &NTupleBufferEventFd::on_fire;
+        node_.owner = this;
+        fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        errcode_ = (fd_ < 0)? -errno : 0;
+    }
+
+    NTupleBufferEventFd(const NTupleBufferEventFd&) = delete;
+    NTupleBufferEventFd& operator=(const NTupleBufferEventFd&) = delete;
+
+    ~NTupleBufferEventFd(){
+        disarm();
+        while(armed_.load(std::memory_order_acquire) || busy_.load(std::memory_order_acquire)){
+            cpu_relax(); // (a producer is firing the node)
+        }
+        if(fd_ >= 0){
+            close(fd_);
+        }
+    }
+
+    errcode_t errcode() const{ return errcode_; } // 0 if the eventfd has been created
+
+    int fd() const{ return fd_; }
+
+    int // returns 1 if armed (the fd becomes readable on the next update), 0 if updated already, negative on error
+    arm(int bufnum_seen = 0){ // bufnum_seen: the buffer still referenced by the consumer (0: none)
+        if(fd_ < 0){
+            return errcode_;
+        }
+        if(armed_.load(std::memory_order_acquire)){
+            return 1; // (still queued)
+        }
+
+        armed_.store(true, std::memory_order_relaxed);
+        if(buf_.get_control().wait_async(&node_, bufnum_seen) == 0){
+            armed_.store(false, std::memory_order_relaxed);
+            return 0;
+        }
+        return 1;
+    }
+
+    template<typename Handle>
+    int arm(const Handle& h){ return arm(h.bufnum()); }
+
+    // returns true if the notifier was armed and has been taken back before it fired
+    bool disarm(){
+        if(armed_.load(std::memory_order_acquire) && buf_.get_control().cancel_wait_async(&node_)){
+            armed_.store(false, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    // resets the fd after it has been reported readable; returns the number of notifications taken (0 or 1)
+    uint64_t ack(){
+        uint64_t n = 0;
+        if(read(fd_, &n, sizeof(n)) != (ssize_t)sizeof(n)){ // (EAGAIN: not signalled)
+            return 0;
+        }
+        return n;
+    }
+
+    uint64_t signals() const{ return signals_.load(std::memory_order_relaxed); } // eventfd writes so far
+
+
+private:
+
+    struct Node
+        : public WaitNode
+    {
+        NTupleBufferEventFd* owner = nullptr;
+    };
+
+    static void on_fire(WaitNode* n){ // (the producer's thread)
+        NTupleBufferEventFd* self = static_cast<Node*>(n)->owner;
+        self->busy_.store(1, std::memory_order_relaxed);
+        self->armed_.store(false, std::memory_order_release); // (before the write: arm() after ack() queues again)
+
+        uint64_t one = 1;
+        if(write(self->fd_, &one, sizeof(one)) == (ssize_t)sizeof(one)){
+            self->signals_.fetch_add(1, std::memory_order_relaxed);
+        }
+        self->busy_.store(0, std::memory_order_release); // (the last access to *self)
+    }
+
+    Buffer& buf_;
+    int fd_ = -1;
+    errcode_t errcode_ = 0;
+
+    Node node_;
+    std::atomic<bool> armed_ = {false};
+    std::atomic<uint32_t> busy_ = {0};
+    std::atomic<uint64_t> signals_ = {0};
+};
+
+
+} // namespace
+
+#endif // __linux__
+
+#endif
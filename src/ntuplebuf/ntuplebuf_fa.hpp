@@ -0,0 +1,749 @@
+/*
+
+Alternative control structure of ntuple buffer with wait-free reader acquire.
+Public API is the same as NTupleBufferControl (see ntuplebuf.hpp).
+
+The control word contains only the number of current buffer and the counter of "pending" readers
+of the current buffer. Reference counters of buffers are kept in separate atomics.
+
+A reader takes its reference with single fetch_add on the control word: the returned value tells
+which buffer was current, and the increment is the reference itself (it belongs to whatever buffer
+is current at the moment of fetch_add). The writer replaces the current buffer with single exchange
+(which also zeroes the pending counter) and transfers the pending count of the ex-current buffer
+to its reference counter.
+
+The current buffer keeps a large "current bias" in its reference counter, so readers releasing
+references which are not transferred yet can not bring the counter to zero
+(the counter may go below the bias for a while, but never reaches zero).
+
+So start_reading, pop, free, commit are wait-free (one or two RMWs each).
+start_writing and start_transaction search a free buffer with CAS (the only possible
+contenders are other writers). commit_transaction(force == false), commit_ordered() and consume()
+use CAS loop on the control word since they have to compare the current buffer. The loop compares
+only the current buffer field and retries with the fresh word (whatever the pending counter is),
+but the CAS itself fails on any change, readers' fetch_add included. So a reader which passes its
+previous buffer to start_reading() keeps the reference without any RMW while that buffer is still
+current: readers polling for new data fail a writer's CAS at most once each per commit
+(readers starting without a previous buffer still fetch_add every time).
+The pending counter is folded into the reference counter when it reaches the half of its range:
+every reader which sees the counter above the threshold does not return until the counter is folded
+(by itself or by somebody else), so the counter can not exceed the threshold by more than the number
+of participants. The fold is the only lock-free (not wait-free) part of the reader path, and it
+happens once per pending_fold readings at most.
+ */
+
+
+#ifndef ntuplebuf_fa_h
+#define ntuplebuf_fa_h
+
+#include "ntuplebuf.hpp"
+
+
+namespace ntuplebuf {
+
+
+// control words of NTupleBufferControlFA: the current buffer with pending readers, and reference counters
+template<typename ControlCodeT, typename RefCountT, unsigned NBUFS>
+struct ControlWordsFA
+{
+    std::atomic<ControlCodeT> cco = {0};
+    std::atomic<RefCountT> refs[NBUFS] = {};
+};
+
+
+template<
+    typename ControlCodeSpec, // unsigned integral type or AutoControlCode
+    unsigned NBUFS,
+    typename MemOrder,
+    bool REF // control words and side data are referenced (see ControlStorage)
+>
+struct NTupleBufferControlFAImpl
+{
+private:
+    // AutoControlCode: 32 bits (a smaller word would fold the pending counter too often)
+    typedef typename std::conditional<
+        std::is_same<ControlCodeSpec, AutoControlCode>::value, uint32_t, ControlCodeSpec
+    >::type ControlCodeT;
+
+public:
+    using CCodeT = ControlCodeT;
+    using MemOrderPolicy = MemOrder;
+    using RefCountT = typename std::make_signed<ControlCodeT>::type;
+    using gen_t = typename Generations<NBUFS>::gen_t;
+    static constexpr uint32_t engine_id = 2; // (shared memory layouts record it, see ntuplebuf_shm.hpp)
+
+    using Word = ControlWordsFA<ControlCodeT, RefCountT, NBUFS>;
+    using Side = ControlSide<NBUFS, MemOrder::wait>;
+    using Ref = NTupleBufferControlFAImpl<ControlCodeSpec, NBUFS, MemOrder, true>;
+
+    NTupleBufferControlFAImpl() = default;
+
+    // REF: control structure of the words and side data kept by the caller
+    NTupleBufferControlFAImpl(Word& word, Side& side): store_(word, side) {}
+
+    enum: ControlCodeT{
+        NumOfBuffers = NBUFS,
+        current_bitsize = counter_bitsize(NBUFS),
+        pending_bitsize = sizeof(ControlCodeT) * CHAR_BIT - current_bitsize,
+        pending_mask = ((ControlCodeT)1 << pending_bitsize) - 1,
+        pending_fold = (ControlCodeT)1 << (pending_bitsize - 1) // fold pending counter at this value
+    };
+
+    static_assert(
+            std::is_integral<ControlCodeT>::value && std::is_unsigned<ControlCodeT>::value,
+            "ControlCodeT shall be unsigned"
+    );
+
+    static_assert(
+            ControlAtomic<ControlCodeT>::always_lock_free,
+            "atomic ControlCodeT is not lock-free"
+    );
+
+    static_assert(
+            pending_fold > NBUFS && NBUFS >= 2, // room for pending counter over the fold threshold
+            "NBUFS too large for ControlCodeT"
+    );
+
+    // larger than any possible pending counter, still fits RefCountT (current_bitsize >= 2):
+    static constexpr RefCountT current_bias = (RefCountT)1 << pending_bitsize;
+
+    struct Transaction {
+        int errcode;
+        int old_buf;
+        int new_buf;
+    };
+
+
+    int // returns positive (1-based number) on success, 0 if no data, negative on error
+    start_reading(int* p_bufnum_prev){
+        return start_reading_impl(p_bufnum_prev, false);
+    }
+
+
+    int // returns positive (1-based number) on success, 0 if no data, negative on error
+    pop(int* p_bufnum_prev){
+        return start_reading_impl(p_bufnum_prev, true);
+    }
+
+
+    // generations: see NTupleBufferControl
+
+    int start_reading(int* p_bufnum_prev, gen_t* p_gen){
+        int res = start_reading_impl(p_bufnum_prev, false);
+        if(res >= 0 && p_gen != nullptr){
+            *p_gen = side().gens.get(res);
+        }
+        return res;
+    }
+
+    int pop(int* p_bufnum_prev, gen_t* p_gen){
+        int res = start_reading_impl(p_bufnum_prev, true);
+        if(res >= 0 && p_gen != nullptr){
+            *p_gen = side().gens.get(res);
+        }
+        return res;
+    }
+
+    int // returns positive (1-based number) if new data, 0 if no (new) data, negative on error
+    start_reading_once(int* p_bufnum_prev, gen_t* p_gen_seen){
+        if(p_bufnum_prev == nullptr || p_gen_seen == nullptr){
+            return -5;
+        }
+
+        int prev_bufnum = *p_bufnum_prev;
+
+        YELD_ntuplebuf
+
+        if(prev_bufnum > 0 && (int)get_current(word().cco.load(MemOrder::load)) == prev_bufnum
+                && side().gens.get(prev_bufnum) == *p_gen_seen
+        ){
+            return 0; // still current and referenced (so its generation can not change)
+        }
+
+        gen_t gen = 0;
+        int res = start_reading(p_bufnum_prev, &gen);
+        if(res <= 0 || gen == *p_gen_seen){
+            return (res < 0)? res : 0;
+        }
+
+        *p_gen_seen = gen;
+        return res;
+    }
+
+    gen_t generation(int bufnum) const{
+        return (bufnum > 0 && bufnum <= (int)NBUFS)? side().gens.get(bufnum) : 0;
+    }
+
+    CommitOrder order(int bufnum) const{
+        return side().orders.get((bufnum > 0 && bufnum <= (int)NBUFS)? bufnum : 0);
+    }
+
+    // commit time: see NTupleBufferControl
+    uint64_t commit_time(int bufnum) const{
+#ifdef TIMESTAMPS_ntuplebuf
+        return side().times.get((bufnum > 0 && bufnum <= (int)NBUFS)? bufnum : 0);
+#else
+        (void)bufnum;
+        return 0;
+#endif
+    }
+
+#ifdef TIMESTAMPS_ntuplebuf
+    // age and commit interval histograms, time of the last commit
+    const CommitTimes<NBUFS>& times() const{ return side().times; }
+#endif
+
+#ifdef STATS_ntuplebuf
+    const StatsRows& stats() const{ return side().stats; } // (see NTupleBufferControl)
+#endif
+
+
+    // true if nobody references the buffer (it is not current either).
+    // Only a writer can take such buffer, so the answer is stable for the (single) writer;
+    // acquire: reading by the last owner happens before.
+    bool is_free(int bufnum){
+        return (bufnum > 0 && bufnum <= (int)NBUFS)
+            && word().refs[bufnum - 1].load(std::memory_order_acquire) == 0; // (current buffer keeps the bias)
+    }
+
+
+    // returns 0 or positive on success (the value is the exact reference count only for not current buffer)
+    // or negative on error
+    int free(int* p_bufnum){
+        if(p_bufnum == nullptr){
+            return -11;
+        }
+
+        int bufnum = *p_bufnum;
+
+        if(bufnum_valid(bufnum) <= 0){ // if error or no data
+            return (bufnum == 0)? 0 : -14;
+        }
+
+        RefCountT count = release(bufnum);
+        if(count < 0){
+            return -12; // count underrun
+        }
+
+        *p_bufnum = 0;
+        return unbiased(count);
+    }
+
+
+    // acts as free() but also clears current buffer "pointer" if it is still the same
+    // (see NTupleBufferControl::consume())
+    int consume(int* p_bufnum){
+        if(p_bufnum == nullptr){
+            return -21;
+        }
+
+        int bufnum = *p_bufnum;
+
+        if(bufnum_valid(bufnum) <= 0){ // if error or no data
+            return (bufnum == 0)? 0 : -22;
+        }
+
+        // The reference of the caller is kept until current is compared: once released, the buffer
+        // could be retaken and published again under the same bufnum, and the CAS would clear
+        // the new (unread) message.
+        bool cleared = false;
+        RefCountT count = 0;
+        ControlCodeT cco = word().cco.load(MemOrder::load);
+        while((int)get_current(cco) == bufnum){
+            YELD_ntuplebuf
+
+            if(word().cco.compare_exchange_strong(cco, 0, MemOrder::cas_success, MemOrder::cas_failure)){
+                // ex-current: transfer pending readers, drop the bias and the reference of the caller
+                count = transfer(bufnum, (RefCountT)get_pending(cco) - current_bias - 1);
+                cleared = true;
+                break;
+            }
+
+            stats_count(StatsPage::CAS_RETRY);
+        }
+
+        if(!cleared){
+            count = release(bufnum);
+        }
+        if(count < 0){
+            return -23; // count underrun
+        }
+
+        *p_bufnum = 0;
+        return unbiased(count);
+    }
+
+
+    int // returns positive (1-based number) on success, negative on error
+    start_writing(
+            int* p_bufnum_working // previous bufnum (1- based) to commit and fill with new
+    ){
+        if(p_bufnum_working == nullptr || bufnum_valid(*p_bufnum_working) < 0){
+            return -31;
+        }
+
+        // Commit previous buffer first: the ex-current one may become free then
+        // (so the engine needs no more buffers than NTupleBufferControl does).
+        // Unlike NTupleBufferControl, the commit is not undone if no free buffer is found
+        // (*p_bufnum_working is 0 then).
+        if(*p_bufnum_working > 0){
+            publish(*p_bufnum_working);
+            *p_bufnum_working = 0;
+        }
+
+        int new_bufnum = acquire_free();
+        if(new_bufnum < 1){
+            stats_count(StatsPage::NO_FREE_SLOT);
+            return -35; // not found
+        }
+        stat_taken(new_bufnum);
+
+        *p_bufnum_working = new_bufnum;
+        return new_bufnum;
+    }
+
+
+    int // returns 0 on success, negative on error
+    commit(int* p_bufnum_working){
+        if(p_bufnum_working == nullptr || bufnum_valid(*p_bufnum_working) < 0){
+            return -41;
+        }
+
+        if(*p_bufnum_working == 0){
+            return 0; // nothing to commit
+        }
+
+        publish(*p_bufnum_working);
+        *p_bufnum_working = 0;
+        return 0;
+    }
+
+
+    Transaction start_transaction(){
+        Transaction rett = {-1, 0, 0};
+
+        int new_bufnum = acquire_free();
+        if(new_bufnum < 1){
+            stats_count(StatsPage::NO_FREE_SLOT);
+            rett.errcode = -80; // not found
+            return rett;
+        }
+        stat_taken(new_bufnum);
+
+        rett.errcode = 0;
+        rett.old_buf = acquire_current();
+        rett.new_buf = new_bufnum;
+        return rett;
+    }
+
+
+    int // returns 0 on success, 1 on failure, negative on error
+    commit_transaction(Transaction tra, bool force){
+        if(bufnum_valid(tra.old_buf) < 0 || bufnum_valid(tra.new_buf) <= 0){
+            return -83;
+        }
+
+        side().gens.stamp(tra.new_buf); // (just garbage on failure)
+        uint64_t t_commit = time_stamp(tra.new_buf);
+
+        // new buffer may become current below, so protect it with the bias before publishing:
+        transfer(tra.new_buf, current_bias - 1);
+
+        ControlCodeT new_cco = (ControlCodeT)tra.new_buf << pending_bitsize;
+        ControlCodeT cco;
+        bool success = true;
+
+        if(force){
+            YELD_ntuplebuf
+            cco = word().cco.exchange(new_cco, MemOrder::cas_success);
+        }else{
+            cco = word().cco.load(MemOrder::load);
+            for(;;){
+                if((int)get_current(cco) != tra.old_buf){ // ABA impossible since tra.old_buf has been referenced
+                    success = false;
+                    break;
+                }
+
+                YELD_ntuplebuf
+
+                if(word().cco.compare_exchange_strong(cco, new_cco, MemOrder::cas_success, MemOrder::cas_failure)){
+                    break;
+                }
+
+                stats_count(StatsPage::CAS_RETRY);
+            }
+        }
+
+        if(success){
+            retire(cco);
+            time_published(t_commit);
+            notify_waiters();
+        }else if(transfer(tra.new_buf, -current_bias) != 0){ // release new buffer (garbage on failure)
+            return -86;
+        }else{
+            stats_count(StatsPage::COLLISION);
+        }
+
+        if(tra.old_buf > 0 && release(tra.old_buf) < 0){ // release tra.old_buf (drop ownership)
+            return -85;
+        }
+
+        return success? 0 : 1;
+    }
+
+
+    // multi-producer "latest value" commit (see NTupleBufferControl::commit_ordered())
+    int // returns 0 on success, 1 if rejected (not newer than current), negative on error
+    commit_ordered(Transaction tra, CommitOrder order){
+        if(bufnum_valid(tra.old_buf) < 0 || bufnum_valid(tra.new_buf) <= 0){
+            return -87;
+        }
+
+        side().orders.set(tra.new_buf, order);
+        side().gens.stamp(tra.new_buf); // (just garbage if rejected)
+        uint64_t t_commit = time_stamp(tra.new_buf);
+
+        // new buffer may become current below, so protect it with the bias before publishing:
+        transfer(tra.new_buf, current_bias - 1);
+
+        ControlCodeT new_cco = (ControlCodeT)tra.new_buf << pending_bitsize;
+        ControlCodeT cco = word().cco.load(MemOrder::load);
+        bool success = true;
+
+        for(;;){
+            int cur_bufnum = (int)get_current(cco);
+            if(cur_bufnum != tra.old_buf){
+                // another commit has replaced it: reference the new current instead and compare again
+                int old_bufnum = tra.old_buf;
+                tra.old_buf = acquire_current();
+                if(old_bufnum > 0 && release(old_bufnum) < 0){
+                    return -88;
+                }
+
+                cco = word().cco.load(MemOrder::load);
+                continue;
+            }
+
+            if(cur_bufnum > 0 && !order.newer_than(side().orders.get(cur_bufnum))){ // (referenced, so stable)
+                success = false;
+                break;
+            }
+
+            YELD_ntuplebuf
+
+            if(word().cco.compare_exchange_strong(cco, new_cco, MemOrder::cas_success, MemOrder::cas_failure)){
+                break;
+            }
+
+            stats_count(StatsPage::CAS_RETRY);
+        }
+
+        if(success){
+            retire(cco);
+            time_published(t_commit);
+            notify_waiters();
+        }else if(transfer(tra.new_buf, -current_bias) != 0){ // release new buffer (garbage if rejected)
+            return -86;
+        }else{
+            stats_count(StatsPage::ORDER_REJECTED);
+        }
+
+        if(tra.old_buf > 0 && release(tra.old_buf) < 0){ // release tra.old_buf (drop ownership)
+            return -85;
+        }
+
+        return success? 0 : 1;
+    }
+
+
+    // blocking wait for new data (see NTupleBufferControl::wait_for_update())
+    int // returns 1 if updated, 0 on timeout
+    wait_for_update(
+            int bufnum_seen,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        static_assert(MemOrder::wait, "the buffer does not wait (NoWait memory order policy)");
+        return side().waitp.wait(
+                [&](){
+                    int cur = (int)get_current(word().cco.load(std::memory_order_seq_cst));
+                    return cur != 0 && cur != bufnum_seen;
+                },
+                timeout,
+                side().wait_spin
+        );
+    }
+
+    // asynchronous wait for new data (see NTupleBufferControl::wait_async())
+    int // returns 1 if the node is queued, 0 if updated already (the node is not queued then)
+    wait_async(WaitNode* node, int bufnum_seen){
+        static_assert(MemOrder::wait, "the buffer does not wait (NoWait memory order policy)");
+        return side().waitp.add_node(
+                node,
+                [&](){
+                    int cur = (int)get_current(word().cco.load(std::memory_order_seq_cst));
+                    return cur != 0 && cur != bufnum_seen;
+                }
+        )? 1 : 0;
+    }
+
+    // returns true if the queued node is taken back (it will not fire), false if it has fired (or fires now)
+    bool cancel_wait_async(WaitNode* node){ return side().waitp.remove_node(node); }
+
+    int // returns positive (1-based number) on success, 0 if no data, negative on error
+    start_reading_wait(
+           int* p_bufnum_prev,
+           std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        if(p_bufnum_prev == nullptr){
+            return -4;
+        }
+
+        wait_for_update(*p_bufnum_prev, timeout);
+        return start_reading(p_bufnum_prev);
+    }
+
+    void set_wait_spin(unsigned spin){
+        side().wait_spin = spin;
+    }
+
+
+private:
+    // everywhere below:
+    // bufnum is 1-based number of a buffer;
+    // buf_idx is 0-based index (bufnum == buf_idx + 1)
+
+
+    int // returns positive (1-based number) on success, 0 if no data, negative on error
+    start_reading_impl(
+            int* p_bufnum_prev, // pointer to previous bufnum (1- based, may be 0 if no previous data)
+                               // it will be released and  set to new bufnum
+            bool consume = false  // i.e. clear current
+    ){
+        int prev_bufnum = 0;
+        if(p_bufnum_prev != nullptr){
+            if(bufnum_valid(*p_bufnum_prev) < 0){
+                return -3;
+            }
+            prev_bufnum = *p_bufnum_prev;
+        }
+
+        int cur_bufnum;
+        if(!consume && prev_bufnum > 0 && still_current(prev_bufnum)){
+            // the reference is kept: no RMW of the control word, so readers polling for new data
+            // do not fail the CAS of commit_transaction() / commit_ordered()
+            cur_bufnum = prev_bufnum;
+        }else if(prev_bufnum > 0 && release(prev_bufnum) < 0){
+            return -3; // count underrun
+        }else if(consume){
+            YELD_ntuplebuf
+            ControlCodeT cco = word().cco.exchange(0, MemOrder::cas_success);
+
+            cur_bufnum = (int)get_current(cco);
+            if(cur_bufnum > 0){
+                // the reference of "current" (the bias) is inherited by the caller:
+                transfer(cur_bufnum, (RefCountT)get_pending(cco) + 1 - current_bias);
+            }
+        }else{
+            cur_bufnum = acquire_current();
+        }
+
+        if(cur_bufnum > 0){
+            stat_read(cur_bufnum);
+            time_read(cur_bufnum);
+        }else{
+            stats_count(StatsPage::NO_DATA);
+        }
+
+        if(p_bufnum_prev != nullptr){
+            *p_bufnum_prev = cur_bufnum;
+        }
+
+        return cur_bufnum;
+    }
+
+
+    bool // true if the buffer (referenced by the caller) is current
+    still_current(int bufnum){
+        YELD_ntuplebuf
+        return (int)get_current(word().cco.load(MemOrder::load)) == bufnum;
+    }
+
+
+    int // returns bufnum (1-based) of current buffer (0 if no data); the buffer is referenced
+    acquire_current(){
+        YELD_ntuplebuf
+        ControlCodeT cco = word().cco.fetch_add(1, MemOrder::cas_success);
+
+        if(get_pending(cco) + 1 >= pending_fold){
+            fold();
+        }
+
+        return (int)get_current(cco);
+    }
+
+
+    // moves pending readers of current buffer to its reference counter
+    // (unless somebody else has already done that)
+    void fold(){
+        ControlCodeT cco = word().cco.load(MemOrder::load);
+        for(;;){
+            ControlCodeT pending = get_pending(cco);
+            int bufnum = (int)get_current(cco);
+
+            if(pending < pending_fold){
+                return;
+            }
+
+            // The counter is credited before the word is changed: the credit shall never lag behind
+            // retire() of the buffer (otherwise the counter might drop to 0 while the buffer is in use).
+            if(bufnum > 0){
+                transfer(bufnum, (RefCountT)pending);
+            }
+
+            YELD_ntuplebuf
+
+            if(word().cco.compare_exchange_strong(cco, cco - pending, MemOrder::cas_success, MemOrder::cas_failure)){
+                return;
+            }
+
+            stats_count(StatsPage::CAS_RETRY);
+
+            if(bufnum > 0){ // cco changed: take the credit back and start again
+                transfer(bufnum, -(RefCountT)pending);
+            }
+        }
+    }
+
+
+    // makes referenced (by the caller) buffer current
+    void publish(int bufnum){
+        side().gens.stamp(bufnum);
+        uint64_t t_commit = time_stamp(bufnum);
+        transfer(bufnum, current_bias - 1); // the reference of the writer becomes the bias
+
+        YELD_ntuplebuf
+        ControlCodeT cco = word().cco.exchange((ControlCodeT)bufnum << pending_bitsize, MemOrder::cas_success);
+
+        retire(cco);
+        time_published(t_commit);
+        notify_waiters();
+    }
+
+
+    // completes replacement of control word cco (transfers pending readers, drops the bias)
+    void retire(ControlCodeT cco){
+        int bufnum = (int)get_current(cco);
+        if(bufnum > 0){
+            stat_replaced(bufnum); // (still referenced here)
+            transfer(bufnum, (RefCountT)get_pending(cco) - current_bias);
+        }
+    }
+
+
+    int  // returns bufnum (1-based) 0 if not found
+    acquire_free(){
+        for(unsigned i = 0; i < NBUFS; ++i){
+            RefCountT count = word().refs[i].load(MemOrder::load);
+            if(count != 0){
+                continue;
+            }
+
+            YELD_ntuplebuf
+
+            if(word().refs[i].compare_exchange_strong(count, 1, MemOrder::cas_success, MemOrder::cas_failure)){
+                return i + 1; // convert index to 1-based
+            }
+
+            stats_count(StatsPage::CAS_RETRY);
+        }
+
+        return 0; // not found
+    }
+
+
+    RefCountT // new reference count (negative on underrun)
+    release(int bufnum){
+        return transfer(bufnum, -1);
+    }
+
+    RefCountT // new reference count
+    transfer(int bufnum, RefCountT delta){
+        YELD_ntuplebuf
+        return word().refs[bufnum - 1].fetch_add(delta, MemOrder::cas_success) + delta;
+    }
+
+    static int unbiased(RefCountT count){
+        return (int)((count >= current_bias / 2)? 0 : count);
+    }
+
+    int  // negativ if invalid; otherwise bufnum itself (may be 0 if no data)
+    bufnum_valid(int bufnum){
+        return (bufnum < 0 || bufnum > (int)NBUFS)? -1 : bufnum;
+    }
+
+    static ControlCodeT get_current(ControlCodeT cco){return cco >> pending_bitsize;}
+    static ControlCodeT get_pending(ControlCodeT cco){return cco & pending_mask;}
+
+
+    void notify_waiters(){
+        side().waitp.notify(MemOrder::cas_success == std::memory_order_seq_cst);
+    }
+
+    // see NTupleBufferControl
+#ifdef STATS_ntuplebuf
+    void stat_taken(int bufnum){ side().read_flags.taken(bufnum); }
+    void stat_read(int bufnum){ side().read_flags.read(bufnum); }
+    void stat_replaced(int bufnum){
+        if(side().read_flags.replaced(bufnum)){
+            stats_count(StatsPage::OVERWRITTEN_UNREAD);
+        }
+    }
+
+    void stats_count(StatsPage::Event ev){ // the page of the process and the counters of this structure
+        ntuplebuf::stats_count(ev);
+        side().stats.count(ev);
+    }
+#else
+    void stat_taken(int){}
+    void stat_read(int){}
+    void stat_replaced(int){}
+    void stats_count(StatsPage::Event){}
+#endif
+
+    // commit timestamps and histograms (nothing unless TIMESTAMPS_ntuplebuf)
+#ifdef TIMESTAMPS_ntuplebuf
+    uint64_t time_stamp(int bufnum){ return side().times.stamp(bufnum); }
+    void time_published(uint64_t t){ side().times.published(t); }
+    void time_read(int bufnum){ side().times.read(bufnum); }
+#else
+    uint64_t time_stamp(int){ return 0; }
+    void time_published(uint64_t){}
+    void time_read(int){}
+#endif
+
+
+    Word& word(){ return store_.word(); }
+    const Word& word() const{ return store_.word(); }
+    Side& side(){ return store_.side(); }
+    const Side& side() const{ return store_.side(); }
+
+    ControlStorage<Word, Side, REF> store_;
+};
+
+
+template<typename ControlCodeT, unsigned NBUFS, typename MemOrder, bool REF>
+constexpr typename NTupleBufferControlFAImpl<ControlCodeT, NBUFS, MemOrder, REF>::RefCountT
+NTupleBufferControlFAImpl<ControlCodeT, NBUFS, MemOrder, REF>::current_bias;
+
+
+template<
+    typename ControlCodeSpec, // unsigned integral type or AutoControlCode
+    unsigned NBUFS,
+    typename MemOrder = MemOrderSeqCst
+>
+using NTupleBufferControlFA = NTupleBufferControlFAImpl<ControlCodeSpec, NBUFS, MemOrder, false>;
+
+
+} // namespace
+
+#endif
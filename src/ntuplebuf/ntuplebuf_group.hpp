@@ -0,0 +1,228 @@
+#ifndef ntuplebuf_group_hpp
+#define ntuplebuf_group_hpp
+
+/*
+Group of n-tuple buffers (members, e.g. position and velocity) published and read as a whole.
+
+The group has its own control word; every group slot maps to one buffer of every member and
+keeps a reference to (pins) them, as NTupleBufferRelay does for its source:
+
+    group slot 1 -> position buf 3, velocity buf 1
+    group slot 2 -> position buf 5, velocity buf 1   (current: velocity not changed by the last publish)
+
+The writer fills new member buffers (start_writing()) and publish() commits all of them at once:
+members are committed and pinned first, then the group slot mapping to them is committed, so group readers
+see either all updates of a publish or none of them:
+
+    NTupleBufferGroup<NTupleBufferDynAlloc<unsigned, 7>, 2, unsigned, 4> group({&position, &velocity});
+
+    group.start_writing(0, &p); // fill p (position)
+    group.start_writing(1, &v); // fill v (velocity)
+    group.publish();
+
+    decltype(group)::Snapshot s = {};
+    group.start_reading(&s);    // s.data[0], s.data[1]: position and velocity of the same publish
+
+A group reader takes one group slot (one RMW on the group control word, as any reader does),
+so readers stay lock-free (wait-free with NTupleBufferControlFA) and never wait for the writer.
+If a member fails in publish(), the group slot is released and nothing is published to group readers
+(members committed before the failure stay committed for their own readers).
+
+Members are typeless buffers (e.g. NTupleBufferDynAlloc, NTupleBufferShm; data sizes may differ)
+written only through the group by one writer thread at a time. They may have readers of their own
+(which see members updated one by one).
+A free group slot keeps its pins until it is reused, so every member needs
+NBUFS (member) >= NBUFS (group) + 1 (writer) + number of its own readers.
+ */
+
+#include "ntuplebuf.hpp"
+#include <array>
+#include <cstddef>
+#include <algorithm> // std::min
+
+
+namespace ntuplebuf {
+
+
+template<
+    typename Member,
+    unsigned NMEMBERS,
+    typename ControlCodeT,
+    unsigned NBUFS,
+    typename MemOrder = MemOrderSeqCst,
+    template<typename, unsigned, typename> class ControlEngine = NTupleBufferControl
+>
+struct NTupleBufferGroup
+{
+    typedef int errcode_t;
+    typedef  ControlEngine<ControlCodeT, NBUFS, MemOrder> ControlCode;
+    typedef typename ControlCode::gen_t gen_t;
+    typedef std::array<Member*, NMEMBERS> Members;
+
+    enum: errcode_t{
+        ERR_NO_SLOT = -151, // no free group slot (too many group readers); nothing is published
+        ERR_MEMBER = -152   // member index out of range
+    };
+
+    // consistent messages of all members (keep it between calls, as pointers in NTupleBufferDynAlloc API)
+    struct Snapshot{
+        int slot;              // group slot (0: no data)
+        gen_t gen;             // group generation (commit sequence number of the group)
+        void* data[NMEMBERS];  // message of every member (nullptr if the member has never been written)
+    };
+
+
+    explicit NTupleBufferGroup(const Members& members)
+        : members_(members)
+    {}
+
+    NTupleBufferGroup(const NTupleBufferGroup&) = delete;
+    NTupleBufferGroup& operator=(const NTupleBufferGroup&) = delete;
+
+    ~NTupleBufferGroup(){ // (readers shall be gone)
+        for(unsigned m = 0; m < NMEMBERS; ++m){
+            if(pending_[m] != nullptr){
+                members_[m]->free(&pending_[m]); // drop unpublished message
+            }
+        }
+
+        for(unsigned b = 1; b <= NBUFS; ++b){
+            unpin(b);
+        }
+    }
+
+
+    // writer side (one thread at a time):
+
+    // new buffer of the member to fill (the same buffer if already taken since the last publish)
+    errcode_t start_writing(unsigned member, void** pptr){
+        if(member >= NMEMBERS){
+            return ERR_MEMBER;
+        }
+
+        if(pending_[member] == nullptr){
+            int res = members_[member]->start_writing(&pending_[member]);
+            if(res < 0){
+                return res;
+            }
+        }
+
+        *pptr = pending_[member];
+        return 0;
+    }
+
+    // commits all members written since the last publish, then publishes them to group readers at once
+    errcode_t publish(){
+        int bufnum = 0;
+        int res = control.start_writing(&bufnum);
+        if(res < 0){
+            return (res == -35)? ERR_NO_SLOT : res; // (pending messages are kept)
+        }
+
+        unpin(bufnum); // the slot is free: nobody reads its old mapping
+
+        for(unsigned m = 0; m < NMEMBERS; ++m){
+            if(pending_[m] != nullptr){
+                res = members_[m]->commit(&pending_[m]);
+                if(res < 0){
+                    return drop_slot(&bufnum, res);
+                }
+            }
+
+            // pin the current message (the one just committed, or the last one: only the group writes)
+            void* p = nullptr;
+            res = members_[m]->start_reading(&p);
+            if(res < 0){
+                return drop_slot(&bufnum, res);
+            }
+            map_[bufnum - 1][m].store(p, std::memory_order_relaxed); // (published by the group commit)
+        }
+
+        return er(control.commit(&bufnum));
+    }
+
+    ControlCode& get_control(){ return control; }
+
+
+    // reader side:
+
+    errcode_t start_reading(Snapshot* s){ // releases the previous snapshot (s->slot shall be 0 initially)
+        auto res = er(control.start_reading(&s->slot, &s->gen));
+        if(res >= 0){
+            fill(s);
+        }
+        return res;
+    }
+
+    errcode_t start_reading_wait(
+            Snapshot* s,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        auto res = er(control.start_reading_wait(&s->slot, timeout));
+        if(res >= 0){
+            s->gen = control.generation(s->slot);
+            fill(s);
+        }
+        return res;
+    }
+
+    int // returns 1 if updated, 0 on timeout
+    wait_for_update(
+            const Snapshot& seen,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        return control.wait_for_update(seen.slot, timeout);
+    }
+
+    void set_wait_spin(unsigned spin){ control.set_wait_spin(spin); }
+
+    errcode_t free(Snapshot* s){
+        auto res = er(control.free(&s->slot));
+        if(res >= 0){
+            fill(s);
+        }
+        return res;
+    }
+
+
+protected:
+
+    errcode_t er(int fr){return std::min(0, fr);}
+
+    void fill(Snapshot* s){
+        for(unsigned m = 0; m < NMEMBERS; ++m){
+            s->data[m] = (s->slot > 0)? map_[s->slot - 1][m].load(std::memory_order_relaxed) : nullptr;
+        }
+    }
+
+    // gives back the group slot taken by publish() (with the pins already made), returns errcode
+    errcode_t drop_slot(int* p_bufnum, errcode_t errcode){
+        unpin(*p_bufnum);
+        control.free(p_bufnum);
+        return errcode;
+    }
+
+    // releases member buffers of the group slot (writer only; the slot shall be free)
+    void unpin(int bufnum){
+        for(unsigned m = 0; m < NMEMBERS; ++m){
+            void* p = map_[bufnum - 1][m].load(std::memory_order_relaxed);
+            if(p != nullptr){
+                map_[bufnum - 1][m].store(nullptr, std::memory_order_relaxed);
+                members_[m]->free(&p);
+            }
+        }
+    }
+
+    // writer thread only:
+    Members members_;
+    void* pending_[NMEMBERS] = {}; // taken by start_writing(), not published yet
+
+    std::atomic<void*> map_[NBUFS][NMEMBERS] = {}; // group slot -> member buffers (pinned)
+
+    char control_pad_[cache_line_size]; // keeps writer's data off the readers' lines
+    ControlCode control;
+};
+
+} // namespace
+
+#endif
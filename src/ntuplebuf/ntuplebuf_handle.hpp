@@ -0,0 +1,213 @@
+#ifndef ntuplebuf_handle_hpp
+#define ntuplebuf_handle_hpp
+
+#include <chrono>
+
+
+namespace ntuplebuf {
+
+
+/*
+Move-only handles of a buffer slot: keep the slot number and the pointer, so the buffer calls
+need no pointer <-> bufnum conversion, and the caller does not pass the previous pointer back.
+A handle is bound to the buffer by the first start_reading()/start_writing() with it.
+
+ReadHandle releases the slot on destruction (or by release(), or by the next start_reading() with it).
+WriteHandle commits the slot on destruction (or by commit()); discard() drops it without publishing.
+A handle shall not be used by more than one thread at a time (as the pointers in the original API).
+ */
+template<typename Owner, typename T>
+class NTupleBufferReadHandle
+{
+public:
+    typedef T* pointer;
+    typedef typename Owner::gen_t gen_t;
+
+    NTupleBufferReadHandle() = default;
+
+    NTupleBufferReadHandle(NTupleBufferReadHandle&& h) noexcept
+        : owner_(h.owner_), bufnum_(h.bufnum_), ptr_(h.ptr_), gen_(h.gen_)
+    {
+        h.bufnum_ = 0;
+        h.ptr_ = nullptr;
+    }
+
+    NTupleBufferReadHandle& operator=(NTupleBufferReadHandle&& h) noexcept{
+        if(this != &h){
+            release();
+            owner_ = h.owner_;
+            bufnum_ = h.bufnum_;
+            ptr_ = h.ptr_;
+            gen_ = h.gen_;
+            h.bufnum_ = 0;
+            h.ptr_ = nullptr;
+        }
+        return *this;
+    }
+
+    NTupleBufferReadHandle(const NTupleBufferReadHandle&) = delete;
+    NTupleBufferReadHandle& operator=(const NTupleBufferReadHandle&) = delete;
+
+    ~NTupleBufferReadHandle(){ release(); }
+
+    int release(){ return (bufnum_ != 0)? owner_->free(*this) : 0; }
+
+    pointer get() const{ return ptr_; }
+    pointer operator->() const{ return ptr_; }
+    explicit operator bool() const{ return ptr_ != nullptr; }
+    gen_t generation() const{ return gen_; } // of the last message read (kept after release)
+    int bufnum() const{ return bufnum_; }   // slot of the buffer (0 if none)
+
+private:
+    friend struct NTupleBufferHandleOps;
+
+    Owner* owner_ = nullptr;
+    int bufnum_ = 0;
+    pointer ptr_ = nullptr;
+    gen_t gen_ = 0;
+};
+
+
+template<typename Owner, typename T>
+class NTupleBufferWriteHandle
+{
+public:
+    typedef T* pointer;
+
+    NTupleBufferWriteHandle() = default;
+
+    NTupleBufferWriteHandle(NTupleBufferWriteHandle&& h) noexcept
+        : owner_(h.owner_), bufnum_(h.bufnum_), ptr_(h.ptr_)
+    {
+        h.bufnum_ = 0;
+        h.ptr_ = nullptr;
+    }
+
+    NTupleBufferWriteHandle& operator=(NTupleBufferWriteHandle&& h) noexcept{
+        if(this != &h){
+            commit();
+            owner_ = h.owner_;
+            bufnum_ = h.bufnum_;
+            ptr_ = h.ptr_;
+            h.bufnum_ = 0;
+            h.ptr_ = nullptr;
+        }
+        return *this;
+    }
+
+    NTupleBufferWriteHandle(const NTupleBufferWriteHandle&) = delete;
+    NTupleBufferWriteHandle& operator=(const NTupleBufferWriteHandle&) = delete;
+
+    ~NTupleBufferWriteHandle(){ commit(); }
+
+    int commit(){ return (bufnum_ != 0)? owner_->commit(*this) : 0; }
+    int discard(){ return (bufnum_ != 0)? owner_->free(*this) : 0; }
+
+    pointer get() const{ return ptr_; }
+    pointer operator->() const{ return ptr_; }
+    explicit operator bool() const{ return ptr_ != nullptr; }
+    int bufnum() const{ return bufnum_; } // slot of the buffer (0 if none)
+
+private:
+    friend struct NTupleBufferHandleOps;
+
+    Owner* owner_ = nullptr;
+    int bufnum_ = 0;
+    pointer ptr_ = nullptr;
+};
+
+
+// buffer side of the handles: operations on the control structure (used by buffer classes)
+struct NTupleBufferHandleOps
+{
+    enum ReadMode{
+        READ,
+        POP,
+        ONCE,
+        WAIT
+    };
+
+    template<typename H, typename O, typename Control, typename ToPtr>
+    static int // as start_reading(), pop(), start_reading_once() or start_reading_wait() of the buffer
+    read(H& h, O* owner, Control& control, ReadMode mode, std::chrono::nanoseconds timeout, ToPtr bufnum2ptr){
+        if(h.owner_ != owner){
+            h.release();
+            h.owner_ = owner;
+        }
+
+        int res;
+        switch(mode){
+        case POP:
+            res = control.pop(&h.bufnum_, &h.gen_);
+            break;
+        case ONCE:
+            res = control.start_reading_once(&h.bufnum_, &h.gen_); // (gen_ is the generation seen)
+            break;
+        case WAIT:
+            res = control.start_reading_wait(&h.bufnum_, timeout);
+            if(res >= 0){
+                h.gen_ = control.generation(h.bufnum_);
+            }
+            break;
+        case READ:
+        default:
+            res = control.start_reading(&h.bufnum_, &h.gen_);
+        }
+
+        if(res >= 0){
+            h.ptr_ = static_cast<typename H::pointer>(bufnum2ptr(h.bufnum_));
+        }
+
+        return (mode == ONCE)? ((res > 0)? 1 : res) : er(res);
+    }
+
+    template<typename H, typename Control>
+    static int release(H& h, Control& control, bool consume){
+        if(h.bufnum_ == 0){
+            return 0;
+        }
+
+        int res = er(consume? control.consume(&h.bufnum_) : control.free(&h.bufnum_));
+        if(res >= 0){
+            h.ptr_ = nullptr;
+        }
+        return res;
+    }
+
+    template<typename H, typename O, typename Control, typename ToPtr>
+    static int write(H& h, O* owner, Control& control, ToPtr bufnum2ptr){
+        if(h.owner_ != owner){
+            h.commit();
+            h.owner_ = owner;
+        }
+
+        int res = er(control.start_writing(&h.bufnum_));
+        if(res >= 0){
+            h.ptr_ = static_cast<typename H::pointer>(bufnum2ptr(h.bufnum_));
+        }else if(h.bufnum_ == 0){
+            h.ptr_ = nullptr; // committed, but no free buffer (NTupleBufferControlFA)
+        }
+        return res;
+    }
+
+    template<typename H, typename Control>
+    static int commit(H& h, Control& control){
+        if(h.bufnum_ == 0){
+            return 0;
+        }
+
+        int res = er(control.commit(&h.bufnum_));
+        if(res >= 0){
+            h.ptr_ = nullptr;
+        }
+        return res;
+    }
+
+private:
+    static int er(int fr){return (fr < 0)? fr : 0;}
+};
+
+
+} // namespace
+
+#endif
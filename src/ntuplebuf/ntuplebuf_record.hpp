@@ -0,0 +1,552 @@
+#ifndef ntuplebuf_record_hpp
+#define ntuplebuf_record_hpp
+
+/*
+Recording of committed messages to an append log of memory-mapped segment files, and replay.
+
+NTupleBufferRecorder sits beside the producer of a buffer (NTupleBufferDynAlloc, NTupleBufferShm):
+right after a commit it takes a reference to (pins) the committed buffer and queues it, a recorder
+thread copies the message to the log and releases the pin. So the producer pays one more RMW on the
+control word and no copying, and a message is recorded even if it is overwritten before any
+consumer reads it.
+
+    NTupleBufferDynAlloc<unsigned long, 15> buf(sizeof(Msg));
+    NTupleBufferRecorder<decltype(buf)> rec(buf, "/var/log/sensor");  // sensor.000000, sensor.000001, ...
+    rec.start();
+
+    rec.start_writing(&p); ... rec.commit(&p);  // (or buf.commit(&p); rec.capture();)
+
+    NTupleBufferReplayer<decltype(buf)> rp(buf, "/var/log/sensor");
+    rp.run(true);  // commits the recorded messages to buf again, with the original intervals
+
+Every queued message pins a buffer: NBUFS - 1 >= writers + consumers + MAX_PINS.
+If all pins are in use (the recorder thread lags), capture() drops the message (see dropped()).
+Only one producer may commit while recording. A message cleared by pop() / consume() before
+capture() pins it is lost for the recorder (see missed()).
+
+Log segment (a file of fixed size, the last one truncated to its used size):
+
+    | RecordSegmentHeader | record | record | ... | END record (continues in the next segment) |
+    record: | RecordHeader (size, gen, time) | data (padded to 8 bytes) |
+
+A zeroed record header (or the end of the file) ends the log. gen is the generation of the message
+in the recorded buffer, time is commit_clock() at capture (ntuplebuf_time.hpp).
+ */
+
+#include "ntuplebuf.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <algorithm> // std::min
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace ntuplebuf {
+
+
+struct RecordSegmentHeader
+{
+    enum: uint32_t{
+        MAGIC = 0x4e54524c, // "NTRL"
+        VERSION = 1
+    };
+
+    uint32_t magic;
+    uint32_t version;
+    uint64_t index;        // of the segment in the log (0, 1, ...)
+    uint64_t segment_size; // as created
+};
+
+struct RecordHeader
+{
+    enum: uint32_t{
+        MESSAGE = 1,
+        END = 2 // end of segment: the log continues in the next one
+    };
+
+    uint32_t kind; // 0: end of log
+    uint32_t size; // of data
+    uint64_t gen;
+    uint64_t time;
+};
+
+// a record of the log (data points into the mapping of the reader)
+struct LogRecord
+{
+    const void* data;
+    uint32_t size;
+    uint64_t gen;
+    uint64_t time;
+};
+
+
+struct RecordLogBase
+{
+    enum: int{
+        ERR_LOG_CLOSED = -161,      // the log has not been opened (see errcode())
+        ERR_LOG_BAD_SEGMENT = -162, // not a log segment, unsupported version or out of sequence
+        ERR_LOG_TOO_BIG = -163      // the record does not fit into an empty segment
+    };
+
+    static std::string segment_name(const std::string& prefix, uint64_t index){
+        char num[24];
+        std::snprintf(num, sizeof(num), ".%06llu", (unsigned long long)index);
+        return prefix + num;
+    }
+
+    static size_t padded(size_t size){ return (size + 7) & ~(size_t)7; }
+};
+
+
+// writer of the log (one thread)
+struct RecordLogWriter
+    : public RecordLogBase
+{
+    RecordLogWriter(const char* prefix, size_t segment_size)
+        : prefix_(prefix), segment_size_(segment_size)
+    {
+        errcode_ = open_segment(0);
+    }
+
+    RecordLogWriter(const RecordLogWriter&) = delete;
+    RecordLogWriter& operator=(const RecordLogWriter&) = delete;
+
+    ~RecordLogWriter(){ close(); }
+
+    int errcode() const{ return errcode_; } // 0 if the first segment has been created
+
+    int append(const void* data, uint32_t size, uint64_t gen, uint64_t time){
+        if(map_ == nullptr){
+            return ERR_LOG_CLOSED;
+        }
+
+        size_t need = sizeof(RecordHeader) + padded(size);
+        if(sizeof(RecordSegmentHeader) + need + sizeof(RecordHeader) > segment_size_){
+            return ERR_LOG_TOO_BIG;
+        }
+        if(used_ + need + sizeof(RecordHeader) > segment_size_){ // (room for END is kept)
+            header_at(used_)->kind = RecordHeader::END;
+            used_ += sizeof(RecordHeader);
+            int res = open_segment(index_ + 1);
+            if(res < 0){
+                return res;
+            }
+        }
+
+        RecordHeader* h = header_at(used_);
+        h->size = size;
+        h->gen = gen;
+        h->time = time;
+        std::memcpy(h + 1, data, size);
+        h->kind = RecordHeader::MESSAGE; // (the last one)
+        used_ += need;
+        return 0;
+    }
+
+    void close(){
+        if(map_ != nullptr){
+            munmap(map_, segment_size_);
+            map_ = nullptr;
+            if(ftruncate(fd_, used_) != 0){ // (the end of the file ends the log)
+                errcode_ = -errno;
+            }
+            ::close(fd_);
+        }
+    }
+
+protected:
+
+    RecordHeader* header_at(size_t offset){ return reinterpret_cast<RecordHeader*>(map_ + offset); }
+
+    int open_segment(uint64_t index){
+        close();
+
+        std::string name = segment_name(prefix_, index);
+        fd_ = ::open(name.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0640);
+        if(fd_ < 0){
+            return -errno;
+        }
+        if(ftruncate(fd_, segment_size_) != 0){ // (zero-filled: every unwritten header ends the log)
+            int err = -errno;
+            ::close(fd_);
+            return err;
+        }
+        void* p = mmap(nullptr, segment_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if(p == MAP_FAILED){
+            int err = -errno;
+            ::close(fd_);
+            return err;
+        }
+
+        map_ = static_cast<uint8_t*>(p);
+        index_ = index;
+        RecordSegmentHeader* sh = reinterpret_cast<RecordSegmentHeader*>(map_);
+        sh->magic = RecordSegmentHeader::MAGIC;
+        sh->version = RecordSegmentHeader::VERSION;
+        sh->index = index;
+        sh->segment_size = segment_size_;
+        used_ = sizeof(RecordSegmentHeader);
+        return 0;
+    }
+
+    std::string prefix_;
+    size_t segment_size_;
+    int errcode_ = 0;
+
+    int fd_ = -1;
+    uint8_t* map_ = nullptr;
+    uint64_t index_ = 0;
+    size_t used_ = 0;
+};
+
+
+// sequential reader of the log
+struct RecordLogReader
+    : public RecordLogBase
+{
+    explicit RecordLogReader(const char* prefix)
+        : prefix_(prefix)
+    {
+        errcode_ = open_segment(0);
+    }
+
+    RecordLogReader(const RecordLogReader&) = delete;
+    RecordLogReader& operator=(const RecordLogReader&) = delete;
+
+    ~RecordLogReader(){ close(); }
+
+    int errcode() const{ return errcode_; } // 0 if the first segment has been opened
+
+    int // returns 1 if *r is the next record (valid until the next call), 0 at the end of the log, negative on error
+    next(LogRecord* r){
+        for(;;){
+            if(map_ == nullptr){
+                return ERR_LOG_CLOSED;
+            }
+
+            const RecordHeader* h = (pos_ + sizeof(RecordHeader) <= size_)?
+                    reinterpret_cast<const RecordHeader*>(map_ + pos_) : nullptr;
+
+            if(h == nullptr || h->kind == 0){
+                return 0;
+            }
+            if(h->kind == RecordHeader::END){
+                int res = open_segment(index_ + 1);
+                if(res < 0){
+                    return res;
+                }
+                continue;
+            }
+            if(h->kind != RecordHeader::MESSAGE || pos_ + sizeof(RecordHeader) + h->size > size_){
+                return ERR_LOG_BAD_SEGMENT;
+            }
+
+            r->data = h + 1;
+            r->size = h->size;
+            r->gen = h->gen;
+            r->time = h->time;
+            pos_ += sizeof(RecordHeader) + padded(h->size);
+            return 1;
+        }
+    }
+
+protected:
+
+    void close(){
+        if(map_ != nullptr){
+            munmap(const_cast<uint8_t*>(map_), size_);
+            map_ = nullptr;
+        }
+    }
+
+    int open_segment(uint64_t index){
+        close();
+
+        std::string name = segment_name(prefix_, index);
+        int fd = ::open(name.c_str(), O_RDONLY);
+        if(fd < 0){
+            return -errno;
+        }
+        struct stat st;
+        if(fstat(fd, &st) != 0){
+            int err = -errno;
+            ::close(fd);
+            return err;
+        }
+        if((size_t)st.st_size < sizeof(RecordSegmentHeader)){
+            ::close(fd);
+            return ERR_LOG_BAD_SEGMENT;
+        }
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd); // the mapping remains
+        if(p == MAP_FAILED){
+            return -errno;
+        }
+
+        map_ = static_cast<const uint8_t*>(p);
+        size_ = st.st_size;
+        const RecordSegmentHeader* sh = reinterpret_cast<const RecordSegmentHeader*>(map_);
+        if(sh->magic != RecordSegmentHeader::MAGIC || sh->version != RecordSegmentHeader::VERSION
+                || sh->index != index){
+            close();
+            return ERR_LOG_BAD_SEGMENT;
+        }
+
+        index_ = index;
+        pos_ = sizeof(RecordSegmentHeader);
+        return 0;
+    }
+
+    std::string prefix_;
+    int errcode_ = 0;
+
+    const uint8_t* map_ = nullptr;
+    size_t size_ = 0;
+    uint64_t index_ = 0;
+    size_t pos_ = 0;
+};
+
+
+template<
+    typename Buffer,
+    unsigned MAX_PINS = 4 // messages queued for the recorder thread (each pins a buffer)
+>
+struct NTupleBufferRecorder
+{
+    typedef int errcode_t;
+    typedef typename Buffer::gen_t gen_t;
+
+    NTupleBufferRecorder(Buffer& buf, const char* prefix, size_t segment_size = 64 << 20)
+        : buf_(buf), log_(prefix, segment_size)
+    {}
+
+    NTupleBufferRecorder(const NTupleBufferRecorder&) = delete;
+    NTupleBufferRecorder& operator=(const NTupleBufferRecorder&) = delete;
+
+    ~NTupleBufferRecorder(){ // (the producer shall be gone)
+        stop();
+        drain();
+    }
+
+    errcode_t errcode() const{ return log_.errcode(); }
+
+    // sleep of the recorder thread when the queue is empty (0: yield only)
+    void set_idle_sleep(unsigned us){ idle_sleep_us_ = us; }
+
+    // starts the recorder thread
+    void start(){
+        if(!thread_.joinable()){
+            stop_.store(false);
+            thread_ = std::thread([this](){ run(); });
+        }
+    }
+
+    // records the queued messages, then stops the recorder thread (the log stays open)
+    void stop(){
+        if(thread_.joinable()){
+            stop_.store(true);
+            thread_.join();
+        }
+    }
+
+
+    // producer side (the producer thread):
+
+    // pins the current message and queues it for recording (call right after a commit)
+    void capture(){ capture_impl(nullptr); }
+
+    errcode_t start_writing(void** pptr){ // (commits the previous buffer, if any)
+        void* prev = *pptr;
+        auto res = buf_.start_writing(pptr);
+        if(res >= 0 && prev != nullptr){
+            capture_impl(prev);
+        }
+        return res;
+    }
+
+    errcode_t commit(void** pptr){
+        void* committed = *pptr;
+        auto res = buf_.commit(pptr);
+        if(res >= 0){
+            capture_impl(committed);
+        }
+        return res;
+    }
+
+    template<typename Transaction>
+    errcode_t commit_transaction(Transaction& tra, bool force){
+        auto res = buf_.commit_transaction(tra, force);
+        if(res == 0){
+            capture_impl(tra.new_buf);
+        }
+        return res;
+    }
+
+
+    // records the queued messages in the calling thread (instead of the recorder thread: do not start() it)
+    unsigned // returns the number of messages taken from the queue
+    drain(){
+        size_t size = buf_.get_data_size();
+        uint64_t start = tail_.load(std::memory_order_relaxed);
+        uint64_t head = head_.load(std::memory_order_acquire);
+
+        uint64_t tail = start;
+        for(; tail != head; ++tail){
+            Entry& e = queue_[tail % MAX_PINS];
+            int res = log_.append(e.ptr, (uint32_t)size, e.gen, e.time);
+            if(res < 0){
+                log_error_.store(res, std::memory_order_relaxed);
+            }else{
+                recorded_.fetch_add(1, std::memory_order_relaxed);
+            }
+            buf_.free(&e.ptr);
+            tail_.store(tail + 1, std::memory_order_release);
+        }
+        return (unsigned)(tail - start);
+    }
+
+    uint64_t recorded() const{ return recorded_.load(std::memory_order_relaxed); }
+    uint64_t dropped() const{ return dropped_.load(std::memory_order_relaxed); } // no free pin
+    uint64_t missed() const{ return missed_.load(std::memory_order_relaxed); }   // consumed before pinned
+    int log_error() const{ return log_error_.load(std::memory_order_relaxed); }   // the last append error
+
+
+protected:
+
+    struct Entry{
+        void* ptr;
+        gen_t gen;
+        uint64_t time;
+    };
+
+    void capture_impl(void* committed){
+        uint64_t t = commit_clock();
+        void* p = nullptr;
+        gen_t gen = 0;
+        if(buf_.start_reading(&p, &gen) < 0 || p == nullptr || (committed != nullptr && p != committed)){
+            buf_.free(&p);
+            missed_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if(gen == last_gen_){ // (capture() without a new commit)
+            buf_.free(&p);
+            return;
+        }
+        last_gen_ = gen;
+
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        if(head - tail_.load(std::memory_order_acquire) >= MAX_PINS){
+            buf_.free(&p);
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        queue_[head % MAX_PINS] = Entry{p, gen, t};
+        head_.store(head + 1, std::memory_order_release);
+    }
+
+    void run(){
+        for(;;){
+            bool stopping = stop_.load(); // (then the queue is drained once more)
+            if(drain() == 0){
+                if(stopping){
+                    break;
+                }
+                if(idle_sleep_us_ != 0){
+                    std::this_thread::sleep_for(std::chrono::microseconds(idle_sleep_us_));
+                }else{
+                    std::this_thread::yield();
+                }
+            }
+        }
+    }
+
+    Buffer& buf_;
+    RecordLogWriter log_;
+
+    // producer thread only:
+    gen_t last_gen_ = 0;
+
+    Entry queue_[MAX_PINS];
+    alignas(cache_line_size) std::atomic<uint64_t> head_ = {0}; // (written by the producer)
+    alignas(cache_line_size) std::atomic<uint64_t> tail_ = {0}; // (written by the recorder thread)
+
+    std::atomic<uint64_t> recorded_ = {0};
+    std::atomic<uint64_t> dropped_ = {0};
+    std::atomic<uint64_t> missed_ = {0};
+    std::atomic<int> log_error_ = {0};
+
+    unsigned idle_sleep_us_ = 50;
+    std::atomic<bool> stop_ = {false};
+    std::thread thread_;
+};
+
+
+// commits recorded messages to a buffer (the buffer may be of other type than the recorded one)
+template<typename Buffer>
+struct NTupleBufferReplayer
+{
+    typedef int errcode_t;
+
+    NTupleBufferReplayer(Buffer& buf, const char* prefix)
+        : buf_(buf), log_(prefix)
+    {}
+
+    errcode_t errcode() const{ return log_.errcode(); }
+
+    // replays the rest of the log: with the recorded intervals between commits (original_speed)
+    // or as fast as possible; returns the number of messages committed or negative on error.
+    // Messages longer than the buffer are cut, shorter ones leave the rest of the buffer unchanged.
+    long run(bool original_speed){
+        long n = 0;
+        size_t size = buf_.get_data_size();
+        uint64_t t0 = 0;
+        uint64_t c0 = 0;
+        void* p = nullptr;
+
+        LogRecord r;
+        int res;
+        while((res = log_.next(&r)) > 0){
+            if(original_speed){
+                if(n == 0){
+                    t0 = r.time;
+                    c0 = commit_clock();
+                }
+                while(commit_clock() - c0 < r.time - t0){
+                    std::this_thread::yield();
+                }
+            }
+
+            int wres = buf_.start_writing(&p);
+            if(wres < 0){
+                return wres;
+            }
+            std::memcpy(p, r.data, std::min<size_t>(r.size, size));
+            wres = buf_.commit(&p);
+            if(wres < 0){
+                return wres;
+            }
+            ++n;
+        }
+
+        return (res < 0)? res : n;
+    }
+
+protected:
+    Buffer& buf_;
+    RecordLogReader log_;
+};
+
+
+} // namespace
+
+#endif
@@ -0,0 +1,274 @@
+#ifndef ntuplebuf_relay_hpp
+#define ntuplebuf_relay_hpp
+
+/*
+Relay node for fan-out of one stream to many consumers (more than one control word can serve).
+
+The relay reads its source (NTupleBufferDynAlloc, NTupleBufferShm or another relay) as a single
+participant and re-publishes the source buffers (pointers, no copying) to its own group of consumers
+through its own control word. Consumers of different groups do not touch each other's control words
+nor the source's one, so the contention on every word is limited by the group size.
+
+    producer -> root buffer -> relay 1 -> consumers 1..13
+                            -> relay 2 -> relay 2.1 -> consumers ...
+                                       -> relay 2.2 -> consumers ...
+
+Every group slot keeps a reference to (pins) the source buffer it is mapped to. The pin is released
+when no consumer references the slot any more (checked by the relay on every update).
+A relay holds at most MAX_PINS source references, so it counts as MAX_PINS participants of its source:
+source NBUFS - 1 >= number of writers + sum of MAX_PINS of its relays.
+If all pins are in use (slow consumers still read old messages) the relay skips the update,
+so its group lags behind the source (see lagged()). MAX_PINS = 3 tolerates one slow consumer per group.
+
+Example for ~200 consumers with 64-bit control words (NBUFS 15):
+root (producer + 4 relays * 3 pins), 4 relays (4 sub-relays * 3 pins each) and 16 sub-relays
+(13 consumers each).
+
+Only one thread at a time may call update()/update_wait() (the relay is the only writer of its group).
+The consumer API is the reader part of NTupleBufferDynAlloc API.
+ */
+
+#include "ntuplebuf.hpp"
+#include <cstddef>
+#include <algorithm> // std::min
+#include <thread>
+
+
+namespace ntuplebuf {
+
+
+template<
+    typename Source,
+    typename ControlCodeT,
+    unsigned NBUFS,
+    unsigned MAX_PINS = 3, // source references held by the relay (at least 2)
+    typename MemOrder = MemOrderSeqCst,
+    template<typename, unsigned, typename> class ControlEngine = NTupleBufferControl
+>
+struct NTupleBufferRelay
+{
+    typedef int errcode_t;
+    typedef  ControlEngine<ControlCodeT, NBUFS, MemOrder> ControlCode;
+    typedef typename ControlCode::gen_t gen_t;
+    typedef typename Source::gen_t source_gen_t;
+
+    static_assert(MAX_PINS >= 2, "the relay needs at least 2 pins (published + new)");
+
+    enum: errcode_t{
+        ERR_FOREIGN_PTR = -131 // the pointer was not obtained from this relay
+    };
+
+
+    explicit NTupleBufferRelay(Source& src)
+        : src_(src)
+    {}
+
+    NTupleBufferRelay(const NTupleBufferRelay&) = delete;
+    NTupleBufferRelay& operator=(const NTupleBufferRelay&) = delete;
+
+    ~NTupleBufferRelay(){ // (consumers shall be gone)
+        for(unsigned i = 0; i < NBUFS; ++i){
+            void* p = map_[i].load(std::memory_order_relaxed);
+            if(p != nullptr){
+                src_.free(&p);
+            }
+        }
+    }
+
+
+    // relay side:
+
+    int // 1 if new source message is published to the group, 0 if nothing new (or no free pin), negative on error
+    update(){
+        unpin_unused();
+
+        if(pins_ >= MAX_PINS){
+            lagged_.fetch_add(1, std::memory_order_relaxed);
+            return 0;
+        }
+
+        void* p = nullptr;
+        source_gen_t gen = 0;
+        int res = src_.start_reading(&p, &gen);
+        if(res < 0){
+            return res;
+        }
+
+        if(p == nullptr || gen == source_gen_){
+            src_.free(&p);
+            return 0; // no (new) data
+        }
+
+        int bufnum = 0;
+        res = control.start_writing(&bufnum);
+        if(res < 0){
+            src_.free(&p);
+            return res;
+        }
+
+        // the slot may still pin a source buffer (its last consumer may have freed it after unpin_unused())
+        void* old = map_[bufnum - 1].exchange(p, std::memory_order_relaxed); // (published by commit)
+        if(old != nullptr){
+            src_.free(&old);
+            --pins_;
+        }
+        ++pins_;
+
+        res = control.commit(&bufnum);
+        if(res < 0){
+            return res;
+        }
+
+        source_gen_ = gen;
+        published_ = p;
+        return 1;
+    }
+
+    // waits for new source data (up to timeout), then update()
+    int update_wait(std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()){
+        if(pins_ >= MAX_PINS){
+            unpin_unused();
+            if(pins_ >= MAX_PINS){
+                std::this_thread::yield(); // only consumers can free a pin (they do not notify)
+            }
+        }else{
+            src_.wait_for_update(published_, timeout);
+        }
+
+        return update();
+    }
+
+    unsigned long lagged() const{ return lagged_.load(std::memory_order_relaxed); } // updates skipped for lack of pins
+
+    ControlCode& get_control(){ return control; }
+
+
+    // consumer side (pointers point to source buffers):
+
+    errcode_t start_reading(void** pptr){ // pptr shall point to previous pointer to buffer (or nullptr)
+        return start_reading(pptr, nullptr);
+    }
+
+    errcode_t start_reading(void** pptr, gen_t* p_gen){
+        int bufnum = ptr2bufnum(*pptr);
+        if(bufnum < 0){
+            return ERR_FOREIGN_PTR;
+        }
+
+        auto res = er(control.start_reading(&bufnum, p_gen));
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+        }
+        return res;
+    }
+
+    int start_reading_once(void** pptr, gen_t* p_gen_seen){ // 1: new message, 0: already seen
+        int bufnum = ptr2bufnum(*pptr);
+        if(bufnum < 0){
+            return ERR_FOREIGN_PTR;
+        }
+
+        int res = control.start_reading_once(&bufnum, p_gen_seen);
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+        }
+        return (res > 0)? 1 : res;
+    }
+
+    errcode_t start_reading_wait(
+            void** pptr,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        int bufnum = ptr2bufnum(*pptr);
+        if(bufnum < 0){
+            return ERR_FOREIGN_PTR;
+        }
+
+        auto res = er(control.start_reading_wait(&bufnum, timeout));
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+        }
+        return res;
+    }
+
+    int // returns 1 if updated, 0 on timeout
+    wait_for_update(
+            void* ptr_seen,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        return control.wait_for_update(std::max(0, ptr2bufnum(ptr_seen)), timeout);
+    }
+
+    void set_wait_spin(unsigned spin){ control.set_wait_spin(spin); }
+
+    errcode_t free(void** pptr){
+        int bufnum = ptr2bufnum(*pptr);
+        if(bufnum < 0){
+            return ERR_FOREIGN_PTR;
+        }
+
+        auto res = er(control.free(&bufnum));
+        if(res >= 0){
+           *pptr = nullptr;
+        }
+        return res;
+    }
+
+    gen_t generation(void* ptr){ return control.generation(std::max(0, ptr2bufnum(ptr))); }
+    uint64_t commit_time(void* ptr){ return control.commit_time(std::max(0, ptr2bufnum(ptr))); }
+
+
+protected:
+
+    errcode_t er(int fr){return std::min(0, fr);}
+
+    // releases source buffers of the slots nobody references
+    void unpin_unused(){
+        for(unsigned i = 0; i < NBUFS && pins_ > 0; ++i){
+            void* p = map_[i].load(std::memory_order_relaxed);
+            if(p != nullptr && control.is_free(i + 1)){
+                map_[i].store(nullptr, std::memory_order_relaxed);
+                src_.free(&p);
+                --pins_;
+            }
+        }
+    }
+
+    // a source buffer is mapped to one slot at most (it can not be republished while pinned),
+    // and the slot held by the caller is not remapped, so the search is race-free
+    int ptr2bufnum(void* ptr){
+        if(ptr == nullptr){
+            return 0;
+        }
+
+        for(unsigned i = 0; i < NBUFS; ++i){
+            if(map_[i].load(std::memory_order_relaxed) == ptr){
+                return i + 1;
+            }
+        }
+
+        return -1;
+    }
+
+    void* bufnum2ptr(int bufnum){
+        return (bufnum != 0)
+            ? map_[bufnum - 1].load(std::memory_order_relaxed)
+            : nullptr;
+    }
+
+    // relay thread only:
+    Source& src_;
+    unsigned pins_ = 0;
+    source_gen_t source_gen_ = 0;
+    void* published_ = nullptr; // source buffer of the last update (pinned while current)
+    std::atomic<unsigned long> lagged_ = {0};
+
+    std::atomic<void*> map_[NBUFS] = {}; // slot -> source buffer (nullptr if unpinned)
+
+    char control_pad_[cache_line_size]; // keeps relay thread's writes (pins_, ...) off the consumers' lines
+    ControlCode control;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,527 @@
+#ifndef ntuplebuf_shm_hpp
+#define ntuplebuf_shm_hpp
+
+/*
+N-tuple buffer in memory shared between processes (POSIX shm_open or any mappable fd, e.g. memfd).
+
+The mapping contains a versioned header (layout description), the control structure and the
+message buffers:
+
+    | ShmHeader | control | buf 1 | buf 2 | ... | buf NBUFS |
+
+The creator sizes the mapping, constructs the control structure and sets "ready" flag at last;
+other processes attach to it and check the layout against their own template parameters.
+The API is the same as of NTupleBufferDynAlloc (pointers are valid in the calling process only).
+
+Requirements: the atomics of the control engine shall be lock-free (hence address-free);
+messages shall not contain pointers (e.g. be trivially copyable).
+ */
+
+#include "ntuplebuf.hpp"
+#include "ntuplebuf_fa.hpp"
+#include "ntuplebuf_handle.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+#include <new>
+#include <algorithm> // std::min
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace ntuplebuf {
+
+
+struct ShmHeader
+{
+    enum: uint32_t{
+        MAGIC = 0x4e545042, // "NTPB"
+        VERSION = 2
+    };
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nbufs;
+    uint32_t ccode_size;   // size of control code type (as resolved by the engine)
+    uint32_t engine_id;    // ControlCode::engine_id (engines may have the same control_size)
+    uint32_t wait;         // MemOrder::wait (producers of a NoWait buffer would not wake waiters)
+    uint64_t control_size; // sizeof of control structure
+    uint64_t data_size;    // size of message as passed by creator
+    uint64_t slot_size;    // size of one buffer (as allocated)
+    uint64_t slot_align;
+    uint64_t control_offset;
+    uint64_t data_offset;
+    uint64_t total_size;
+    std::atomic<uint32_t> ready; // set by creator when everything else is initialized
+};
+
+
+template<
+    typename ControlCodeT,
+    unsigned NBUFS,
+    typename MemOrder = MemOrderSeqCst,
+    template<typename, unsigned, typename> class ControlEngine = NTupleBufferControl
+>
+struct NTupleBufferShm
+{
+    typedef int errcode_t;
+    typedef  ControlEngine<ControlCodeT, NBUFS, MemOrder> ControlCode;
+    typedef typename ControlCode::Transaction CCTransaction;
+    typedef typename ControlCode::gen_t gen_t;
+
+    struct TypelessTransacion{
+      errcode_t errcode;
+      void* old_buf;
+      void* new_buf;
+    };
+
+    // handles keep both bufnum and pointer (see ntuplebuf_handle.hpp)
+    typedef NTupleBufferReadHandle<NTupleBufferShm, void> ReadHandle;
+    typedef NTupleBufferWriteHandle<NTupleBufferShm, void> WriteHandle;
+
+    // errors specific to shared mapping (system errors are reported as -errno)
+    enum: errcode_t{
+        ERR_NOT_OPEN = -120,
+        ERR_BAD_HEADER = -121, // not an ntuple buffer or unsupported version
+        ERR_LAYOUT = -122,     // created with other template parameters or data size
+        ERR_NOT_READY = -123   // creator has not initialized the mapping yet (try later)
+    };
+
+#   if defined(__cpp_lib_atomic_is_always_lock_free)
+    static_assert(
+            ControlAtomic<typename ControlCode::CCodeT>::always_lock_free && std::atomic<gen_t>::is_always_lock_free,
+            "shared memory requires lock-free atomics"
+    );
+#   endif
+
+
+    // creates (create == true, fails if exists) or attaches to named shared memory object;
+    // data_size is ignored on attach if 0 (otherwise it is checked)
+    NTupleBufferShm(const char* name, size_t data_size, bool create){
+        int fd = shm_open(name, create? (O_CREAT | O_EXCL | O_RDWR) : O_RDWR, 0660);
+        if(fd < 0){
+            errcode_ = -errno;
+            return;
+        }
+
+        errcode_ = create? init(fd, data_size) : attach(fd, data_size);
+        close(fd); // the mapping remains
+    }
+
+    // the same for already opened file descriptor (e.g. memfd_create() or received via unix socket);
+    // fd is not closed
+    NTupleBufferShm(int fd, size_t data_size, bool create){
+        errcode_ = create? init(fd, data_size) : attach(fd, data_size);
+    }
+
+    NTupleBufferShm(const NTupleBufferShm&) = delete;
+    NTupleBufferShm& operator=(const NTupleBufferShm&) = delete;
+
+    ~NTupleBufferShm(){
+        if(map_ != nullptr){
+            munmap(map_, map_size_);
+        }
+    }
+
+    // removes the name (existing mappings stay valid)
+    static int unlink(const char* name){
+        return (shm_unlink(name) == 0)? 0 : -errno;
+    }
+
+    errcode_t errcode() const{ return errcode_; } // 0 if created/attached successfully
+
+    size_t get_data_size(){ return data_size_; };
+
+    ControlCode& get_control(){ return *control_; }
+
+
+    errcode_t start_reading(void** pptr){ // pptr shall point to previous pointer to buffer (or nullptr)
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control_->start_reading(&bufnum));
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+        }
+        return res;
+    }
+
+    errcode_t start_reading(void** pptr, gen_t* p_gen){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control_->start_reading(&bufnum, p_gen));
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+        }
+        return res;
+    }
+
+    errcode_t start_reading_wait(
+            void** pptr,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control_->start_reading_wait(&bufnum, timeout));
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+        }
+        return res;
+    }
+
+    int // returns 1 if updated, 0 on timeout
+    wait_for_update(
+            void* ptr_seen,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        return control_->wait_for_update(ptr2bufnum(ptr_seen), timeout);
+    }
+
+    errcode_t pop(void** pptr){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control_->pop(&bufnum));
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+        }
+        return res;
+    }
+
+    errcode_t free(void** pptr){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control_->free(&bufnum));
+        if(res >= 0){
+           *pptr = nullptr;
+        }
+        return res;
+    }
+
+    errcode_t consume(void** pptr){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control_->consume(&bufnum));
+        if(res >= 0){
+           *pptr = nullptr;
+        }
+        return res;
+    }
+
+    errcode_t start_writing(void** pptr){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control_->start_writing(&bufnum));
+        if(res >= 0 || bufnum == 0){ // (bufnum == 0 on error: committed, but no free buffer)
+            *pptr = bufnum2ptr(bufnum);
+        }
+        return res;
+    }
+
+    errcode_t commit(void** pptr){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control_->commit(&bufnum));
+        if(res >= 0){
+           *pptr = nullptr;
+        }
+        return res;
+    }
+
+    TypelessTransacion start_transaction(){
+        CCTransaction tr = control_->start_transaction();
+        TypelessTransacion ret = {
+                tr.errcode,
+                bufnum2ptr(tr.old_buf),
+                bufnum2ptr(tr.new_buf),
+        };
+
+        return ret;
+    }
+
+    errcode_t commit_transaction(TypelessTransacion& tra, bool force){
+        if(tra.errcode != 0){
+            return -91;
+        }
+
+        CCTransaction cctra = {
+                0,
+                ptr2bufnum(tra.old_buf),
+                ptr2bufnum(tra.new_buf)
+        };
+
+        return control_->commit_transaction(cctra, force);
+    }
+
+    // multi-producer "latest value" commit, e.g. by producers in different processes
+    // (see NTupleBufferControl::commit_ordered())
+    errcode_t commit_ordered(TypelessTransacion& tra, CommitOrder order){
+        if(tra.errcode != 0){
+            return -91;
+        }
+
+        CCTransaction cctra = {
+                0,
+                ptr2bufnum(tra.old_buf),
+                ptr2bufnum(tra.new_buf)
+        };
+
+        return control_->commit_ordered(cctra, order);
+    }
+
+    gen_t generation(void* ptr){ return control_->generation(ptr2bufnum(ptr)); }
+    uint64_t commit_time(void* ptr){ return control_->commit_time(ptr2bufnum(ptr)); } // (see ntuplebuf_time.hpp)
+    CommitOrder order(void* ptr){ return control_->order(ptr2bufnum(ptr)); }
+
+
+    // the same with handles (as of NTupleBufferDynAlloc):
+
+    errcode_t start_reading(ReadHandle& h){ return read_h(h, HOps::READ); }
+    errcode_t pop(ReadHandle& h){ return read_h(h, HOps::POP); }
+    int start_reading_once(ReadHandle& h){ return read_h(h, HOps::ONCE); } // 1: new message, 0: already seen
+
+    errcode_t start_reading_wait(
+            ReadHandle& h,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        return read_h(h, HOps::WAIT, timeout);
+    }
+
+    errcode_t free(ReadHandle& h){ return HOps::release(h, *control_, false); }
+    errcode_t consume(ReadHandle& h){ return HOps::release(h, *control_, true); }
+
+    errcode_t start_writing(WriteHandle& h){
+        return HOps::write(h, this, *control_, [this](int b){ return bufnum2ptr(b); });
+    }
+    errcode_t commit(WriteHandle& h){ return HOps::commit(h, *control_); }
+    errcode_t free(WriteHandle& h){ return HOps::release(h, *control_, false); } // drop without publishing
+
+
+private:
+
+    typedef NTupleBufferHandleOps HOps;
+
+    int read_h(ReadHandle& h, HOps::ReadMode mode, std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()){
+        return HOps::read(h, this, *control_, mode, timeout, [this](int b){ return bufnum2ptr(b); });
+    }
+
+    static uint64_t round_up(uint64_t v, uint64_t algn){ return ((v + algn - 1) / algn) * algn; }
+
+    // layout for given data size (everything but the ready flag)
+    static void layout(ShmHeader& h, size_t data_size){
+        h.magic = ShmHeader::MAGIC;
+        h.version = ShmHeader::VERSION;
+        h.nbufs = NBUFS;
+        h.ccode_size = sizeof(typename ControlCode::CCodeT);
+        h.engine_id = ControlCode::engine_id;
+        h.wait = MemOrder::wait? 1 : 0;
+        h.control_size = sizeof(ControlCode);
+        h.data_size = data_size;
+        h.slot_align = alignof(std::max_align_t);
+        h.slot_size = round_up(data_size, h.slot_align);
+        h.control_offset = round_up(sizeof(ShmHeader), cache_line_size);
+        h.data_offset = round_up(h.control_offset + sizeof(ControlCode), cache_line_size);
+        h.total_size = h.data_offset + NBUFS * h.slot_size;
+    }
+
+    errcode_t init(int fd, size_t data_size){
+        ShmHeader l;
+        layout(l, data_size);
+
+        if(ftruncate(fd, (off_t)l.total_size) != 0){ // (zero-filled)
+            return -errno;
+        }
+
+        errcode_t res = map(fd, l.total_size);
+        if(res != 0){
+            return res;
+        }
+
+        ShmHeader* h = static_cast<ShmHeader*>(map_);
+        layout(*h, data_size);
+
+        new(static_cast<uint8_t*>(map_) + h->control_offset) ControlCode;
+
+        set_pointers(*h);
+        h->ready.store(1, std::memory_order_release);
+        return 0;
+    }
+
+    errcode_t attach(int fd, size_t data_size){
+        struct stat st;
+        if(fstat(fd, &st) != 0){
+            return -errno;
+        }
+
+        if((size_t)st.st_size < sizeof(ShmHeader)){
+            return ERR_NOT_READY; // not sized yet
+        }
+
+        errcode_t res = map(fd, (size_t)st.st_size);
+        if(res != 0){
+            return res;
+        }
+
+        ShmHeader* h = static_cast<ShmHeader*>(map_);
+        if(h->ready.load(std::memory_order_acquire) == 0){
+            return ERR_NOT_READY;
+        }
+
+        if(h->magic != ShmHeader::MAGIC || h->version != ShmHeader::VERSION){
+            return ERR_BAD_HEADER;
+        }
+
+        ShmHeader l;
+        layout(l, (size_t)h->data_size);
+        if(
+                (data_size != 0 && data_size != h->data_size)
+                || h->nbufs != l.nbufs || h->ccode_size != l.ccode_size
+                || h->engine_id != l.engine_id || h->wait != l.wait || h->control_size != l.control_size
+                || h->slot_size != l.slot_size || h->slot_align != l.slot_align
+                || h->control_offset != l.control_offset || h->data_offset != l.data_offset
+                || h->total_size != l.total_size || l.total_size > map_size_
+        ){
+            return ERR_LAYOUT;
+        }
+
+        set_pointers(*h);
+        return 0;
+    }
+
+    errcode_t map(int fd, size_t size){
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(p == MAP_FAILED){
+            return -errno;
+        }
+        map_ = p;
+        map_size_ = size;
+        return 0;
+    }
+
+    void set_pointers(const ShmHeader& h){
+        data_size_ = (size_t)h.data_size;
+        sz1buf_ = (size_t)h.slot_size;
+        control_ = reinterpret_cast<ControlCode*>(static_cast<uint8_t*>(map_) + h.control_offset);
+        data_ = static_cast<uint8_t*>(map_) + h.data_offset;
+    }
+
+    errcode_t er(int fr){return std::min(0, fr);}
+
+    int ptr2bufnum(void* ptr){
+        uint8_t* p = (uint8_t*)ptr;
+        return (p == nullptr)? 0 : ((p - data_) / sz1buf_ + 1);
+    }
+
+    void* bufnum2ptr(int bufnum){
+        return (bufnum != 0)
+            ? data_ + sz1buf_* (bufnum -1)
+            : nullptr;
+    }
+
+    errcode_t errcode_ = ERR_NOT_OPEN;
+    void* map_ = nullptr;
+    size_t map_size_ = 0;
+    size_t data_size_ = 0;
+    size_t sz1buf_ = 1; // size of 1 buffer
+    ControlCode* control_ = nullptr;
+    uint8_t* data_ = nullptr;
+};
+
+/*
+Stats page (see ntuplebuf_stats.hpp) in a named shared memory object.
+The process being monitored creates it (the page becomes the page of the process), a monitor
+attaches to it read-only and reads the counters without touching the hot path of the buffers:
+
+    NTupleBufferStatsShm stats("/app_stats", true);    // in the application, before buffers are used
+    NTupleBufferStatsShm mon("/app_stats", false);     // in the monitor
+    mon.page()->total(StatsPage::CAS_RETRY);
+ */
+struct NTupleBufferStatsShm
+{
+    typedef int errcode_t;
+
+    // (the same meaning as of NTupleBufferShm errors)
+    enum: errcode_t{
+        ERR_NOT_OPEN = -120,
+        ERR_BAD_HEADER = -121, // not a stats page or built with other StatsPage layout
+        ERR_NOT_READY = -123
+    };
+
+    NTupleBufferStatsShm(const char* name, bool create){
+        int fd = shm_open(name, create? (O_CREAT | O_EXCL | O_RDWR) : O_RDONLY, 0660);
+        if(fd < 0){
+            errcode_ = -errno;
+            return;
+        }
+
+        errcode_ = create? init(fd) : attach(fd);
+        close(fd); // the mapping remains
+    }
+
+    NTupleBufferStatsShm(const NTupleBufferStatsShm&) = delete;
+    NTupleBufferStatsShm& operator=(const NTupleBufferStatsShm&) = delete;
+
+    ~NTupleBufferStatsShm(){ // (the creator: buffers of the process shall not be used any more)
+        if(page_ != nullptr && &stats_page() == page_){
+            stats_set_page(default_page_);
+        }
+        if(map_ != nullptr){
+            munmap(map_, sizeof(StatsPage));
+        }
+    }
+
+    static int unlink(const char* name){
+        return (shm_unlink(name) == 0)? 0 : -errno;
+    }
+
+    errcode_t errcode() const{ return errcode_; } // 0 if created/attached successfully
+
+    const StatsPage* page() const{ return page_; }
+
+
+private:
+
+    errcode_t init(int fd){
+        if(ftruncate(fd, (off_t)sizeof(StatsPage)) != 0){
+            return -errno;
+        }
+
+        void* p = mmap(nullptr, sizeof(StatsPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(p == MAP_FAILED){
+            return -errno;
+        }
+        map_ = p;
+
+        page_ = new(p) StatsPage;
+        default_page_ = &stats_page();
+        stats_set_page(page_);
+        return 0;
+    }
+
+    errcode_t attach(int fd){
+        struct stat st;
+        if(fstat(fd, &st) != 0){
+            return -errno;
+        }
+
+        if((size_t)st.st_size < sizeof(StatsPage)){
+            return ERR_NOT_READY; // not sized yet
+        }
+
+        void* p = mmap(nullptr, sizeof(StatsPage), PROT_READ, MAP_SHARED, fd, 0);
+        if(p == MAP_FAILED){
+            return -errno;
+        }
+        map_ = p;
+
+        const StatsPage* page = static_cast<const StatsPage*>(p);
+        if(!page->valid()){
+            return ERR_BAD_HEADER;
+        }
+
+        page_ = const_cast<StatsPage*>(page); // (read only: mapped so)
+        return 0;
+    }
+
+    errcode_t errcode_ = ERR_NOT_OPEN;
+    void* map_ = nullptr;
+    StatsPage* page_ = nullptr;
+    StatsPage* default_page_ = nullptr;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef ntuplebuf_slot_hpp
+#define ntuplebuf_slot_hpp
+
+/*
+Slot policies of typed buffers (NTupleBufferDynAllocTyped, NTupleBufferStatic): what is done with
+the object in a slot taken by start_writing() or start_transaction().
+
+    SlotReconstruct       destruct and default-construct (fresh object every time; default)
+    SlotRecycle<Reset>    keep the object as it is (with its heap memory, e.g. string/vector capacity)
+                          and call Reset()(object); the default reset does nothing
+    SlotCopyFromOld       start_transaction(): copy-assign the old (current) message in one pass
+                          (assign a default-constructed object if there is no current message);
+                          start_writing(): as SlotReconstruct
+
+With SlotRecycle the slot contains an old message (the one committed NBUFS - 1 commits ago or so),
+so the writer (or Reset) shall overwrite every field it publishes.
+ */
+
+#include <new>
+
+
+namespace ntuplebuf {
+
+
+struct SlotReconstruct
+{
+    template<typename T>
+    static void on_write(T* p){
+        p -> T::~T(); // destruct previous data
+        new(p) T; // (placement) construct new data
+    }
+
+    template<typename T>
+    static void on_transaction(T* p_new, const T* /*p_old*/){
+        on_write(p_new);
+    }
+};
+
+
+struct SlotNoReset
+{
+    template<typename T>
+    void operator()(T&) const{}
+};
+
+template<typename Reset = SlotNoReset> // functor: void operator()(DataT&)
+struct SlotRecycle
+{
+    template<typename T>
+    static void on_write(T* p){
+        Reset()(*p);
+    }
+
+    template<typename T>
+    static void on_transaction(T* p_new, const T* /*p_old*/){
+        Reset()(*p_new);
+    }
+};
+
+
+struct SlotCopyFromOld
+{
+    template<typename T>
+    static void on_write(T* p){
+        SlotReconstruct::on_write(p);
+    }
+
+    // (assignment: if copying throws, the slot still holds a valid object, and its heap memory is reused)
+    template<typename T>
+    static void on_transaction(T* p_new, const T* p_old){
+        if(p_old != nullptr){
+            *p_new = *p_old; // (the old message is referenced by the transaction, so it is stable)
+        }else{
+            *p_new = T();
+        }
+    }
+};
+
+
+} // namespace
+
+#endif
@@ -0,0 +1,283 @@
+#ifndef ntuplebuf_static_hpp
+#define ntuplebuf_static_hpp
+
+/*
+N-tuple buffer with message buffers embedded into the object (no heap at all).
+
+Slot size and alignment are compile time constants, so pointer <-> bufnum conversion is
+a constant multiply (a shift if SLOT_ALIGN makes the slot size a power of 2).
+
+Constructor is constexpr: if DataT is constexpr default constructible (e.g. trivial types,
+value-initialized as zeroes) a global or static NTupleBufferStatic is constant initialized,
+i.e. it lives in .bss/.data and nothing is executed at program start.
+
+The API is the same as of NTupleBufferDynAllocTyped.
+ */
+
+#include "ntuplebuf.hpp"
+#include "ntuplebuf_handle.hpp"
+#include "ntuplebuf_slot.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+
+namespace ntuplebuf {
+
+
+template<
+    typename ControlCodeT,
+    unsigned NBUFS,
+    typename DataT,
+    typename MemOrder = MemOrderSeqCst,
+    template<typename, unsigned, typename> class ControlEngine = NTupleBufferControl,
+    size_t SLOT_ALIGN = alignof(DataT), // power of 2 (e.g. cache_line_size to keep messages apart)
+    typename SlotPolicy = SlotReconstruct // or SlotRecycle<>, SlotCopyFromOld (see ntuplebuf_slot.hpp)
+>
+struct NTupleBufferStatic
+{
+    typedef int errcode_t;
+    typedef  ControlEngine<ControlCodeT, NBUFS, MemOrder> ControlCode;
+    typedef typename ControlCode::Transaction CCTransaction;
+    typedef typename ControlCode::gen_t gen_t;
+
+    struct TypedTransacion{
+      errcode_t errcode;
+      DataT* old_buf;
+      DataT* new_buf;
+    };
+
+    typedef NTupleBufferHandleOps HOps;
+    typedef NTupleBufferReadHandle<NTupleBufferStatic, DataT> ReadHandle;
+    typedef NTupleBufferWriteHandle<NTupleBufferStatic, DataT> WriteHandle;
+
+    static_assert((SLOT_ALIGN & (SLOT_ALIGN - 1)) == 0 && SLOT_ALIGN >= alignof(DataT), "bad slot alignment");
+
+    static constexpr size_t slot_size = sizeof(DataT) + (SLOT_ALIGN - sizeof(DataT) % SLOT_ALIGN) % SLOT_ALIGN;
+
+
+    constexpr NTupleBufferStatic() = default;
+
+    NTupleBufferStatic(const NTupleBufferStatic&) = delete;
+    NTupleBufferStatic& operator=(const NTupleBufferStatic&) = delete;
+
+    constexpr size_t get_data_size() const{ return sizeof(DataT); };
+
+
+    errcode_t start_reading(DataT** pptr){ // pptr shall point to previous pointer to buffer (or nullptr)
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control.start_reading(&bufnum));
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+        }
+        return res;
+    }
+
+    errcode_t start_reading(DataT** pptr, gen_t* p_gen){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control.start_reading(&bufnum, p_gen));
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+        }
+        return res;
+    }
+
+    int start_reading_once(DataT** pptr, gen_t* p_gen_seen){ // 1: new message, 0: already seen
+        int bufnum = ptr2bufnum(*pptr);
+        int res = control.start_reading_once(&bufnum, p_gen_seen);
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+        }
+        return res;
+    }
+
+    errcode_t start_reading_wait(
+            DataT** pptr,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control.start_reading_wait(&bufnum, timeout));
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+        }
+        return res;
+    }
+
+    int wait_for_update(DataT* ptr, std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()){
+        return control.wait_for_update(ptr2bufnum(ptr), timeout);
+    }
+
+    void set_wait_spin(unsigned spin){ control.set_wait_spin(spin); }
+
+    errcode_t pop(DataT** pptr){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control.pop(&bufnum));
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+        }
+        return res;
+    }
+
+    errcode_t pop(DataT** pptr, gen_t* p_gen){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control.pop(&bufnum, p_gen));
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+        }
+        return res;
+    }
+
+    errcode_t free(DataT** pptr){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control.free(&bufnum));
+        if(res >= 0){
+           *pptr = nullptr;
+        }
+        return res;
+    }
+
+    errcode_t consume(DataT** pptr){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control.consume(&bufnum));
+        if(res >= 0){
+           *pptr = nullptr;
+        }
+        return res;
+    }
+
+    errcode_t start_writing(DataT** pptr){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control.start_writing(&bufnum));
+        if(res >= 0){
+            *pptr = bufnum2ptr(bufnum);
+            SlotPolicy::on_write(*pptr);
+        }else if(bufnum == 0){
+            *pptr = nullptr; // committed, but no free buffer (NTupleBufferControlFA)
+        }
+        return res;
+    }
+
+    errcode_t commit(DataT** pptr){
+        int bufnum = ptr2bufnum(*pptr);
+        auto res = er(control.commit(&bufnum));
+        if(res >= 0){
+           *pptr = nullptr;
+        }
+        return res;
+    }
+
+    TypedTransacion start_transaction(){
+        CCTransaction tr = control.start_transaction();
+        TypedTransacion ret = {
+                tr.errcode,
+                bufnum2ptr(tr.old_buf),
+                bufnum2ptr(tr.new_buf),
+        };
+
+        if(tr.errcode == 0){
+            // prepare object in newly allocated buffer (see ntuplebuf_slot.hpp):
+            SlotPolicy::on_transaction(ret.new_buf, ret.old_buf);
+        }
+
+        return ret;
+    }
+
+    errcode_t commit_transaction(TypedTransacion& tra, bool force){
+        if(tra.errcode != 0){
+            return -92;
+        }
+
+        CCTransaction cctra = {
+                0,
+                ptr2bufnum(tra.old_buf),
+                ptr2bufnum(tra.new_buf)
+        };
+
+        return control.commit_transaction(cctra, force);
+    }
+
+    // multi-producer "latest value" commit (see NTupleBufferControl::commit_ordered())
+    errcode_t commit_ordered(TypedTransacion& tra, CommitOrder order){
+        if(tra.errcode != 0){
+            return -92;
+        }
+
+        CCTransaction cctra = {
+                0,
+                ptr2bufnum(tra.old_buf),
+                ptr2bufnum(tra.new_buf)
+        };
+
+        return control.commit_ordered(cctra, order);
+    }
+
+    gen_t generation(DataT* ptr){ return control.generation(ptr2bufnum(ptr)); }
+    uint64_t commit_time(DataT* ptr){ return control.commit_time(ptr2bufnum(ptr)); } // (see ntuplebuf_time.hpp)
+    CommitOrder order(DataT* ptr){ return control.order(ptr2bufnum(ptr)); }
+
+
+    // the same with handles (see ntuplebuf_handle.hpp):
+
+    errcode_t start_reading(ReadHandle& h){ return read_h(h, HOps::READ); }
+    errcode_t pop(ReadHandle& h){ return read_h(h, HOps::POP); }
+    int start_reading_once(ReadHandle& h){ return read_h(h, HOps::ONCE); }
+
+    errcode_t start_reading_wait(
+            ReadHandle& h,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        return read_h(h, HOps::WAIT, timeout);
+    }
+
+    errcode_t free(ReadHandle& h){ return HOps::release(h, control, false); }
+    errcode_t consume(ReadHandle& h){ return HOps::release(h, control, true); }
+
+    errcode_t start_writing(WriteHandle& h){
+        auto res = HOps::write(h, this, control, [this](int b){ return bufnum2ptr(b); });
+        if(res >= 0){
+            SlotPolicy::on_write(h.get());
+        }
+        return res;
+    }
+
+    errcode_t commit(WriteHandle& h){ return HOps::commit(h, control); }
+    errcode_t free(WriteHandle& h){ return HOps::release(h, control, false); }
+
+
+protected:
+
+    struct alignas(SLOT_ALIGN) Slot{
+        DataT data;
+    };
+
+    static_assert(sizeof(Slot) == slot_size, "unexpected slot padding");
+
+    static constexpr errcode_t er(int fr){return (fr < 0)? fr : 0;}
+
+    int read_h(ReadHandle& h, HOps::ReadMode mode, std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()){
+        return HOps::read(h, this, control, mode, timeout, [this](int b){ return bufnum2ptr(b); });
+    }
+
+    int ptr2bufnum(DataT* ptr){
+        // (offsetof(Slot, data) == 0, so the pointer to data is the pointer to its slot)
+        return (ptr == nullptr)? 0 : (int)(reinterpret_cast<Slot*>(ptr) - slots_) + 1;
+    }
+
+    DataT* bufnum2ptr(int bufnum){
+        return (bufnum != 0)
+            ? &slots_[bufnum - 1].data
+            : nullptr;
+    }
+
+    alignas(cache_line_size) ControlCode control;
+    char control_pad_[cache_line_size - sizeof(ControlCode) % cache_line_size] = {}; // nothing else on the last line
+    Slot slots_[NBUFS] = {};
+};
+
+template<typename ControlCodeT, unsigned NBUFS, typename DataT, typename MemOrder,
+        template<typename, unsigned, typename> class ControlEngine, size_t SLOT_ALIGN, typename SlotPolicy>
+constexpr size_t NTupleBufferStatic<ControlCodeT, NBUFS, DataT, MemOrder, ControlEngine, SLOT_ALIGN, SlotPolicy>::slot_size;
+
+} // namespace
+
+#endif
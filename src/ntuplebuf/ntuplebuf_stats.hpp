@@ -0,0 +1,235 @@
+#ifndef ntuplebuf_stats_hpp
+#define ntuplebuf_stats_hpp
+
+/*
+Optional usage and contention counters of control engines (compiled in only if STATS_ntuplebuf is defined).
+
+Counters are per thread: every thread takes a row of the stats page at its first counted event
+(and gives it back at exit, the counts stay), a row is a cache line written by its owner only
+(relaxed load and store, no RMW), so counting does not add contention.
+Threads which find no free row share an overflow row (fetch_add there).
+
+    CAS_RETRY            failed CAS of the control word (or of a reference counter in NTupleBufferControlFA)
+    NO_DATA              start_reading() / pop() found no current message
+    NO_FREE_SLOT         start_writing() / start_transaction() found no free buffer (-35, -80)
+    COLLISION            commit_transaction(force == false) failed (the current buffer has changed)
+    ORDER_REJECTED       commit_ordered() rejected the message as not newer than the current one
+    OVERWRITTEN_UNREAD   a committed message was replaced before any reader took it
+                         (approximate: a reader marks the buffer just before its CAS)
+
+The page is a plain structure of lock-free atomics, so it may live in shared memory:
+NTupleBufferStatsShm (ntuplebuf_shm.hpp) creates such a page and makes it the page of the process,
+a monitor process attaches to it read-only and sums the rows (StatsPage::total()).
+Set the page before the buffers are used: counts made before go to the previous page.
+
+The page sums the events of all buffers of the process. Every control structure counts its own
+events too (StatsRows in its side data, e.g. buf.get_control().stats().total(StatsPage::CAS_RETRY)),
+so the events can be attributed to a buffer. Those rows are taken by thread tokens, as the rows
+of age histograms are (see ntuplebuf_time.hpp), so they work in shared memory buffers as well.
+ */
+
+#include <cstdint>
+#include <atomic>
+
+#include "ntuplebuf_time.hpp" // (thread tokens)
+
+// (the same default as in ntuplebuf.hpp, which includes this header)
+#ifndef CACHE_LINE_ntuplebuf
+#   define  CACHE_LINE_ntuplebuf 64
+#endif
+
+// thread rows of the counters of every control structure (the overflow row aside)
+#ifndef STATS_ROWS_ntuplebuf
+#   define  STATS_ROWS_ntuplebuf 4
+#endif
+
+
+namespace ntuplebuf {
+
+
+struct StatsPage
+{
+    enum Event: unsigned{
+        CAS_RETRY,
+        NO_DATA,
+        NO_FREE_SLOT,
+        COLLISION,
+        ORDER_REJECTED,
+        OVERWRITTEN_UNREAD,
+        NUM_EVENTS
+    };
+
+    enum: uint32_t{
+        MAGIC = 0x4e545053, // "NTPS"
+        VERSION = 1,
+        MAX_THREADS = 63 // + overflow row
+    };
+
+    struct alignas(CACHE_LINE_ntuplebuf) Row{
+        std::atomic<uint32_t> owned;
+        uint32_t shared; // overflow row (counted with fetch_add)
+        std::atomic<uint64_t> counts[NUM_EVENTS];
+    };
+
+    uint32_t magic = MAGIC;
+    uint32_t version = VERSION;
+    uint32_t max_threads = MAX_THREADS;
+    uint32_t num_events = NUM_EVENTS;
+    uint64_t page_size = sizeof(StatsPage);
+
+    Row rows[MAX_THREADS + 1]; // the last one is the overflow row
+
+    StatsPage(){
+        for(auto& r: rows){
+            r.owned.store(0, std::memory_order_relaxed);
+            r.shared = 0;
+            for(auto& c: r.counts){
+                c.store(0, std::memory_order_relaxed);
+            }
+        }
+        rows[MAX_THREADS].shared = 1;
+    }
+
+    // true if the page (e.g. mapped from shared memory) has the layout of this build
+    bool valid() const{
+        return magic == MAGIC && version == VERSION && max_threads == MAX_THREADS
+            && num_events == NUM_EVENTS && page_size == sizeof(StatsPage);
+    }
+
+    // sum of all threads (may be called from any thread or process)
+    uint64_t total(Event ev) const{
+        uint64_t sum = 0;
+        for(auto& r: rows){
+            sum += r.counts[ev].load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    // a free row (or the overflow row)
+    Row* take_row(){
+        for(unsigned i = 0; i < MAX_THREADS; ++i){
+            uint32_t owned = rows[i].owned.load(std::memory_order_relaxed);
+            if(owned == 0 && rows[i].owned.compare_exchange_strong(owned, 1, std::memory_order_acquire)){
+                return &rows[i];
+            }
+        }
+        return &rows[MAX_THREADS];
+    }
+
+    static void give_row(Row* r){
+        if(!r->shared){
+            r->owned.store(0, std::memory_order_release); // (the next owner continues the counts)
+        }
+    }
+};
+
+
+inline std::atomic<StatsPage*>& stats_page_ptr(){
+    static StatsPage page; // default page (process memory)
+    static std::atomic<StatsPage*> p = {&page};
+    return p;
+}
+
+inline StatsPage& stats_page(){ return *stats_page_ptr().load(std::memory_order_acquire); }
+
+// makes the page (constructed by the caller, e.g. in shared memory) the page of the process
+inline void stats_set_page(StatsPage* page){ stats_page_ptr().store(page, std::memory_order_release); }
+
+
+struct StatsThreadRow
+{
+    StatsPage* page = nullptr;
+    StatsPage::Row* row = nullptr;
+
+    ~StatsThreadRow(){
+        if(row != nullptr && page == &stats_page()){ // (a replaced page may be unmapped already)
+            StatsPage::give_row(row);
+        }
+    }
+};
+
+inline void stats_count(StatsPage::Event ev){
+#ifdef STATS_ntuplebuf
+    static thread_local StatsThreadRow tr;
+    StatsPage* page = &stats_page();
+    if(tr.page != page){ // first event of the thread, or the page has been replaced
+        tr.page = page;
+        tr.row = page->take_row();
+    }
+
+    std::atomic<uint64_t>& c = tr.row->counts[ev];
+    if(tr.row->shared){
+        c.fetch_add(1, std::memory_order_relaxed);
+    }else{
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+#else
+    (void)ev;
+#endif
+}
+
+
+// counters of one control structure (kept in its side data if STATS_ntuplebuf): a row per counting
+// thread (written by the owner only, no RMW), threads which find no free row share the overflow row
+struct StatsRows
+{
+    enum: unsigned{
+        NUM_ROWS = STATS_ROWS_ntuplebuf
+    };
+
+    void count(StatsPage::Event ev){
+        int r = thread_row(owners_, NUM_ROWS);
+        if(r >= 0){
+            std::atomic<uint64_t>& c = rows_[r].counts[ev];
+            c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }else{
+            overflow_.counts[ev].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // sum of all threads (may be called from any thread, or process if the structure is shared)
+    uint64_t total(StatsPage::Event ev) const{
+        uint64_t sum = overflow_.counts[ev].load(std::memory_order_relaxed);
+        for(auto& r: rows_){
+            sum += r.counts[ev].load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+private:
+    struct alignas(CACHE_LINE_ntuplebuf) Row{
+        std::atomic<uint64_t> counts[StatsPage::NUM_EVENTS] = {};
+    };
+
+    std::atomic<uint64_t> owners_[NUM_ROWS] = {}; // (read-mostly: one line for all rows)
+    Row rows_[NUM_ROWS];
+    Row overflow_;
+};
+
+
+// "has been read" flag of every buffer (for OVERWRITTEN_UNREAD), kept by control engines if STATS_ntuplebuf
+template<unsigned NBUFS>
+struct StatsReadFlags
+{
+    void taken(int bufnum){ // by a writer (nobody else references it)
+        read_[bufnum - 1].store(0, std::memory_order_relaxed);
+    }
+
+    void read(int bufnum){
+        if(bufnum > 0 && read_[bufnum - 1].load(std::memory_order_relaxed) == 0){ // (write the line once)
+            read_[bufnum - 1].store(1, std::memory_order_relaxed);
+        }
+    }
+
+    bool replaced(int bufnum){ // the buffer is not current any more; true if it has not been read
+        return bufnum > 0 && read_[bufnum - 1].load(std::memory_order_relaxed) == 0;
+    }
+
+private:
+    std::atomic<uint8_t> read_[NBUFS] = {};
+};
+
+
+} // namespace
+
+#endif
@@ -0,0 +1,417 @@
+#ifndef ntuplebuf_stress_hpp
+#define ntuplebuf_stress_hpp
+
+/*
+Stress test at full speed: a producer and consumers run unthrottled (no scheduler, no console output),
+pinned to cores 0, 1, 2, ... (modulo the number of cores), for every producer/consumer mode.
+Shall not be included together with ntuplebuf_test.hpp or ntuplebuf_bench.hpp (both redefine YELD_ntuplebuf).
+
+Every message carries a sequence number (commit order of the producer), payload words derived from it
+and a checksum, so consumers detect:
+
+    torn          checksum mismatch (the message was read while it was being written)
+    reused        the message changed while the consumer still referenced it (checked again
+                  just before the consumer releases it)
+    out_of_order  generation and sequence number disagree (a newer generation with an older
+                  or the same sequence number, an older generation after a newer one),
+                  or a successful transaction was based on a message which was not the latest one
+    dup_pop       the same message popped twice (by any consumers)
+    lost          the latest value lost: "no data" or an older message read after a commit which no pop
+                  or consume of that (or a newer) message could have cleared
+
+    NtbStressConfig cfg;
+    cfg.duration_ms = 500;
+    int failures = ntuplebuf_stress(cfg); // 0: no failures, prints CSV lines with throughput and counts
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#   include <pthread.h>
+#   include <sched.h>
+#endif
+
+#include "ntuplebuf_dyn.hpp"
+#include "ntuplebuf_fa.hpp"
+
+
+struct NtbStressConfig{
+    unsigned duration_ms = 200; // per case
+    size_t msg_size = 256;      // bytes (at least 3 words)
+    unsigned readers = 3;       // (limited by NBUFS - 2)
+};
+
+
+// message layout (in 64-bit words): seq, payload..., checksum
+struct NtbStressMsg{
+    static uint64_t word(uint64_t seq, size_t i){ return seq * 0x9e3779b97f4a7c15ull + i; }
+
+    static void write(void* p, size_t nwords, uint64_t seq){
+        volatile uint64_t* w = static_cast<volatile uint64_t*>(p);
+        uint64_t sum = seq;
+        w[0] = seq;
+        for(size_t i = 1; i + 1 < nwords; ++i){
+            uint64_t v = word(seq, i);
+            w[i] = v;
+            sum ^= v;
+        }
+        w[nwords - 1] = sum;
+    }
+
+    // returns false if the message is torn
+    static bool check(const void* p, size_t nwords, uint64_t* p_seq){
+        const volatile uint64_t* w = static_cast<const volatile uint64_t*>(p);
+        uint64_t seq = w[0];
+        uint64_t sum = seq;
+        bool ok = true;
+        for(size_t i = 1; i + 1 < nwords; ++i){
+            uint64_t v = w[i];
+            ok = ok && (v == word(seq, i));
+            sum ^= v;
+        }
+        *p_seq = seq;
+        return ok && w[nwords - 1] == sum;
+    }
+
+    static uint64_t seq(const void* p){ return *static_cast<const volatile uint64_t*>(p); }
+};
+
+
+template<
+    typename ControlCodeT,
+    unsigned NBUFS,
+    template<typename, unsigned, typename> class ControlEngine = ntuplebuf::NTupleBufferControl
+>
+struct NtbStress
+{
+    typedef ntuplebuf::NTupleBufferDynAlloc<ControlCodeT, NBUFS, ntuplebuf::MemOrderSeqCst, ControlEngine> Buffer;
+    typedef typename Buffer::gen_t gen_t;
+    using Clock = std::chrono::steady_clock;
+
+    enum ProducerMode{
+        P_SIMPLE,  // start_writing (commits the previous message)
+        COMMIT,    // start_writing + commit
+        TRANSACT   // start_transaction + commit_transaction (retried on collision)
+    };
+
+    enum ConsumerMode{
+        C_SIMPLE,  // start_reading (releases the previous message)
+        FREE,      // start_reading + free
+        CONSUME,   // start_reading + consume
+        POP        // pop + free
+    };
+
+    enum{
+        POP_RING = 1 << 16 // popped sequence numbers (dup_pop check)
+    };
+
+    struct Counts{
+        unsigned long ops = 0;
+        unsigned long torn = 0;
+        unsigned long reused = 0;
+        unsigned long out_of_order = 0;
+        unsigned long dup_pop = 0;
+        unsigned long lost = 0;
+        int error = 0;
+
+        unsigned long failures() const{ return torn + reused + out_of_order + dup_pop + lost + (error < 0); }
+    };
+
+    static const char* pm_name(ProducerMode pm){
+        static const char* names[] = {"start_writing", "start_writing+commit", "transaction"};
+        return names[pm];
+    }
+
+    static const char* cm_name(ConsumerMode cm){
+        static const char* names[] = {"start_reading", "start_reading+free", "start_reading+consume", "pop"};
+        return names[cm];
+    }
+
+    static void pin_to_core(unsigned core){
+#       ifdef __linux__
+        unsigned ncores = std::thread::hardware_concurrency();
+        if(ncores == 0){
+            return;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core % ncores, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#       else
+        (void)core;
+#       endif
+    }
+
+
+    NtbStress(const NtbStressConfig& cfg, ProducerMode pm, ConsumerMode cm)
+        : cfg_(cfg), pm_(pm), cm_(cm), nwords_(std::max<size_t>(3, cfg.msg_size / sizeof(uint64_t))),
+          buf_(nwords_ * sizeof(uint64_t)), counts_(readers() + 1)
+    {}
+
+    unsigned readers() const{ return std::min(cfg_.readers, NBUFS - 2); }
+
+    // returns the number of failures
+    unsigned long run(const char* engine_name){
+        std::unique_ptr<std::atomic<uint64_t>[]> popped(new std::atomic<uint64_t>[POP_RING]);
+        for(unsigned i = 0; i < POP_RING; ++i){
+            popped[i].store(0, std::memory_order_relaxed);
+        }
+        popped_ = popped.get();
+
+        std::vector<std::thread> threads;
+        threads.emplace_back([this](){ producer(); });
+        for(unsigned r = 0; r < readers(); ++r){
+            threads.emplace_back([this, r](){ consumer(r); });
+        }
+
+        while(ready_.load() <= readers()){ // start all threads together
+            std::this_thread::yield();
+        }
+        auto t0 = Clock::now();
+        std::this_thread::sleep_for(std::chrono::milliseconds(cfg_.duration_ms));
+        stop_.store(true);
+        for(auto& t: threads){
+            t.join();
+        }
+        double secs = std::chrono::duration<double>(Clock::now() - t0).count();
+
+        Counts total;
+        for(auto& c: counts_){
+            total.ops += c.ops;
+            total.torn += c.torn;
+            total.reused += c.reused;
+            total.out_of_order += c.out_of_order;
+            total.dup_pop += c.dup_pop;
+            total.lost += c.lost;
+            if(c.error < 0){
+                total.error = c.error;
+            }
+        }
+
+        std::cout
+            << engine_name << "," << NBUFS << "," << readers() << ","
+            << pm_name(pm_) << "," << cm_name(cm_) << ","
+            << (unsigned long)(counts_[0].ops / secs) << ","
+            << (unsigned long)((total.ops - counts_[0].ops) / secs) << ","
+            << total.torn << "," << total.reused << "," << total.out_of_order << ","
+            << total.dup_pop << "," << total.lost << "," << total.error << "\n";
+
+        return total.failures();
+    }
+
+
+protected:
+
+    void wait_start(unsigned core){
+        pin_to_core(core);
+        ready_++;
+        while(ready_.load() <= readers()){
+            std::this_thread::yield();
+        }
+    }
+
+    void producer(){
+        Counts& c = counts_[0];
+        wait_start(0);
+
+        uint64_t seq = 0; // of the last committed message
+        void* p = nullptr;
+
+        while(!stop_.load(std::memory_order_relaxed)){
+            if(pm_ == TRANSACT){
+                int res = 1;
+                while(res == 1){ // collision: retry
+                    auto tra = buf_.start_transaction();
+                    if(tra.errcode < 0){
+                        c.error = tra.errcode;
+                        return;
+                    }
+
+                    uint64_t old_seq = 0;
+                    if(tra.old_buf != nullptr && !NtbStressMsg::check(tra.old_buf, nwords_, &old_seq)){
+                        ++c.torn;
+                    }
+
+                    NtbStressMsg::write(tra.new_buf, nwords_, seq + 1);
+                    res = buf_.commit_transaction(tra, false);
+                    if(res == 0 && tra.old_buf != nullptr && old_seq != seq){
+                        ++c.out_of_order; // committed over a message which was not the latest one
+                    }
+                }
+                if(res < 0){
+                    c.error = res;
+                    return;
+                }
+                committed_.store(++seq);
+            }else{
+                int res = buf_.start_writing(&p); // (commits the previous one in P_SIMPLE mode)
+                if(res < 0){
+                    c.error = res;
+                    return;
+                }
+                if(pm_ == P_SIMPLE){
+                    committed_.store(seq);
+                }
+                NtbStressMsg::write(p, nwords_, ++seq);
+                if(pm_ == COMMIT){
+                    res = buf_.commit(&p);
+                    if(res < 0){
+                        c.error = res;
+                        return;
+                    }
+                    committed_.store(seq);
+                }
+            }
+            ++c.ops;
+        }
+
+        if(p != nullptr){
+            buf_.commit(&p);
+        }
+    }
+
+    void consumer(unsigned r){
+        Counts& c = counts_[r + 1];
+        wait_start(r + 1);
+
+        void* p = nullptr;
+        uint64_t seq = 0;      // of the message referenced by p
+        uint64_t last_seq = 0; // of the last message read
+        gen_t last_gen = 0;
+
+        auto recheck = [&](){ // before the message is released
+            if(p != nullptr && NtbStressMsg::seq(p) != seq){
+                ++c.reused;
+            }
+        };
+
+        while(!stop_.load(std::memory_order_relaxed)){
+            recheck();
+
+            uint64_t committed = committed_.load(); // (the read below shall see it, or a newer message)
+            if(cm_ == POP){
+                takers_.fetch_add(1);
+            }
+
+            gen_t gen = 0;
+            int res = (cm_ == POP)? buf_.pop(&p, &gen) : buf_.start_reading(&p, &gen);
+            if(res < 0){
+                c.error = res;
+                break;
+            }
+            ++c.ops;
+
+            seq = 0;
+            if(p != nullptr && !NtbStressMsg::check(p, nwords_, &seq)){
+                ++c.torn;
+            }
+
+            if(cm_ == POP){
+                raise_taken(seq);
+                takers_.fetch_sub(1);
+            }
+            if(seq < committed && takers_.load() == 0 && taken_.load() < committed){
+                ++c.lost;
+            }
+
+            if(p == nullptr){
+                continue;
+            }
+
+            if(last_seq != 0){
+                bool ordered = (gen > last_gen)? seq > last_seq
+                             : (gen == last_gen)? (seq == last_seq && cm_ != POP)
+                             : false;
+                if(!ordered){
+                    ++c.out_of_order;
+                }
+            }
+            last_seq = seq;
+            last_gen = gen;
+
+            if(cm_ == POP && popped_[seq % POP_RING].exchange(seq, std::memory_order_relaxed) == seq){
+                ++c.dup_pop;
+            }
+
+            if(cm_ != C_SIMPLE){
+                recheck();
+                if(cm_ == CONSUME){
+                    raise_taken(seq); // (before: a reader seeing the message cleared shall know it)
+                }
+                res = (cm_ == CONSUME)? buf_.consume(&p) : buf_.free(&p);
+                if(res < 0){
+                    c.error = res;
+                    break;
+                }
+            }
+        }
+
+        recheck();
+        buf_.free(&p);
+    }
+
+    void raise_taken(uint64_t seq){
+        uint64_t t = taken_.load();
+        while(t < seq && !taken_.compare_exchange_weak(t, seq)){
+        }
+    }
+
+    NtbStressConfig cfg_;
+    ProducerMode pm_;
+    ConsumerMode cm_;
+    size_t nwords_;
+
+    Buffer buf_;
+    std::vector<Counts> counts_; // [0]: producer
+    std::atomic<uint64_t>* popped_ = nullptr;
+
+    std::atomic<uint64_t> committed_ = {0}; // sequence number of the last committed message
+    std::atomic<uint64_t> taken_ = {0};     // the newest message popped or being consumed
+    std::atomic<unsigned> takers_ = {0};    // pops in progress (their message is not known yet)
+
+    std::atomic<unsigned> ready_ = {0};
+    std::atomic<bool> stop_ = {false};
+
+
+public:
+
+    static unsigned long run_all(const char* engine_name, const NtbStressConfig& cfg){
+        unsigned long failures = 0;
+        for(int pm = P_SIMPLE; pm <= TRANSACT; ++pm){
+            for(int cm = C_SIMPLE; cm <= POP; ++cm){
+                NtbStress st(cfg, (ProducerMode)pm, (ConsumerMode)cm);
+                failures += st.run(engine_name);
+            }
+        }
+        return failures;
+    }
+};
+
+
+// returns the total number of failures (0: passed)
+int ntuplebuf_stress(const NtbStressConfig& cfg = NtbStressConfig()){
+    std::cout << "\n===== stress: full speed, " << std::thread::hardware_concurrency() << " cores =====\n"
+        << "engine,nbufs,readers,producer_op,consumer_op,prod_ops_s,cons_ops_s,"
+        << "torn,reused,out_of_order,dup_pop,lost,error\n";
+
+    unsigned long failures = 0;
+    failures += NtbStress<unsigned long, 15>::run_all("CAS", cfg);
+    failures += NtbStress<unsigned long, 15, ntuplebuf::NTupleBufferControlFA>::run_all("FA", cfg);
+    // NBUFS = readers + 2 (with the default 3 readers): buffers run out whenever a reader lags
+    failures += NtbStress<unsigned, 5>::run_all("CAS 32-bit", cfg);
+    failures += NtbStress<unsigned, 5, ntuplebuf::NTupleBufferControlFA>::run_all("FA 32-bit", cfg);
+
+    std::cout << "stress failures: " << failures << "\n";
+    return (int)failures;
+}
+
+
+#endif
@@ -6,11 +6,19 @@
 //#define TEST_RACES_ntuplebuf_ms 100
 
 #include <array>
+#include <cstring>
 #include <iostream>
+#include <random>
 #include <thread>
 #include <mutex>
+#include <stdexcept>
 #include <string>
+#include <vector>
 #include <unistd.h>
+#ifdef __linux__
+#   include <poll.h>
+#   include <sys/wait.h>
+#endif
 
 #include "test_scheduler.hpp"
 
@@ -19,10 +27,30 @@ using Alg = lf_test_utils::SimpleRandomAlgorithm;
 
 static std::unique_ptr<Shed> psched;
 
-#define YELD_ntuplebuf psched->yeld();
+// yield point of control engines: tasks of the coroutine scheduler (if it runs), threads of psched otherwise
+inline void ntb_yeld(){
+    if(lf_test_utils::CoroutineSched::running()){
+        lf_test_utils::CoroutineSched::yeld(); // (nothing in the scheduler itself)
+    }else{
+        psched->yeld();
+    }
+}
+
+#define YELD_ntuplebuf ntb_yeld();
+#define STATS_ntuplebuf
+#define TIMESTAMPS_ntuplebuf
 // #define DBG_STATUS_ntuplebuf
 
 #include "ntuplebuf_dyn.hpp"
+#include "ntuplebuf_fa.hpp"
+#include "ntuplebuf_static.hpp"
+#include "ntuplebuf_shm.hpp"
+#include "ntuplebuf_var.hpp"
+#include "ntuplebuf_bank.hpp"
+#include "ntuplebuf_group.hpp"
+#include "ntuplebuf_record.hpp"
+#include "ntuplebuf_coro.hpp"
+#include "ntuplebuf_eventfd.hpp"
 
 
 
@@ -51,6 +79,14 @@ struct Data
         ninstances ++;
     }
 
+    Data(const Data& d)
+    : DataBase(d)
+    {
+        ninstances ++;
+    }
+
+    Data& operator=(const Data&) = default;
+
     ~Data(){
         ninstances --;
     }
@@ -74,21 +110,31 @@ struct Data
 std::atomic<unsigned> Data::ninstances;
 
 
-template <typename ControlCodeT, unsigned NConsumers, typename DataT>
+template <
+    typename ControlCodeT,
+    unsigned NConsumers,
+    typename DataT,
+    template<typename, unsigned, typename> class ControlEngine = ntuplebuf::NTupleBufferControl,
+    bool STATIC_BUF = false, // NTupleBufferStatic instead of NTupleBufferDynAllocTyped
+    typename SlotPolicy = ntuplebuf::SlotReconstruct
+>
 struct NtbTestMT
         : public NtbTesBase
 {
     enum ProducerMode{
         P_SIMPLE,
         COMMIT,
-        TRANSACT
+        TRANSACT,
+        P_HANDLE // WriteHandle (commit on destruction)
     };
 
     enum ConsumerMode{
         C_SIMPLE,
         FREE,
         CONSUME,
-        POP
+        POP,
+        ONCE, // start_reading_once()
+        HANDLE // ReadHandle
     };
 
     NtbTestMT(unsigned cycles, ProducerMode pm = P_SIMPLE, ConsumerMode cm = C_SIMPLE)
@@ -147,17 +193,31 @@ struct NtbTestMT
         psched->add_thread();
 
         DataT* p = nullptr;
+        typename decltype(nbc)::gen_t gen = 0;
+        typename decltype(nbc)::ReadHandle h;
 
         while(!stop_.load()){
-            auto res = (cm_ == POP)? nbc.pop(&p) : nbc.start_reading(&p);
+            auto res = (cm_ == POP)? nbc.pop(&p)
+                    : (cm_ == ONCE)? nbc.start_reading_once(&p, &gen)
+                    : (cm_ == HANDLE)? nbc.start_reading(h)
+                    : nbc.start_reading(&p);
+            if(cm_ == HANDLE){
+                p = h.get();
+            }
             if(res < 0){
                 under_lock([=](){
                 std::cout << "** Read error consNo: " << consNo << "  error: " << res << "\n";
                 });
                 break;
             }else{
+                bool seen = (cm_ == ONCE && res == 0 && p != nullptr);
                 under_lock([=](){
-                    if(p != nullptr){
+                    if(seen){
+                        under_lock([=](){
+                        std::cout << "consNo: " << consNo << " already seen: " << p->count << "\n";
+                        });
+                        std::this_thread::sleep_for(std::chrono::milliseconds(100)); // do not annoy console
+                    }else if(p != nullptr){
                         under_lock([=](){
                         std::cout << "consNo: " << consNo << " data: ";
                         std::cout << p->count;
@@ -197,6 +257,8 @@ struct NtbTestMT
             }
         }
 
+        h.release(); // (while still scheduled: release() yelds)
+
         psched->remove_thread();
 
     }
@@ -225,6 +287,13 @@ struct NtbTestMT
                         break;
                     }
 
+                    if(
+                            std::is_same<SlotPolicy, ntuplebuf::SlotCopyFromOld>::value
+                            && tra.old_buf != nullptr && tra.new_buf->s != tra.old_buf->s
+                    ){
+                        std::cout << "** Producer: new buffer is not a copy of the old one\n";
+                    }
+
                     tra.new_buf->count = count;
                     tra.new_buf->s = ((tra.old_buf != nullptr)?  tra.old_buf->s : std::string()) + add_s;
 
@@ -261,6 +330,18 @@ struct NtbTestMT
                     break;
                 }
 
+            }else if(pm_ == P_HANDLE){
+                typename decltype(nbc)::WriteHandle w;
+                auto res = nbc.start_writing(w);
+                if(res < 0){
+                    std::cout << "** Write error Producer: " << "  error: "<< res << "\n";
+                    break;
+                }
+
+                w->count = ++count;
+                under_lock([=](){
+                    std::cout << "Producer prepared  data (handle): " << count << "\n";
+                });
             }else{
                 auto res = nbc.start_writing(&p);
                 if(res < 0){
@@ -316,7 +397,15 @@ struct NtbTestMT
 private:
 
 
-    ntuplebuf::NTupleBufferDynAllocTyped<ControlCodeT, NConsumers + 2, DataT> nbc; // = {sizeof(Data)};
+    typename std::conditional<
+        STATIC_BUF,
+        ntuplebuf::NTupleBufferStatic<
+            ControlCodeT, NConsumers + 2, DataT, ntuplebuf::MemOrderSeqCst, ControlEngine, alignof(DataT), SlotPolicy
+        >,
+        ntuplebuf::NTupleBufferDynAllocTyped<
+            ControlCodeT, NConsumers + 2, DataT, ntuplebuf::MemOrderSeqCst, ControlEngine, SlotPolicy
+        >
+    >::type nbc; // = {sizeof(Data)};
 
     std::atomic<bool> stop_ = {0};
 
@@ -326,73 +415,1805 @@ private:
     ConsumerMode cm_;
 };
 
-int ntuplebuf_test(){
-    ntuplebuf::NTupleBufferControl<unsigned, 7> nbc;
-    // ntuplebuf::NTupleBufferControl<unsigned long, 8> nbc; // convinient to debug
+// multi-producer "latest value" mode: producers take sequence numbers in order, but commit them
+// in the order chosen by the scheduler; readers shall never see an older value after a newer one
+template<template<typename, unsigned, typename> class ControlEngine = ntuplebuf::NTupleBufferControl>
+struct NtbTestOrdered
+        : public NtbTesBase
+{
+    enum{
+        NProducers = 3,
+        NConsumers = 2
+    };
 
-#   if 0
-    // the following declarations produce design time errors:
+    NtbTestOrdered(unsigned cycles)
+    : cycles_(cycles)
+    {
+        psched = std::unique_ptr<Shed>(new Shed(
+                std::shared_ptr<Alg>(new Alg(0.9)))
+        );
+    }
 
-    ntuplebuf::NTupleBufferControl<unsigned, 8> nbc_err_1;
-    ntuplebuf::NTupleBufferControl<int, 7> nbc_err_2;
-#   endif
+    void start(){
+        std::cout << "\n\n===== staring ordered commits test ====== producers: " << NProducers
+            << "   consumers: " << NConsumers << "   cycles: " << cycles_ << "\n";
 
-    /*
-    int wb = 0;
-    int rb = 0;
-    nbc.start_writing(&wb);
-    nbc.commit(&wb);
-    nbc.start_reading(&rb);
-    nbc.free(&rb);
-    nbc.start_writing(&wb);
-    nbc.start_reading(&rb);
-    nbc.start_writing(&wb);
-    nbc.start_reading(&rb);
-    nbc.start_writing(&wb);
-    nbc.start_reading(&rb);
-    nbc.start_writing(&wb);
-    nbc.start_reading(&rb);
-*/
-    typedef NtbTestMT<unsigned, 5, DataBase> T5;
-    typedef NtbTestMT<unsigned, 1, Data> T1;
+        std::thread threads[NProducers - 1 + NConsumers];
+        for(unsigned i = 0; i < NConsumers; ++i){
+            threads[i] = std::thread([=](){ this->consumer(i);});
+        }
+        for(unsigned i = 1; i < NProducers; ++i){
+            threads[NConsumers + i - 1] = std::thread([=](){ this->producer(i);});
+        }
 
-    {
-        T5 tst(20);
-        tst.start();
+        sleep(1); // allow threads to start (for deterministic test behavior)
+
+        producer(0);
+
+        for(auto& t: threads){
+            t.join();
+        }
+
+        std::cout << (errors_.load()? "** " : "") << "ordered commits: accepted " << accepted_.load()
+            << ", rejected " << rejected_.load() << ", errors " << errors_.load() << "\n";
     }
 
-    {
-        T1 tst(50, T1::COMMIT, T1::C_SIMPLE);
-        tst.start();
+    void producer(unsigned id){
+        psched->add_thread();
+        if(id == 0){
+            psched->start();
+        }
+
+        for(unsigned i = 0; i < cycles_; ++i){
+            uint64_t seq = next_seq_.fetch_add(1) + 1;
+
+            auto tra = nbc.start_transaction();
+            if(tra.errcode < 0){
+                error("transaction start error", tra.errcode);
+                break;
+            }
+
+            tra.new_buf->count = (unsigned)seq;
+
+            YELD_ntuplebuf // let other producers overtake
+
+            int res = nbc.commit_ordered(tra, ntuplebuf::CommitOrder{seq, id});
+            if(res == 0){
+                accepted_.fetch_add(1);
+            }else if(res == 1){
+                rejected_.fetch_add(1);
+            }else{
+                error("ordered commit error", res);
+                break;
+            }
+        }
+
+        producers_done_.fetch_add(1);
+        psched->remove_thread();
     }
 
-    {
-        T5 tst(20, T5::COMMIT, T5::FREE);
-        tst.start();
+    void consumer(unsigned consNo){
+        psched->add_thread();
+
+        DataBase* p = nullptr;
+        unsigned last = 0;
+        bool done = false;
+
+        while(!done){
+            done = (producers_done_.load() == NProducers); // (then the last reading sees the last value)
+
+            int res = nbc.start_reading(&p);
+            if(res < 0){
+                error("read error", res);
+                break;
+            }
+
+            if(p != nullptr){
+                if(p->count < last || nbc.order(p).seq != p->count){
+                    error("older value after newer one, consumer", (int)consNo);
+                }
+                last = p->count;
+            }
+        }
+
+        if(last != NProducers * cycles_){
+            error("the newest value is lost, consumer", (int)consNo);
+        }
+
+        nbc.free(&p);
+        psched->remove_thread();
     }
 
+private:
+    void error(const char* what, int code){
+        errors_.fetch_add(1);
+        under_lock([=](){
+            std::cout << "** " << what << ": " << code << "\n";
+        });
+    }
+
+    ntuplebuf::NTupleBufferDynAllocTyped<
+        unsigned long, 2 * NProducers + NConsumers + 1, DataBase, ntuplebuf::MemOrderSeqCst, ControlEngine
+    > nbc;
+
+    unsigned cycles_;
+    std::atomic<uint64_t> next_seq_ = {0};
+    std::atomic<unsigned> producers_done_ = {0};
+    std::atomic<unsigned> accepted_ = {0};
+    std::atomic<unsigned> rejected_ = {0};
+    std::atomic<unsigned> errors_ = {0};
+};
+
+// variable-length messages: the producer writes messages of growing lengths (so slots are reallocated
+// while consumers read other slots); consumers check the size and the contents of every message
+struct NtbTestVar
+        : public NtbTesBase
+{
+    enum{
+        NConsumers = 3
+    };
+
+    typedef ntuplebuf::NTupleBufferVar<unsigned, NConsumers + 2> Buf;
+
+    NtbTestVar(unsigned cycles)
+    : cycles_(cycles), nbc(8)
     {
-        //T1 tst(50, T1::COMMIT, T1::CONSUME);
-        T1 tst(20, T1::COMMIT, T1::C_SIMPLE);
-        //T1 tst(50, T1::P_SIMPLE, T1::CONSUME);
-        tst.start();
+        psched = std::unique_ptr<Shed>(new Shed(
+                std::shared_ptr<Alg>(new Alg(0.9)))
+        );
+    }
+
+    static size_t length(unsigned count){ return 4 + (count * 37) % (count * 8 + 1); }
+
+    void start(){
+        std::cout << "\n\n===== staring variable-length messages test ====== consumers: " << NConsumers
+            << "   cycles: " << cycles_ << "\n";
+
+        std::thread threads[NConsumers];
+        for(unsigned i = 0; i < NConsumers; ++i){
+            threads[i] = std::thread([=](){ this->consumer(i);});
+        }
+
+        sleep(1); // allow threads to start (for deterministic test behavior)
+
+        producer();
+
+        for(auto& t: threads){
+            t.join();
+        }
+
+        std::cout << (errors_.load()? "** " : "") << "variable-length messages: read " << read_.load()
+            << ", errors " << errors_.load() << ", capacity " << nbc.capacity() << "\n";
+    }
+
+    void producer(){
+        psched->add_thread();
+        psched->start();
+
+        Buf::Span w = {nullptr, 0};
+        for(unsigned count = 1; count <= cycles_; ++count){
+            size_t len = length(count);
+            if(count % 16 == 0){
+                nbc.reserve(len * 2);
+            }
+
+            if(count % 3 == 0){ // transaction (the slot kept by start_writing() is committed first)
+                int res = nbc.commit(&w);
+                res = (res < 0)? res : commit_transaction(count, len);
+                if(res < 0){
+                    error("transaction error", res);
+                    break;
+                }
+                continue;
+            }
+
+            int res = nbc.start_writing(&w, len); // (commits the previous message kept, if any)
+            if(res < 0 || w.size < len){
+                error("write error", res);
+                break;
+            }
+
+            fill((uint8_t*)w.data, count, len);
+            w.size = len;
+            if(count % 2 == 0 && nbc.commit(&w) < 0){
+                error("commit error", count);
+            }
+        }
+        nbc.commit(&w);
+
+        done_.store(true);
+        psched->remove_thread();
+    }
+
+    void consumer(unsigned consNo){
+        psched->add_thread();
+
+        Buf::Span r = {nullptr, 0};
+        while(!done_.load()){
+            int res = nbc.start_reading(&r);
+            if(res < 0){
+                error("read error", res);
+                break;
+            }
+
+            if(r.data != nullptr){
+                read_.fetch_add(1);
+                unsigned count = 0;
+                std::memcpy(&count, r.data, 4);
+                if(r.size != length(count) || !check((const uint8_t*)r.data, count, r.size)){
+                    error("bad message, consumer", (int)consNo);
+                }
+            }
+
+            if(consNo == 0){
+                nbc.free(&r);
+            }
+        }
+
+        nbc.free(&r);
+        psched->remove_thread();
+    }
+
+private:
+    int commit_transaction(unsigned count, size_t len){
+        auto tra = nbc.start_transaction(len);
+        if(tra.errcode < 0){
+            return tra.errcode;
+        }
+
+        fill((uint8_t*)tra.new_buf.data, count, len);
+        tra.new_buf.size = len;
+        return nbc.commit_transaction(tra, false);
+    }
+
+    static void fill(uint8_t* p, unsigned count, size_t len){
+        std::memcpy(p, &count, 4);
+        for(size_t k = 4; k < len; ++k){
+            p[k] = (uint8_t)(count + k);
+        }
+    }
+
+    static bool check(const uint8_t* p, unsigned count, size_t len){
+        for(size_t k = 4; k < len; ++k){
+            if(p[k] != (uint8_t)(count + k)){
+                return false;
+            }
+        }
+        return true;
     }
 
+    void error(const char* what, int code){
+        errors_.fetch_add(1);
+        under_lock([=](){
+            std::cout << "** " << what << ": " << code << "\n";
+        });
+    }
+
+    unsigned cycles_;
+    Buf nbc;
+    std::atomic<bool> done_ = {false};
+    std::atomic<unsigned> read_ = {0};
+    std::atomic<unsigned> errors_ = {0};
+};
+
+// bank of topics: the producer commits to random topics, every consumer visits the changed topics
+// by its own bitmap; no commit shall be lost (after the producer stops every consumer has seen
+// the last value of every topic) and values of a topic never go back
+struct NtbTestBank
+        : public NtbTesBase
+{
+    enum{
+        NTopics = 300,
+        NConsumers = 2
+    };
+
+    typedef ntuplebuf::NTupleBufferBankTyped<unsigned, NConsumers + 2, DataBase> Bank;
 
+    static_assert(sizeof(Bank::ControlWord) == sizeof(unsigned), "control words of the bank shall be dense");
+
+    NtbTestBank(unsigned cycles)
+    : cycles_(cycles), bank_(NTopics, NConsumers)
     {
-        //T1 tst(50, T1::COMMIT, T1::CONSUME);
+        psched = std::unique_ptr<Shed>(new Shed(
+                std::shared_ptr<Alg>(new Alg(0.9)))
+        );
+    }
 
-        //T1 tst(1, T1::P_SIMPLE, T1::C_SIMPLE);
-        //T1 tst(10, T1::COMMIT, T1::C_SIMPLE);
+    void start(){
+        std::cout << "\n\n===== staring bank test ====== topics: " << NTopics
+            << "   consumers: " << NConsumers << "   cycles: " << cycles_ << "\n";
 
-        //T1 tst(1, T1::P_SIMPLE, T1::CONSUME);
-        T1 tst(10, T1::COMMIT, T1::CONSUME);
-        tst.start();
+        std::thread threads[NConsumers];
+        for(unsigned i = 0; i < NConsumers; ++i){
+            threads[i] = std::thread([=](){ this->consumer(i);});
+        }
+
+        sleep(1); // allow threads to start (for deterministic test behavior)
+
+        producer();
+
+        for(auto& t: threads){
+            t.join();
+        }
+
+        std::cout << (errors_.load()? "** " : "") << "bank: visited " << visited_.load()
+            << ", errors " << errors_.load() << "\n";
+    }
+
+    void producer(){
+        psched->add_thread();
+        psched->start();
+
+        std::mt19937 rnd(1);
+        DataBase* p = nullptr;
+        for(unsigned count = 1; count <= cycles_; ++count){
+            size_t topic = rnd() % NTopics;
+            if(bank_.start_writing(topic, &p) < 0){
+                error("write error", (int)topic);
+                break;
+            }
+
+            p->count = count;
+            last_[topic] = count;
+            bank_.commit(topic, &p);
+        }
+
+        done_.store(true);
+        psched->remove_thread();
+    }
+
+    void consumer(unsigned consNo){
+        psched->add_thread();
+
+        std::vector<unsigned> seen(NTopics, 0);
+        for(bool done = false; !done;){
+            done = done_.load(); // (then the last scan sees all commits)
+            YELD_ntuplebuf // (the scan itself has no yeld point if nothing changed)
+
+            visited_ += bank_.for_each_changed(consNo, [&](size_t topic){
+                DataBase* p = nullptr;
+                if(bank_.start_reading(topic, &p) < 0 || p == nullptr || p->count < seen[topic]){
+                    error("bad topic read, consumer", (int)consNo);
+                }else{
+                    seen[topic] = p->count;
+                }
+                bank_.free(topic, &p);
+            });
+        }
+
+        for(size_t t = 0; t < NTopics; ++t){
+            if(seen[t] != last_[t]){
+                error("lost commit, topic", (int)t);
+            }
+        }
+
+        psched->remove_thread();
+    }
+
+private:
+    void error(const char* what, int code){
+        errors_.fetch_add(1);
+        under_lock([=](){
+            std::cout << "** " << what << ": " << code << "\n";
+        });
     }
 
+    unsigned cycles_;
+    Bank bank_;
+    unsigned last_[NTopics] = {}; // (written by the producer before done_)
+    std::atomic<bool> done_ = {false};
+    std::atomic<unsigned> visited_ = {0};
+    std::atomic<unsigned> errors_ = {0};
+};
+
+// group of two buffers: the producer updates one or both of them per publish, readers check that
+// every snapshot is consistent (member 0 records the count last written to member 1)
+struct NtbTestGroup
+        : public NtbTesBase
+{
+    enum{
+        NReaders = 2
+    };
+
+    typedef ntuplebuf::NTupleBufferDynAlloc<unsigned, NReaders + 4> Member;
+    typedef ntuplebuf::NTupleBufferGroup<Member, 2, unsigned, NReaders + 2> Group;
+
+    struct Msg0{ unsigned count; unsigned count1; };
+
+    NtbTestGroup(unsigned cycles)
+    : cycles_(cycles), m0_(sizeof(Msg0)), m1_(sizeof(unsigned)), group_(new Group({&m0_, &m1_}))
     {
-        // T1 tst(10, T1::COMMIT, T1::POP);
-        T1 tst(50, T1::TRANSACT, T1::POP);
+        psched = std::unique_ptr<Shed>(new Shed(
+                std::shared_ptr<Alg>(new Alg(0.9)))
+        );
+    }
+
+    void start(){
+        std::cout << "\n\n===== staring group test ====== readers: " << NReaders
+            << "   cycles: " << cycles_ << "\n";
+
+        std::thread threads[NReaders];
+        for(unsigned i = 0; i < NReaders; ++i){
+            threads[i] = std::thread([=](){ this->reader(i);});
+        }
+
+        sleep(1); // allow threads to start (for deterministic test behavior)
+
+        producer();
+
+        for(auto& t: threads){
+            t.join();
+        }
+
+        std::cout << (errors_.load()? "** " : "") << "group: snapshots " << snapshots_.load()
+            << ", errors " << errors_.load() << "\n";
+    }
+
+    void producer(){
+        psched->add_thread();
+        psched->start();
+
+        std::mt19937 rnd(1);
+        unsigned count1 = 0;
+        for(unsigned count = 1; count <= cycles_; ++count){
+            void* p = nullptr;
+            if(rnd() % 2 == 0){
+                count1 = count;
+                if(group_->start_writing(1, &p) < 0){
+                    error("write error, member", 1);
+                    break;
+                }
+                *(unsigned*)p = count1;
+            }
+
+            if(group_->start_writing(0, &p) < 0){
+                error("write error, member", 0);
+                break;
+            }
+            *(Msg0*)p = Msg0{count, count1};
+
+            if(group_->publish() < 0){
+                error("publish error", (int)count);
+                break;
+            }
+        }
+
+        done_.store(true);
+
+        while(readers_done_.load() < NReaders){
+            YELD_ntuplebuf
+        }
+        group_.reset(); // (releases member buffers: control operations, so before remove_thread())
+        psched->remove_thread();
+    }
+
+    void reader(unsigned readerNo){
+        psched->add_thread();
+
+        Group::Snapshot s = {};
+        unsigned seen = 0;
+        for(bool done = false; !done;){
+            done = done_.load();
+            YELD_ntuplebuf
+
+            if(group_->start_reading(&s) < 0){
+                error("read error, reader", (int)readerNo);
+                break;
+            }
+            if(s.slot == 0){
+                continue;
+            }
+
+            const Msg0* p0 = (const Msg0*)s.data[0];
+            unsigned c1 = (s.data[1] != nullptr)? *(const unsigned*)s.data[1] : 0;
+            if(p0 == nullptr || p0->count1 != c1 || p0->count < seen){
+                error("inconsistent snapshot, reader", (int)readerNo);
+            }else{
+                seen = p0->count;
+            }
+            ++snapshots_;
+        }
+
+        if(seen != cycles_){
+            error("last publish not seen, reader", (int)readerNo);
+        }
+
+        group_->free(&s);
+        readers_done_.fetch_add(1);
+        psched->remove_thread();
+    }
+
+private:
+    void error(const char* what, int code){
+        errors_.fetch_add(1);
+        under_lock([=](){
+            std::cout << "** " << what << ": " << code << "\n";
+        });
+    }
+
+    unsigned cycles_;
+    Member m0_;
+    Member m1_;
+    std::unique_ptr<Group> group_;
+    std::atomic<bool> done_ = {false};
+    std::atomic<unsigned> readers_done_ = {0};
+    std::atomic<unsigned> snapshots_ = {0};
+    std::atomic<unsigned> errors_ = {0};
+};
+
+// copy-on-write (chunked) transactions mixed with whole-message writes and transactions,
+// a lagging reader keeps different buffers busy; every committed message is compared with the model
+struct NtbTestChunks
+{
+    static unsigned long run(unsigned cycles = 3000){
+        psched = std::unique_ptr<Shed>(new Shed(std::shared_ptr<Alg>(new Alg(0.9))));
+        psched->add_thread(); // (the only thread)
+        psched->start();
+
+        const size_t size = 10000; // (the last chunk is partial)
+        ntuplebuf::NTupleBufferDynAlloc<unsigned, 4> buf(size);
+        std::vector<uint8_t> model(size, 0);
+        std::mt19937 rnd(1);
+        unsigned long errors = (buf.set_chunk_size(100) != -93)? 1 : 0;
+        errors += (buf.set_chunk_size(256) != 0);
+
+        void* lagging = nullptr;
+        for(unsigned i = 0; i < cycles; ++i){
+            unsigned mode = rnd() % 10;
+            if(mode < 8){
+                auto tra = buf.start_chunked_transaction();
+                for(unsigned r = rnd() % 4; r > 0; --r){
+                    size_t off = rnd() % size;
+                    size_t len = std::min<size_t>(rnd() % 600, size - off);
+                    uint8_t* p = (uint8_t*)buf.write_chunks(tra, off, len);
+                    for(size_t k = 0; k < len; ++k){
+                        p[k] = model[off + k] = (uint8_t)rnd();
+                    }
+                }
+                errors += (buf.commit_chunked_transaction(tra, false) != 0);
+            }else if(mode < 9){ // (through a handle every other time)
+                void* p = nullptr;
+                decltype(buf)::WriteHandle h;
+                if(i % 2 == 0){
+                    buf.start_writing(&p);
+                }else{
+                    buf.start_writing(h);
+                    p = h.get();
+                }
+                for(size_t k = 0; k < size; ++k){
+                    ((uint8_t*)p)[k] = model[k] = (uint8_t)rnd();
+                }
+                if(i % 2 == 0){
+                    buf.commit(&p);
+                }else{
+                    buf.commit(h);
+                }
+            }else{
+                auto tra = buf.start_transaction();
+                std::memcpy(tra.new_buf, tra.old_buf, size);
+                size_t off = rnd() % size;
+                ((uint8_t*)tra.new_buf)[off] = model[off] = (uint8_t)rnd();
+                errors += (buf.commit_transaction(tra, false) != 0);
+            }
+
+            void* p = nullptr;
+            buf.start_reading(&p);
+            errors += (p == nullptr || std::memcmp(p, model.data(), size) != 0);
+            buf.free(&p);
+
+            if(i % 3 == 0){
+                buf.start_reading(&lagging);
+            }
+        }
+        buf.free(&lagging);
+
+        psched->remove_thread();
+
+        std::cout << (errors? "** " : "") << "chunked transactions test: " << cycles << " cycles, "
+            << errors << " errors\n";
+        return errors;
+    }
+};
+
+// SlotCopyFromOld with a throwing copy: the slot of the transaction still holds a valid object
+// (not destructed twice when the buffer is destroyed)
+struct NtbTestSlotCopyThrow
+{
+    struct Msg{
+        std::string s = std::string(100, 'x'); // (on the heap)
+        static bool fail;
+
+        Msg() = default;
+        Msg(const Msg& m): s(check(m).s){}
+        Msg& operator=(const Msg& m){
+            s = check(m).s;
+            return *this;
+        }
+
+        static const Msg& check(const Msg& m){
+            if(fail){
+                throw std::runtime_error("copy");
+            }
+            return m;
+        }
+    };
+
+    static unsigned long run(){
+        psched = std::unique_ptr<Shed>(new Shed(std::shared_ptr<Alg>(new Alg(0.9))));
+        psched->add_thread(); // (the only thread)
+        psched->start();
+
+        unsigned long errors = 0;
+        {
+            ntuplebuf::NTupleBufferDynAllocTyped<unsigned, 4, Msg, ntuplebuf::MemOrderSeqCst,
+                ntuplebuf::NTupleBufferControl, ntuplebuf::SlotCopyFromOld> buf;
+
+            auto tra = buf.start_transaction();
+            tra.new_buf->s = "old";
+            errors += (buf.commit_transaction(tra, false) != 0);
+
+            Msg::fail = true;
+            bool thrown = false;
+            try{
+                buf.start_transaction();
+            }catch(const std::runtime_error&){
+                thrown = true; // (the slots of the transaction stay referenced)
+            }
+            Msg::fail = false;
+            errors += !thrown;
+
+            tra = buf.start_transaction();
+            errors += (tra.errcode != 0 || tra.new_buf->s != "old");
+            errors += (buf.commit_transaction(tra, false) != 0);
+        }
+
+        psched->remove_thread();
+
+        std::cout << (errors? "** " : "") << "slot copy exception test: " << errors << " errors\n";
+        return errors;
+    }
+};
+
+bool NtbTestSlotCopyThrow::Msg::fail = false;
+
+// writer progress under reader traffic: one producer commits transactions (force == false) while
+// consumers poll start_reading() as fast as the scheduler lets them; every commit shall succeed
+// (there is no other producer), and its failed CASes are bounded by one per consumer (FA engine)
+template<template<typename, unsigned, typename> class Engine = ntuplebuf::NTupleBufferControl>
+struct NtbTestWriterProgress
+        : public NtbTesBase
+{
+    enum{
+        NConsumers = 5
+    };
+
+    NtbTestWriterProgress(unsigned cycles)
+    : cycles_(cycles)
+    {
+        psched = std::unique_ptr<Shed>(new Shed(
+                std::shared_ptr<Alg>(new Alg(0.9)))
+        );
+    }
+
+    unsigned long start(){
+        std::cout << "\n\n===== staring writer progress test ====== consumers: " << NConsumers
+            << "   cycles: " << cycles_ << "\n";
+
+        uint64_t retries = ntuplebuf::stats_page().total(ntuplebuf::StatsPage::CAS_RETRY);
+
+        std::thread threads[NConsumers];
+        for(unsigned i = 0; i < NConsumers; ++i){
+            threads[i] = std::thread([=](){ this->consumer();});
+        }
+
+        sleep(1); // allow threads to start (for deterministic test behavior)
+
+        producer();
+
+        for(auto& t: threads){
+            t.join();
+        }
+
+        retries = ntuplebuf::stats_page().total(ntuplebuf::StatsPage::CAS_RETRY) - retries;
+        unsigned long errors = errors_.load() + (max_retries_ > NConsumers);
+
+        std::cout << (errors? "** " : "") << "writer progress: " << cycles_ << " commits, "
+            << retries << " CAS retries (" << max_retries_ << " at most per commit), errors " << errors << "\n";
+        return errors;
+    }
+
+    void producer(){
+        psched->add_thread();
+        psched->start();
+
+        for(unsigned i = 0; i < cycles_; ++i){
+            auto tra = nbc.start_transaction();
+            if(tra.errcode < 0){
+                errors_.fetch_add(1);
+                break;
+            }
+
+            tra.new_buf->count = i + 1;
+
+            uint64_t retries = ntuplebuf::stats_page().total(ntuplebuf::StatsPage::CAS_RETRY);
+            if(nbc.commit_transaction(tra, false) != 0){ // (a collision is an error too: no other producer)
+                errors_.fetch_add(1);
+                break;
+            }
+
+            retries = ntuplebuf::stats_page().total(ntuplebuf::StatsPage::CAS_RETRY) - retries;
+            if(retries > max_retries_){
+                max_retries_ = retries;
+            }
+        }
+
+        psched->remove_thread();
+        stop_.store(true);
+    }
+
+    void consumer(){
+        psched->add_thread();
+
+        DataBase* p = nullptr;
+        while(!stop_.load()){
+            if(nbc.start_reading(&p) < 0){
+                errors_.fetch_add(1);
+                break;
+            }
+        }
+
+        nbc.free(&p);
+        psched->remove_thread();
+    }
+
+private:
+    ntuplebuf::NTupleBufferDynAllocTyped<
+        unsigned, NConsumers + 2, DataBase, ntuplebuf::MemOrderSeqCst, Engine
+    > nbc;
+
+    unsigned cycles_;
+    uint64_t max_retries_ = 0; // (readers do not retry CAS, except rare folds of the pending counter)
+    std::atomic<bool> stop_ = {false};
+    std::atomic<unsigned long> errors_ = {0};
+};
+
+// usage counters of the process page and of the buffer (one thread, so every event is known exactly
+// and there are no CAS retries)
+template<template<typename, unsigned, typename> class Engine = ntuplebuf::NTupleBufferControl>
+struct NtbTestStats
+{
+    typedef ntuplebuf::StatsPage SP;
+
+    static unsigned long run(){
+        psched = std::unique_ptr<Shed>(new Shed(std::shared_ptr<Alg>(new Alg(0.9))));
+        psched->add_thread(); // (the only thread)
+        psched->start();
+
+        uint64_t before[SP::NUM_EVENTS];
+        for(unsigned e = 0; e < SP::NUM_EVENTS; ++e){
+            before[e] = ntuplebuf::stats_page().total((SP::Event)e);
+        }
+
+        ntuplebuf::NTupleBufferDynAlloc<unsigned, 4, ntuplebuf::MemOrderSeqCst, Engine> buf(sizeof(unsigned));
+        void* r = nullptr;
+        buf.start_reading(&r); // no data
+
+        for(unsigned i = 0; i < 3; ++i){ // 2 messages overwritten unread
+            void* w = nullptr;
+            buf.start_writing(&w);
+            buf.commit(&w);
+        }
+
+        buf.start_reading(&r); // (the current one is read)
+        auto tra = buf.start_transaction();
+        void* w = nullptr;
+        buf.start_writing(&w);
+        buf.commit(&w);
+        buf.commit_transaction(tra, false); // collision
+
+        void* w1 = nullptr;
+        void* w2 = nullptr;
+        void* w3 = nullptr;
+        buf.start_writing(&w1);
+        buf.start_writing(&w2);
+        int full = buf.start_writing(&w3); // no free slot (r, current, w1, w2)
+        buf.free(&r);
+        buf.commit(&w1); // overwrites the current one unread
+        buf.commit(&w2); // and again
+
+        decltype(buf) other(sizeof(unsigned));
+        void* o = nullptr;
+        other.start_reading(&o); // (counted by the process page, not by buf)
+
+        psched->remove_thread();
+
+        const uint64_t expected[SP::NUM_EVENTS] = {0, 1, 1, 1, 0, 4};
+        unsigned long errors = (full != -35);
+        for(unsigned e = 0; e < SP::NUM_EVENTS; ++e){
+            uint64_t n = ntuplebuf::stats_page().total((SP::Event)e) - before[e];
+            uint64_t own = buf.get_control().stats().total((SP::Event)e);
+            errors += (n != expected[e] + (e == SP::NO_DATA) || own != expected[e]);
+        }
+
+        std::cout << (errors? "** " : "") << "stats test: " << errors << " errors\n";
+        return errors;
+    }
+};
+
+#ifdef __linux__
+// buffer and stats page in shared memory: create/attach (memfd), layout and readiness checks,
+// a reader in another process woken by start_reading_wait(), a monitor of the stats page
+struct NtbTestShm
+{
+    typedef ntuplebuf::NTupleBufferShm<unsigned, 5> Buffer;
+    typedef ntuplebuf::NTupleBufferShm<unsigned, 5, ntuplebuf::MemOrderSeqCst, ntuplebuf::NTupleBufferControlFA> BufferFA;
+    typedef ntuplebuf::NTupleBufferShm<unsigned, 5, ntuplebuf::NoWait<ntuplebuf::MemOrderSeqCst>> BufferNoWait;
+    typedef ntuplebuf::StatsPage SP;
+
+    static void put(Buffer& buf, unsigned long v){
+        void* p = nullptr;
+        buf.start_writing(&p);
+        *static_cast<unsigned long*>(p) = v;
+        buf.commit(&p);
+    }
+
+    static unsigned long get(Buffer& buf){ // (0 if no data)
+        void* p = nullptr;
+        buf.start_reading(&p);
+        unsigned long v = (p != nullptr)? *static_cast<unsigned long*>(p) : 0;
+        buf.free(&p);
+        return v;
+    }
+
+    static unsigned long run_buffer(){
+        unsigned long errors = 0;
+
+        int fd = memfd_create("ntb_test", 0);
+        if(fd < 0){
+            return 1;
+        }
+
+        {
+            Buffer none(fd, sizeof(unsigned long), false); // not sized yet
+            errors += (none.errcode() != Buffer::ERR_NOT_READY);
+        }
+
+        if(ftruncate(fd, 4096) != 0){ // sized, but the ready flag is not set
+            ++errors;
+        }else{
+            Buffer half(fd, sizeof(unsigned long), false);
+            errors += (half.errcode() != Buffer::ERR_NOT_READY);
+        }
+
+        fd = (close(fd), memfd_create("ntb_test", 0)); // (init() expects an empty object)
+        Buffer buf(fd, sizeof(unsigned long), true);
+        Buffer att(fd, 0, false);
+        errors += (buf.errcode() != 0 || att.errcode() != 0 || att.get_data_size() != sizeof(unsigned long));
+
+        put(buf, 1);
+        errors += (get(att) != 1);
+        put(buf, 2);
+        errors += (get(att) != 2 || get(buf) != 2);
+
+        {
+            Buffer other_size(fd, 2 * sizeof(unsigned long), false);
+            BufferFA other_engine(fd, 0, false); // (the same size of the control structure)
+            BufferNoWait no_wait(fd, 0, false);
+            errors += (other_size.errcode() != Buffer::ERR_LAYOUT || other_engine.errcode() != BufferFA::ERR_LAYOUT);
+            errors += (no_wait.errcode() != BufferNoWait::ERR_LAYOUT);
+        }
+
+        // the other process waits for a message newer than 2
+        pid_t pid = fork();
+        if(pid == 0){
+            Buffer child(fd, sizeof(unsigned long), false);
+            void* p = nullptr;
+            int res = child.start_reading(&p); // (message 2)
+            res = (res < 0)? res : child.start_reading_wait(&p, std::chrono::seconds(10));
+            bool ok = child.errcode() == 0 && res >= 0 && p != nullptr && *static_cast<unsigned long*>(p) == 3;
+            _exit(ok? 0 : 1);
+        }
+
+        if(pid < 0){
+            ++errors;
+        }else{
+            std::this_thread::sleep_for(std::chrono::milliseconds(50)); // (the child is likely waiting by now)
+            put(buf, 3);
+            int status = 0;
+            errors += (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0);
+        }
+
+        close(fd);
+        return errors;
+    }
+
+    static unsigned long run_stats(){
+        unsigned long errors = 0;
+        std::string name = "/ntb_test_stats_" + std::to_string(getpid());
+        const SP* dflt = &ntuplebuf::stats_page();
+
+        {
+            ntuplebuf::NTupleBufferStatsShm none(name.c_str(), false);
+            errors += (none.errcode() != -ENOENT);
+        }
+
+        {
+            ntuplebuf::NTupleBufferStatsShm stats(name.c_str(), true);
+            ntuplebuf::NTupleBufferStatsShm mon(name.c_str(), false);
+            errors += (stats.errcode() != 0 || mon.errcode() != 0 || &ntuplebuf::stats_page() != stats.page());
+
+            ntuplebuf::NTupleBufferDynAlloc<unsigned, 4> buf(sizeof(unsigned));
+            void* r = nullptr;
+            buf.start_reading(&r); // no data
+            buf.start_reading(&r);
+            errors += (mon.page() == nullptr || mon.page()->total(SP::NO_DATA) != 2);
+        }
+
+        errors += (&ntuplebuf::stats_page() != dflt); // (the creator has set it back)
+        errors += (ntuplebuf::NTupleBufferStatsShm::unlink(name.c_str()) != 0);
+        return errors;
+    }
+
+    static unsigned long run(){
+        psched = std::unique_ptr<Shed>(new Shed(std::shared_ptr<Alg>(new Alg(0.9))));
+        psched->add_thread(); // (the only thread)
+        psched->start();
+
+        unsigned long errors = run_buffer() + run_stats();
+
+        psched->remove_thread();
+
+        std::cout << (errors? "** " : "") << "shared memory test: " << errors << " errors\n";
+        return errors;
+    }
+};
+#endif
+
+// classic triple buffer without commit(): start_writing() commits the previous buffer,
+// so 3 buffers are sufficient for 1 writer and 1 reader holding an older message
+template<
+    template<typename, unsigned, typename> class Engine = ntuplebuf::NTupleBufferControl,
+    typename MemOrder = ntuplebuf::MemOrderSeqCst
+>
+struct NtbTestTriple
+{
+    static unsigned long run(){
+        psched = std::unique_ptr<Shed>(new Shed(std::shared_ptr<Alg>(new Alg(0.9))));
+        psched->add_thread(); // (the only thread)
+        psched->start();
+
+        Engine<unsigned, 3, MemOrder> control;
+        int w = 0;
+        int r = 0;
+        int res[5];
+        res[0] = control.start_writing(&w);
+        res[1] = control.start_writing(&w); // commits 1
+        res[2] = control.start_reading(&r); // holds 1
+        res[3] = control.start_writing(&w); // commits 2
+        res[4] = control.start_writing(&w); // commits 3, takes 2 (replaced, unreferenced)
+
+        psched->remove_thread();
+
+        const int expected[5] = {1, 2, 1, 3, 2};
+        unsigned long errors = 0;
+        for(unsigned i = 0; i < 5; ++i){
+            errors += (res[i] != expected[i]);
+        }
+
+        std::cout << (errors? "** " : "") << "triple buffer test: " << errors << " errors\n";
+        return errors;
+    }
+};
+
+// commit timestamps and histograms (one thread, steady_clock nanoseconds)
+template<template<typename, unsigned, typename> class Engine = ntuplebuf::NTupleBufferControl>
+struct NtbTestTimes
+{
+    static unsigned long run(){
+        psched = std::unique_ptr<Shed>(new Shed(std::shared_ptr<Alg>(new Alg(0.9))));
+        psched->add_thread(); // (the only thread)
+        psched->start();
+
+        ntuplebuf::NTupleBufferDynAlloc<unsigned, 3, ntuplebuf::MemOrderSeqCst, Engine> buf(sizeof(unsigned));
+        const auto& times = buf.get_control().times();
+        const uint64_t ms = 1000000;
+
+        uint64_t t0 = ntuplebuf::commit_clock();
+        void* w = nullptr;
+        for(unsigned i = 0; i < 3; ++i){
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            buf.start_writing(&w);
+            buf.commit(&w);
+        }
+
+        void* r = nullptr;
+        buf.start_reading(&r);
+        uint64_t t = buf.commit_time(r);
+        std::this_thread::sleep_for(std::chrono::milliseconds(3));
+        buf.start_reading(&r); // (the same message, older now)
+        buf.free(&r);
+
+        psched->remove_thread();
+
+        unsigned long errors = 0;
+        errors += (t < t0 + 6 * ms || t != times.last_commit());
+        errors += (times.interval.total() != 2 || times.interval.max() < 2 * ms);
+        errors += (times.age.total() != 2 || times.age.max() < 3 * ms);
+        errors += (times.age.percentile(0.0) > times.age.percentile(1.0) || times.age.percentile(1.0) < 3 * ms);
+
+        // rows of reader threads, and the overflow row shared by the threads which found no row:
+        ntuplebuf::TimeHistogramRows rows;
+        std::vector<std::thread> readers;
+        for(unsigned i = 0; i < ntuplebuf::TimeHistogramRows::NUM_ROWS + 2; ++i){
+            readers.emplace_back([&rows, i](){
+                for(unsigned k = 0; k < 1000; ++k){
+                    rows.add(i * ms + k);
+                }
+            });
+        }
+        for(auto& th: readers){
+            th.join();
+        }
+        errors += (rows.total() != 1000 * readers.size() || rows.max() != (readers.size() - 1) * ms + 999);
+
+        std::cout << (errors? "** " : "") << "timestamps test: " << errors << " errors\n";
+        return errors;
+    }
+};
+
+// recorder (drained by the test thread, 2 pins, segments of 3 records) and replay
+struct NtbTestRecord
+{
+    typedef ntuplebuf::NTupleBufferDynAlloc<unsigned, 7> Buffer;
+
+    static unsigned long run(){
+        psched = std::unique_ptr<Shed>(new Shed(std::shared_ptr<Alg>(new Alg(0.9))));
+        psched->add_thread(); // (the only thread)
+        psched->start();
+
+        std::string prefix = "/tmp/ntb_record_test_" + std::to_string(getpid());
+        unsigned long errors = 0;
+        std::vector<unsigned long> replayed;
+        long nreplayed = 0;
+
+        {
+            Buffer buf(sizeof(unsigned long));
+            ntuplebuf::NTupleBufferRecorder<Buffer, 2> rec(buf, prefix.c_str(), 160);
+            errors += (rec.errcode() != 0);
+
+            void* p = nullptr;
+            auto put = [&](unsigned long v){
+                rec.start_writing(&p);
+                *static_cast<unsigned long*>(p) = v;
+                rec.commit(&p);
+            };
+
+            put(1);
+            put(2);
+            put(3); // no free pin: dropped
+            rec.drain();
+            rec.capture(); // no new commit: nothing queued
+
+            put(4);
+            buf.start_writing(&p); // popped before the recorder pins it: missed
+            *static_cast<unsigned long*>(p) = 5;
+            buf.commit(&p);
+            void* r = nullptr;
+            buf.pop(&r);
+            buf.free(&r);
+            rec.capture();
+
+            for(unsigned long v = 6; v <= 8; ++v){
+                put(v);
+                rec.drain();
+            }
+
+            errors += (rec.recorded() != 6 || rec.dropped() != 1 || rec.missed() != 1 || rec.log_error() != 0);
+        }
+
+        {
+            ntuplebuf::RecordLogReader log(prefix.c_str());
+            ntuplebuf::LogRecord lr;
+            uint64_t gen = 0;
+            while(log.next(&lr) > 0){
+                errors += (lr.size != sizeof(unsigned long) || lr.gen <= gen);
+                gen = lr.gen;
+                replayed.push_back(*static_cast<const unsigned long*>(lr.data));
+            }
+
+            Buffer out(sizeof(unsigned long));
+            ntuplebuf::NTupleBufferReplayer<Buffer> rp(out, prefix.c_str());
+            nreplayed = rp.run(false);
+            void* r = nullptr;
+            out.start_reading(&r);
+            errors += (r == nullptr || *static_cast<unsigned long*>(r) != 8);
+            out.free(&r);
+        }
+
+        psched->remove_thread();
+
+        errors += (replayed != std::vector<unsigned long>{1, 2, 4, 6, 7, 8} || nreplayed != 6);
+        errors += (access(ntuplebuf::RecordLogBase::segment_name(prefix, 1).c_str(), F_OK) != 0); // (rolled over)
+        for(unsigned i = 0; i < 3; ++i){
+            unlink(ntuplebuf::RecordLogBase::segment_name(prefix, i).c_str());
+        }
+
+        std::cout << (errors? "** " : "") << "record/replay test: " << errors << " errors\n";
+        return errors;
+    }
+};
+
+#ifdef __linux__
+// eventfd notifier: one signal per arm (a burst of commits coalesces), none while not armed
+struct NtbTestEventFd
+{
+    typedef ntuplebuf::NTupleBufferDynAllocTyped<unsigned, 5, unsigned long> Buffer;
+
+    static bool readable(int fd){
+        struct pollfd pfd = {fd, POLLIN, 0};
+        return poll(&pfd, 1, 0) == 1;
+    }
+
+    static unsigned long run(){
+        psched = std::unique_ptr<Shed>(new Shed(std::shared_ptr<Alg>(new Alg(0.9))));
+        psched->add_thread(); // (the only thread)
+        psched->start();
+
+        unsigned long errors = 0;
+        {
+            Buffer buf;
+            ntuplebuf::NTupleBufferEventFd<Buffer> notifier(buf);
+            Buffer::ReadHandle h;
+            unsigned long* p = nullptr;
+            auto put = [&](unsigned long v){
+                buf.start_writing(&p);
+                *p = v;
+                buf.commit(&p);
+            };
+
+            errors += (notifier.errcode() != 0 || notifier.arm(h) != 1 || readable(notifier.fd()));
+            put(1);
+            put(2);
+            put(3);
+            errors += (!readable(notifier.fd()) || notifier.ack() != 1 || notifier.signals() != 1);
+
+            put(4); // not armed: no signal
+            errors += (readable(notifier.fd()) || notifier.signals() != 1);
+            errors += (notifier.arm(h) != 0); // (data not read yet)
+
+            buf.start_reading(h);
+            errors += (*h.get() != 4 || notifier.arm(h) != 1 || notifier.arm(h) != 1);
+            put(5);
+            put(6);
+            errors += (notifier.ack() != 1 || notifier.signals() != 2);
+
+            buf.start_reading(h);
+            errors += (notifier.arm(h) != 1 || !notifier.disarm());
+            put(7);
+            errors += (readable(notifier.fd()) || notifier.signals() != 2);
+        }
+
+        psched->remove_thread();
+
+        std::cout << (errors? "** " : "") << "eventfd notifier test: " << errors << " errors\n";
+        return errors;
+    }
+};
+#endif
+
+#ifdef CORO_ntuplebuf
+// C++20 coroutine reader: resumed (through a queue executor) once per newer message, none while nothing is new
+struct NtbTestCoReader
+{
+    typedef ntuplebuf::NTupleBufferDynAllocTyped<unsigned, 5, unsigned long> Buffer;
+    typedef ntuplebuf::NTupleBufferShm<unsigned, 5> ShmBuffer;
+
+    struct Task{
+        struct promise_type{
+            Task get_return_object(){ return {}; }
+            std::suspend_never initial_suspend(){ return {}; }
+            std::suspend_never final_suspend() noexcept{ return {}; }
+            void return_void(){}
+            void unhandled_exception(){ std::terminate(); }
+        };
+    };
+
+    struct QueueExecutor{
+        std::vector<std::coroutine_handle<>> queue;
+        void post(std::coroutine_handle<> h){ queue.push_back(h); }
+        unsigned run(){
+            unsigned n = 0;
+            while(!queue.empty()){
+                auto h = queue.front();
+                queue.erase(queue.begin());
+                h.resume();
+                ++n;
+            }
+            return n;
+        }
+    };
+
+    static unsigned long value(const void* p){ return *static_cast<const unsigned long*>(p); }
+
+    template<typename Reader>
+    static Task consumer(Reader& reader, std::vector<unsigned long>& got, unsigned long last){
+        for(;;){
+            int res = co_await reader.next();
+            if(res < 0){
+                break;
+            }
+            if(res > 0){
+                got.push_back(value(reader.handle().get()));
+                if(got.back() == last){
+                    break;
+                }
+            }
+        }
+    }
+
+    template<typename B>
+    static unsigned long run_on(B& buf){
+        unsigned long errors = 0;
+        std::vector<unsigned long> got;
+        {
+            QueueExecutor exec;
+            ntuplebuf::NTupleBufferCoReader<B, QueueExecutor> reader(buf, exec);
+            consumer(reader, got, 4); // suspends: no data
+
+            typename B::WriteHandle h;
+            auto put = [&](unsigned long v){
+                buf.start_writing(h);
+                *static_cast<unsigned long*>(static_cast<void*>(h.get())) = v;
+                buf.commit(h);
+            };
+
+            put(1);
+            errors += (exec.run() != 1);
+            put(2);
+            buf.start_writing(h); // (nothing new before the commit)
+            *static_cast<unsigned long*>(static_cast<void*>(h.get())) = 3;
+            errors += (exec.run() != 1 || exec.run() != 0);
+            buf.commit(h);
+            errors += (exec.run() != 1);
+            put(4);
+            errors += (exec.run() != 1);
+        }
+
+        errors += (got != std::vector<unsigned long>{1, 2, 3, 4});
+        return errors;
+    }
+
+    static unsigned long run(){
+        psched = std::unique_ptr<Shed>(new Shed(std::shared_ptr<Alg>(new Alg(0.9))));
+        psched->add_thread(); // (the only thread)
+        psched->start();
+
+        unsigned long errors = 0;
+        {
+            Buffer buf;
+            errors += run_on(buf);
+        }
+#       ifdef __linux__
+        {
+            int fd = memfd_create("ntb_coro", 0);
+            ShmBuffer buf(fd, sizeof(unsigned long), true);
+            errors += (fd < 0 || buf.errcode() != 0)? 1 : run_on(buf);
+            if(fd >= 0){
+                close(fd);
+            }
+        }
+#       endif
+
+        psched->remove_thread();
+
+        std::cout << (errors? "** " : "") << "coroutine reader test: " << errors << " errors\n";
+        return errors;
+    }
+};
+#endif
+
+// one producer and two consumers (reading, popping and consuming) interleaved by the coroutine scheduler:
+// after every step a buffer referenced by a task is not free, messages are neither torn nor out of order;
+// at the end only the current buffer (if any) is referenced, and it is the last committed message
+// unless a pop() or consume() has taken that one
+template<template<typename, unsigned, typename> class Engine>
+struct NtbCoroScenario
+        : public lf_test_utils::CoroScenario
+{
+    enum{
+        NBUFS = 4,
+        NTasks = 3,
+        Commits = 4,
+        Reads = 3
+    };
+
+    typedef Engine<unsigned, NBUFS, ntuplebuf::MemOrderSeqCst> Control;
+
+    explicit NtbCoroScenario(bool transactions): transactions_(transactions){}
+
+    unsigned num_tasks() const override{ return NTasks; }
+
+    void task(unsigned i) override{
+        if(i == 0){
+            producer();
+        }else{
+            consumer(i);
+        }
+    }
+
+    bool invariant() override{
+        for(int b: held_){
+            if(b > 0 && control_.is_free(b)){
+                return false;
+            }
+        }
+        return !bad_;
+    }
+
+    bool check_final() override{
+        int r = 0;
+        int cur = control_.start_reading(&r);
+        unsigned last = (cur > 0)? slots_[cur - 1].a : 0;
+        control_.free(&r);
+
+        int busy = 0;
+        for(int b = 1; b <= NBUFS; ++b){
+            busy += control_.is_free(b)? 0 : 1;
+        }
+
+        bool latest = (cur > 0)
+            ? last == committed_
+            : committed_ == 0 || (taken_ & (1u << committed_)) != 0;
+        return !bad_ && busy == ((cur > 0)? 1 : 0) && latest;
+    }
+
+private:
+    void write(int b, unsigned c){
+        slots_[b - 1].a = c;
+        lf_test_utils::CoroutineSched::yeld(); // (a reader of this buffer would see it torn)
+        slots_[b - 1].b = c;
+    }
+
+    void producer(){
+        for(unsigned c = 1; c <= Commits; ++c){
+            if(transactions_ && c % 2 == 0){
+                auto tra = control_.start_transaction();
+                bad_ |= tra.errcode != 0;
+                held_[0] = tra.new_buf;
+                write(tra.new_buf, c);
+                held_[0] = 0;
+                int res = control_.commit_transaction(tra, false); // (fails if a consumer has popped or consumed)
+                bad_ |= res < 0;
+                if(res == 0){
+                    committed_ = c;
+                }
+            }else{
+                int w = 0;
+                bad_ |= control_.start_writing(&w) <= 0;
+                held_[0] = w;
+                write(w, c);
+                held_[0] = 0;
+                bad_ |= control_.commit(&w) < 0;
+                committed_ = c;
+            }
+        }
+    }
+
+    void consumer(unsigned i){
+        int r = 0;
+        unsigned last = 0;
+        for(unsigned k = 0; k < Reads; ++k){
+            bool popping = (i == 2 && k % 2 == 1);
+            bool consuming = (i == 1 && k == 1);
+            held_[i] = 0;
+            bad_ |= (popping? control_.pop(&r) : control_.start_reading(&r)) < 0;
+            held_[i] = r;
+
+            if(r > 0){
+                unsigned a = slots_[r - 1].a;
+                lf_test_utils::CoroutineSched::yeld();
+                unsigned b = slots_[r - 1].b;
+                bad_ |= a != b || a < last;
+                last = a;
+
+                if(popping || consuming){
+                    taken_ |= 1u << a; // (may be no longer current for consume(): then it is not cleared)
+                }
+                if(consuming){
+                    held_[i] = 0;
+                    bad_ |= control_.consume(&r) < 0 || r != 0;
+                }
+            }
+        }
+
+        held_[i] = 0;
+        bad_ |= control_.free(&r) < 0;
+    }
+
+    struct Slot{ unsigned a; unsigned b; };
+
+    bool transactions_;
+    Control control_;
+    Slot slots_[NBUFS] = {};
+    int held_[NTasks] = {}; // buffer referenced by the task (0 while it is inside of a control operation)
+    unsigned committed_ = 0; // the last message committed
+    unsigned taken_ = 0;     // bit c: message c has been popped or consumed
+    bool bad_ = false;
+};
+
+// consume() racing with the producer: the consumed buffer is retired and published again
+// under the same bufnum meanwhile; consume() shall clear current only if it is still the message
+// consumed, so at the end the last message is readable unless it is the one consumed
+template<template<typename, unsigned, typename> class Engine>
+struct NtbCoroConsume
+        : public lf_test_utils::CoroScenario
+{
+    enum{
+        NBUFS = 3, // (consumers + 2: the least for NTupleBufferControlFA)
+        Commits = 3
+    };
+
+    typedef Engine<unsigned, NBUFS, ntuplebuf::MemOrderSeqCst> Control;
+
+    unsigned num_tasks() const override{ return 2; }
+
+    void task(unsigned i) override{
+        if(i == 0){
+            for(unsigned c = 1; c <= Commits; ++c){
+                int w = 0;
+                bad_ |= control_.start_writing(&w) <= 0;
+                seqs_[w - 1] = c;
+                bad_ |= control_.commit(&w) < 0;
+            }
+        }else{
+            int r = 0;
+            bad_ |= control_.start_reading(&r) < 0;
+            if(r > 0){
+                consumed_ = seqs_[r - 1];
+                bad_ |= control_.consume(&r) < 0;
+            }
+        }
+    }
+
+    bool check_final() override{
+        int r = 0;
+        int cur = control_.start_reading(&r);
+        unsigned seq = (cur > 0)? seqs_[cur - 1] : 0;
+        control_.free(&r);
+        return !bad_ && ((cur > 0)? seq == Commits : consumed_ == Commits);
+    }
+
+private:
+    Control control_;
+    unsigned seqs_[NBUFS] = {};
+    unsigned consumed_ = 0;
+    bool bad_ = false;
+};
+
+struct NtbTestCoro
+{
+    template<template<typename, unsigned, typename> class Engine>
+    static unsigned long run(const char* name, unsigned long random_runs, unsigned long max_bounded_runs){
+        unsigned long errors = 0;
+        for(bool tr: {false, true}){
+            auto factory = [=](){
+                return std::unique_ptr<lf_test_utils::CoroScenario>(new NtbCoroScenario<Engine>(tr));
+            };
+
+            lf_test_utils::CoroutineSched sched;
+            auto rr = sched.run_random(factory, 1, random_runs);
+            auto rb = sched.run_bounded(factory, 3, max_bounded_runs);
+
+            for(auto* res: {&rr, &rb}){
+                errors += res->violations + res->incomplete;
+                std::cout << ((res->violations + res->incomplete)? "** " : "") << "coroutine sched, " << name
+                    << (tr? " (transactions)" : "") << ((res == &rr)? ": random " : ": preemption bound 3 ")
+                    << res->runs << " runs" << ((res == &rb && res->complete)? " (all)" : "")
+                    << ", " << res->steps << " steps, " << (unsigned long)(res->runs / (res->seconds + 1e-9))
+                    << " runs/s, violations " << res->violations << ", incomplete " << res->incomplete << "\n";
+            }
+
+            if(rr.violations + rb.violations > 0){ // (the trace reproduces it)
+                auto& trace = rr.violations? rr.trace : rb.trace;
+                std::cout << "** replayed: " << sched.replay(factory, trace).violations << " violation(s)\n";
+            }
+        }
+        return errors;
+    }
+
+    template<template<typename, unsigned, typename> class Engine>
+    static unsigned long run_consume(const char* name){
+        auto factory = [](){
+            return std::unique_ptr<lf_test_utils::CoroScenario>(new NtbCoroConsume<Engine>());
+        };
+
+        lf_test_utils::CoroutineSched sched;
+        auto res = sched.run_bounded(factory, 3);
+
+        unsigned long errors = res.violations + res.incomplete + !res.complete;
+        std::cout << (errors? "** " : "") << "coroutine sched, " << name << " consume() race: "
+            << res.runs << " runs, violations " << res.violations << ", incomplete " << res.incomplete << "\n";
+        return errors;
+    }
+};
+
+// SWAR field kernels vs. the original loop versions: every control word value
+// (all bits of all fields) if there are not too many of them, random field values otherwise
+template<typename ControlCodeT, unsigned NBUFS>
+struct NtbTestFields
+{
+    typedef ntuplebuf::ControlWordFields<ControlCodeT, NBUFS> F;
+
+    static unsigned long check(ControlCodeT cco){
+        unsigned long errors = 0;
+        errors += (F::find_new(cco) != F::find_new_loop(cco));
+
+        for(int b = -1; b <= (int)NBUFS; ++b){
+            ControlCodeT c1 = cco, c2 = cco;
+            errors += (F::inc_ref(c1, b) != F::inc_ref_loop(c2, b) || c1 != c2);
+
+            c1 = cco;
+            c2 = cco;
+            errors += (F::dec_ref(c1, b) != F::dec_ref_loop(c2, b) || c1 != c2);
+        }
+
+        return errors;
+    }
+
+    static unsigned long run(unsigned long random_samples = 1000000){
+        const unsigned bits = ntuplebuf::control_bitsize(NBUFS);
+        unsigned long errors = 0;
+        unsigned long n = 0;
+
+        if(bits <= 24){
+            for(unsigned long v = 0; v < (1ul << bits); ++v, ++n){
+                errors += check((ControlCodeT)v);
+            }
+        }else{
+            std::mt19937_64 rnd(1);
+            for(; n < random_samples; ++n){
+                ControlCodeT cco = 0;
+                for(unsigned i = 0; i <= NBUFS; ++i){
+                    cco |= (ControlCodeT)(rnd() & F::count_mask) << (i * F::count_bitsize);
+                }
+                errors += check(cco);
+            }
+        }
+
+        std::cout << (errors? "** " : "") << "fields test: " << sizeof(ControlCodeT) * 8 << " bits, NBUFS " << NBUFS
+            << ": " << n << " words, " << errors << " mismatches\n";
+        return errors;
+    }
+};
+
+int ntuplebuf_test(){
+    ntuplebuf::NTupleBufferControl<unsigned, 7> nbc;
+    // ntuplebuf::NTupleBufferControl<unsigned long, 8> nbc; // convinient to debug
+
+#   if 0
+    // the following declarations produce design time errors:
+
+    ntuplebuf::NTupleBufferControl<unsigned, 8> nbc_err_1;
+    ntuplebuf::NTupleBufferControl<int, 7> nbc_err_2;
+#   endif
+
+    /*
+    int wb = 0;
+    int rb = 0;
+    nbc.start_writing(&wb);
+    nbc.commit(&wb);
+    nbc.start_reading(&rb);
+    nbc.free(&rb);
+    nbc.start_writing(&wb);
+    nbc.start_reading(&rb);
+    nbc.start_writing(&wb);
+    nbc.start_reading(&rb);
+    nbc.start_writing(&wb);
+    nbc.start_reading(&rb);
+    nbc.start_writing(&wb);
+    nbc.start_reading(&rb);
+*/
+    NtbTestFields<uint8_t, 2>::run();
+    NtbTestFields<uint8_t, 3>::run();
+    NtbTestFields<uint16_t, 4>::run();
+    NtbTestFields<uint32_t, 5>::run();
+    NtbTestFields<uint32_t, 7>::run();
+    NtbTestFields<uint64_t, 7>::run();
+    NtbTestFields<uint64_t, 15>::run();
+#   if defined(__SIZEOF_INT128__)
+    NtbTestFields<ntuplebuf::uint128_t, 24>::run();
+#   endif
+
+    NtbTestChunks::run();
+    NtbTestSlotCopyThrow::run();
+
+    NtbTestStats<>::run();
+    NtbTestStats<ntuplebuf::NTupleBufferControlFA>::run();
+#   ifdef __linux__
+    NtbTestShm::run();
+#   endif
+
+    NtbTestTriple<>::run();
+    NtbTestTriple<ntuplebuf::NTupleBufferControlFA>::run();
+    NtbTestTriple<ntuplebuf::NTupleBufferControl, ntuplebuf::NoWait<ntuplebuf::MemOrderAcqRel>>::run();
+    NtbTestTriple<ntuplebuf::NTupleBufferControlFA, ntuplebuf::NoWait<ntuplebuf::MemOrderAcqRel>>::run();
+
+    NtbTestTimes<>::run();
+    NtbTestTimes<ntuplebuf::NTupleBufferControlFA>::run();
+
+    NtbTestRecord::run();
+#   ifdef __linux__
+    NtbTestEventFd::run();
+#   endif
+#   ifdef CORO_ntuplebuf
+    NtbTestCoReader::run();
+#   endif
+
+    // deterministic interleavings (coroutines):
+    NtbTestCoro::run<ntuplebuf::NTupleBufferControl>("CAS engine", 20000, 50000);
+    NtbTestCoro::run<ntuplebuf::NTupleBufferControlFA>("FA engine", 20000, 50000);
+    NtbTestCoro::run_consume<ntuplebuf::NTupleBufferControl>("CAS engine");
+    NtbTestCoro::run_consume<ntuplebuf::NTupleBufferControlFA>("FA engine");
+
+    typedef NtbTestMT<unsigned, 5, DataBase> T5;
+    typedef NtbTestMT<unsigned, 1, Data> T1;
+
+    {
+        T5 tst(20);
+        tst.start();
+    }
+
+    {
+        T1 tst(50, T1::COMMIT, T1::C_SIMPLE);
+        tst.start();
+    }
+
+    {
+        T5 tst(20, T5::COMMIT, T5::FREE);
+        tst.start();
+    }
+
+    {
+        //T1 tst(50, T1::COMMIT, T1::CONSUME);
+        T1 tst(20, T1::COMMIT, T1::C_SIMPLE);
+        //T1 tst(50, T1::P_SIMPLE, T1::CONSUME);
+        tst.start();
+    }
+
+
+    {
+        //T1 tst(50, T1::COMMIT, T1::CONSUME);
+
+        //T1 tst(1, T1::P_SIMPLE, T1::C_SIMPLE);
+        //T1 tst(10, T1::COMMIT, T1::C_SIMPLE);
+
+        //T1 tst(1, T1::P_SIMPLE, T1::CONSUME);
+        T1 tst(10, T1::COMMIT, T1::CONSUME);
+        tst.start();
+    }
+
+    {
+        // T1 tst(10, T1::COMMIT, T1::POP);
+        T1 tst(50, T1::TRANSACT, T1::POP);
+        tst.start();
+    }
+
+    // the same with wait-free reader control engine:
+    typedef NtbTestMT<unsigned, 5, DataBase, ntuplebuf::NTupleBufferControlFA> T5FA;
+    typedef NtbTestMT<unsigned, 1, Data, ntuplebuf::NTupleBufferControlFA> T1FA;
+
+    {
+        T5FA tst(20, T5FA::COMMIT, T5FA::FREE);
+        tst.start();
+    }
+
+    {
+        T1FA tst(10, T1FA::COMMIT, T1FA::CONSUME);
+        tst.start();
+    }
+
+    {
+        T1FA tst(50, T1FA::TRANSACT, T1FA::POP);
+        tst.start();
+    }
+
+    {
+        // start_writing() without commit(), NBUFS = consumers + 2:
+        T5FA tst(20, T5FA::P_SIMPLE, T5FA::C_SIMPLE);
+        tst.start();
+    }
+
+    // read-once consumers:
+    {
+        T1 tst(20, T1::COMMIT, T1::ONCE);
+        tst.start();
+    }
+
+    {
+        T1FA tst(20, T1FA::TRANSACT, T1FA::ONCE);
+        tst.start();
+    }
+
+    // slot handles:
+    {
+        T5 tst(20, T5::P_HANDLE, T5::HANDLE);
+        tst.start();
+    }
+
+    {
+        T1FA tst(20, T1FA::P_HANDLE, T1FA::HANDLE);
+        tst.start();
+    }
+
+    // automatically selected (8-bit) and 128-bit control words:
+    typedef NtbTestMT<ntuplebuf::AutoControlCode, 1, Data> T1A;
+
+    {
+        T1A tst(20, T1A::COMMIT, T1A::FREE);
+        tst.start();
+    }
+
+#   if DWCAS_ntuplebuf
+    typedef NtbTestMT<ntuplebuf::uint128_t, 5, DataBase> T5W;
+
+    {
+        T5W tst(20, T5W::TRANSACT, T5W::POP);
+        tst.start();
+    }
+#   endif
+
+    // slot policies:
+    struct ResetCount{
+        void operator()(DataBase& d) const{ d.count = 0; }
+    };
+
+    typedef NtbTestMT<unsigned, 1, Data, ntuplebuf::NTupleBufferControl, false, ntuplebuf::SlotCopyFromOld> T1C;
+    typedef NtbTestMT<
+        unsigned, 5, Data, ntuplebuf::NTupleBufferControlFA, false, ntuplebuf::SlotRecycle<ResetCount>
+    > T5R;
+
+    {
+        T1C tst(20, T1C::TRANSACT, T1C::FREE);
+        tst.start();
+    }
+
+    {
+        T5R tst(20, T5R::COMMIT, T5R::CONSUME);
+        tst.start();
+    }
+
+    {
+        T5R tst(20, T5R::TRANSACT, T5R::POP);
+        tst.start();
+    }
+
+    // variable-length messages:
+    NtbTestVar(200).start();
+
+    // bank of topics with "changed" bitmaps:
+    NtbTestBank(500).start();
+
+    // group of buffers published and read at once:
+    NtbTestGroup(300).start();
+
+    // several producers, ordered ("latest value") commits:
+    NtbTestOrdered<>(50).start();
+    NtbTestOrdered<ntuplebuf::NTupleBufferControlFA>(50).start();
+
+    // transactions of one producer under reader traffic:
+    NtbTestWriterProgress<ntuplebuf::NTupleBufferControlFA>(200).start();
+
+    // statically sized buffer:
+    typedef NtbTestMT<unsigned, 1, Data, ntuplebuf::NTupleBufferControl, true> T1S;
+    typedef NtbTestMT<unsigned, 5, DataBase, ntuplebuf::NTupleBufferControlFA, true> T5FAS;
+
+    {
+        T1S tst(20, T1S::TRANSACT, T1S::CONSUME);
+        tst.start();
+    }
+
+    {
+        T5FAS tst(10, T5FAS::COMMIT, T5FAS::FREE);
         tst.start();
     }
 
@@ -0,0 +1,311 @@
+#ifndef ntuplebuf_time_hpp
+#define ntuplebuf_time_hpp
+
+/*
+Optional commit timestamps of control engines (compiled in only if TIMESTAMPS_ntuplebuf is defined).
+
+The writer stamps its buffer before the (release) commit, as it stamps the generation, so a reader
+referencing the buffer reads the commit time with a relaxed load (commit_time()). Two histograms
+are kept along:
+
+    age        now - commit time, recorded by start_reading() / pop() of a message
+               (how stale the data is when consumers take it)
+    interval   time between successive successful commits (a stalled producer shows up here,
+               and in now - last_commit() meanwhile)
+
+Time is steady_clock (CLOCK_MONOTONIC) nanoseconds, or TSC ticks if TSC_ntuplebuf is defined
+(x86 with invariant TSC; the same in all processes, so it works in shared memory too).
+
+Histogram buckets are powers of 2: bucket 0 counts value 0, bucket i counts values in [2^(i-1), 2^i).
+The interval histogram is recorded by writers (one relaxed fetch_add). The age histogram is recorded
+on the read path, so it has a row per reader thread (TimeHistogramRows): a row is a few cache lines
+written by its owner only (relaxed load and store, no RMW), as rows of the stats page are, and queries
+sum the rows. A thread takes a row of a histogram at its first read of that buffer; threads which find
+no free row (more than TIME_ROWS_ntuplebuf of them) share an overflow row (fetch_add there).
+Readers of a histogram see counts which may be a few events behind.
+ */
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+
+// (the same default as in ntuplebuf.hpp, which includes this header)
+#ifndef CACHE_LINE_ntuplebuf
+#   define  CACHE_LINE_ntuplebuf 64
+#endif
+
+// reader rows of every age histogram (the overflow row aside)
+#ifndef TIME_ROWS_ntuplebuf
+#   define  TIME_ROWS_ntuplebuf 4
+#endif
+
+#if defined(TSC_ntuplebuf) && (defined(__x86_64__) || defined(__i386__))
+#   include <x86intrin.h>
+#endif
+
+
+namespace ntuplebuf {
+
+
+inline uint64_t commit_clock(){
+#if defined(TSC_ntuplebuf) && (defined(__x86_64__) || defined(__i386__))
+    return __rdtsc();
+#else
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+#endif
+}
+
+
+struct TimeHistogram
+{
+    enum: unsigned{
+        NUM_BUCKETS = 65
+    };
+
+    static unsigned bucket(uint64_t v){ // (the number of significant bits)
+#if defined(__GNUC__)
+        return (v == 0)? 0 : 64 - __builtin_clzll(v);
+#else
+        unsigned b = 0;
+        for(; v != 0; v >>= 1){
+            ++b;
+        }
+        return b;
+#endif
+    }
+
+    // the largest value counted by bucket b
+    static uint64_t upper_bound(unsigned b){
+        return (b == 0)? 0 : (b >= 64)? UINT64_MAX : ((uint64_t)1 << b) - 1;
+    }
+
+    void add(uint64_t v){
+        buckets_[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+
+        uint64_t m = max_.load(std::memory_order_relaxed);
+        while(v > m && !max_.compare_exchange_weak(m, v, std::memory_order_relaxed)){
+        }
+    }
+
+    uint64_t count(unsigned b) const{ return buckets_[b].load(std::memory_order_relaxed); }
+
+    uint64_t total() const{
+        uint64_t sum = 0;
+        for(auto& c: buckets_){
+            sum += c.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    uint64_t max() const{ return max_.load(std::memory_order_relaxed); }
+
+    // upper bound of the bucket containing the p-th fraction of values (e.g. 0.99), 0 if empty
+    uint64_t percentile(double p) const{ return percentile(*this, p); }
+
+    template<typename H> // any histogram with count(b) and total()
+    static uint64_t percentile(const H& h, double p){
+        uint64_t n = h.total();
+        uint64_t rank = (uint64_t)(p * (double)n);
+        uint64_t sum = 0;
+        for(unsigned b = 0; b < NUM_BUCKETS; ++b){
+            sum += h.count(b);
+            if(sum > rank || (sum == n && n != 0)){
+                return upper_bound(b);
+            }
+        }
+        return 0;
+    }
+
+    // by the only writer of the histogram (no RMW)
+    void add_owned(uint64_t v){
+        std::atomic<uint64_t>& c = buckets_[bucket(v)];
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+        if(v > max_.load(std::memory_order_relaxed)){
+            max_.store(v, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    std::atomic<uint64_t> buckets_[NUM_BUCKETS] = {};
+    std::atomic<uint64_t> max_ = {0};
+};
+
+
+/*
+Token of the calling thread for rows of TimeHistogramRows (0 if the thread has no token: overflow row).
+A thread takes one of the process-wide token slots at its first call and gives it back at exit
+(the next owner of the slot continues its rows). Tokens carry a random tag of the process,
+so threads of processes sharing a histogram (in shared memory) do not take the same row.
+ */
+struct TimeThreadSlots
+{
+    enum: unsigned{
+        MAX_THREADS = 64
+    };
+
+    static TimeThreadSlots& instance(){
+        static TimeThreadSlots slots;
+        return slots;
+    }
+
+    int take(){
+        for(unsigned i = 0; i < MAX_THREADS; ++i){
+            uint32_t used = used_[i].load(std::memory_order_relaxed);
+            if(used == 0 && used_[i].compare_exchange_strong(used, 1, std::memory_order_acquire)){
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+
+    void give(int slot){
+        used_[slot].store(0, std::memory_order_release);
+    }
+
+    uint64_t token(int slot) const{ return (slot < 0)? 0 : tag_ | (uint64_t)(slot + 1); }
+
+private:
+    TimeThreadSlots()
+        : tag_(((commit_clock() ^ (uint64_t)(uintptr_t)this) * 0x9e3779b97f4a7c15ull) << 8)
+    {}
+
+    uint64_t tag_; // (the low byte: slot + 1)
+    std::atomic<uint32_t> used_[MAX_THREADS] = {};
+};
+
+struct TimeThreadToken
+{
+    int slot = TimeThreadSlots::instance().take();
+
+    ~TimeThreadToken(){
+        if(slot >= 0){
+            TimeThreadSlots::instance().give(slot);
+        }
+    }
+};
+
+inline uint64_t time_thread_token(){
+    static thread_local TimeThreadToken tt;
+    return TimeThreadSlots::instance().token(tt.slot);
+}
+
+
+// row of the calling thread among n rows owned by thread tokens (-1: none, use the overflow row);
+// rows are taken in order and never given back, so the first free row is after the own one
+inline int thread_row(std::atomic<uint64_t>* owners, unsigned n){
+    uint64_t token = time_thread_token();
+    if(token == 0){
+        return -1;
+    }
+
+    for(unsigned i = 0; i < n; ++i){
+        uint64_t owner = owners[i].load(std::memory_order_relaxed);
+        if(owner == token){
+            return (int)i;
+        }
+        if(owner == 0 && owners[i].compare_exchange_strong(owner, token, std::memory_order_relaxed)){
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+
+// histogram with a row per recording thread (see above); the query API is the one of TimeHistogram
+struct TimeHistogramRows
+{
+    enum: unsigned{
+        NUM_ROWS = TIME_ROWS_ntuplebuf,
+        NUM_BUCKETS = TimeHistogram::NUM_BUCKETS
+    };
+
+    void add(uint64_t v){
+        int r = thread_row(owners_, NUM_ROWS);
+        if(r >= 0){
+            rows_[r].h.add_owned(v);
+        }else{
+            overflow_.add(v);
+        }
+    }
+
+    uint64_t count(unsigned b) const{
+        uint64_t sum = overflow_.count(b);
+        for(auto& r: rows_){
+            sum += r.h.count(b);
+        }
+        return sum;
+    }
+
+    uint64_t total() const{
+        uint64_t sum = overflow_.total();
+        for(auto& r: rows_){
+            sum += r.h.total();
+        }
+        return sum;
+    }
+
+    uint64_t max() const{
+        uint64_t m = overflow_.max();
+        for(auto& r: rows_){
+            m = (r.h.max() > m)? r.h.max() : m;
+        }
+        return m;
+    }
+
+    uint64_t percentile(double p) const{ return TimeHistogram::percentile(*this, p); }
+
+private:
+    struct alignas(CACHE_LINE_ntuplebuf) Row{
+        TimeHistogram h;
+    };
+
+    std::atomic<uint64_t> owners_[NUM_ROWS] = {}; // (read-mostly: one line for all rows)
+    Row rows_[NUM_ROWS];
+    alignas(CACHE_LINE_ntuplebuf) TimeHistogram overflow_;
+};
+
+
+// commit times of buffers (kept aside of the control word, accessed as Generations) and histograms
+template<unsigned NBUFS>
+struct CommitTimes
+{
+    uint64_t stamp(int bufnum){ // before the commit
+        uint64_t t = commit_clock();
+        times_[bufnum - 1].store(t, std::memory_order_relaxed);
+        return t;
+    }
+
+    void published(uint64_t t){ // after successful commit (t: as stamped)
+        uint64_t prev = last_.exchange(t, std::memory_order_relaxed);
+        if(prev != 0 && t >= prev){ // (commits of several producers may be stamped out of order)
+            interval.add(t - prev);
+        }
+    }
+
+    void read(int bufnum){ // by a reader referencing the buffer
+        uint64_t t = get(bufnum);
+        uint64_t now = commit_clock();
+        age.add((now > t)? now - t : 0);
+    }
+
+    uint64_t get(int bufnum) const{
+        return (bufnum > 0)? times_[bufnum - 1].load(std::memory_order_relaxed) : 0;
+    }
+
+    uint64_t last_commit() const{ return last_.load(std::memory_order_relaxed); }
+
+    TimeHistogramRows age; // (read path: a row per reader thread)
+    TimeHistogram interval;
+
+private:
+    std::atomic<uint64_t> times_[NBUFS] = {};
+    std::atomic<uint64_t> last_ = {0};
+};
+
+
+} // namespace
+
+#endif
@@ -0,0 +1,346 @@
+#ifndef ntuplebuf_var_hpp
+#define ntuplebuf_var_hpp
+
+/*
+N-tuple buffer for variable-length messages.
+
+Every message buffer (slot) is allocated separately and keeps the size of the committed message,
+so the writer commits an explicit length and readers get (data, size) span back:
+
+    NTupleBufferVar<unsigned, 7>::Span w = {nullptr, 0};
+    buf.start_writing(&w, max_len); // w.data: at least max_len bytes, w.size: capacity of the slot
+    w.size = encode(w.data);        // the length of the message
+    buf.commit(&w);
+
+    NTupleBufferVar<unsigned, 7>::Span r = {nullptr, 0};
+    buf.start_reading(&r);          // r.data, r.size: the current message (nullptr, 0 if no data)
+
+Capacity grows online: start_writing() reallocates the slot it takes if the slot is smaller than
+requested (or than the minimum set by reserve()). A slot taken by a writer is referenced by nobody else
+(its reference count was 0), so the retired memory is released at once and readers are never stopped.
+Allocation happens on the writer path only, and only when the capacity grows.
+
+Slots are found by pointer with a search over NBUFS slots (as in NTupleBufferRelay).
+The API is the same as of NTupleBufferDynAlloc otherwise, with Span* instead of void**.
+ */
+
+#include "ntuplebuf.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <algorithm> // std::min, std::max
+
+
+namespace ntuplebuf {
+
+
+template<
+    typename ControlCodeT,
+    unsigned NBUFS,
+    typename MemOrder = MemOrderSeqCst,
+    template<typename, unsigned, typename> class ControlEngine = NTupleBufferControl
+>
+struct NTupleBufferVar
+{
+    typedef int errcode_t;
+    typedef  ControlEngine<ControlCodeT, NBUFS, MemOrder> ControlCode;
+    typedef typename ControlCode::Transaction CCTransaction;
+    typedef typename ControlCode::gen_t gen_t;
+
+    struct Span{
+        void* data;
+        size_t size;
+    };
+
+    struct SpanTransacion{
+      errcode_t errcode;
+      Span old_buf;
+      Span new_buf; // (size: capacity; set to the length of the message before commit)
+    };
+
+    enum: errcode_t{
+        ERR_FOREIGN_PTR = -141, // the span was not obtained from this buffer
+        ERR_SIZE = -142,        // committed size exceeds the capacity of the slot
+        ERR_NO_MEMORY = -143    // slot reallocation failed (the slot is released)
+    };
+
+
+    explicit NTupleBufferVar(size_t initial_capacity){
+        min_capacity_.store(initial_capacity, std::memory_order_relaxed);
+        for(unsigned i = 0; i < NBUFS; ++i){
+            void* p = ::operator new(std::max(initial_capacity, (size_t)1));
+            slots_[i].store(p, std::memory_order_relaxed);
+            caps_[i] = initial_capacity;
+        }
+    }
+
+    NTupleBufferVar(const NTupleBufferVar&) = delete;
+    NTupleBufferVar& operator=(const NTupleBufferVar&) = delete;
+
+    ~NTupleBufferVar(){
+        for(unsigned i = 0; i < NBUFS; ++i){
+            ::operator delete(slots_[i].load(std::memory_order_relaxed));
+        }
+    }
+
+    // minimum capacity of slots taken by writers from now on (slots grow when taken)
+    void reserve(size_t capacity){
+        size_t c = min_capacity_.load(std::memory_order_relaxed);
+        while(c < capacity && !min_capacity_.compare_exchange_weak(c, capacity, std::memory_order_relaxed)){
+        }
+    }
+
+    size_t capacity() const{ return min_capacity_.load(std::memory_order_relaxed); }
+
+
+    errcode_t start_reading(Span* span){ // span shall hold the previous span (or nullptr data)
+        return start_reading(span, nullptr);
+    }
+
+    errcode_t start_reading(Span* span, gen_t* p_gen){
+        int bufnum = ptr2bufnum(span->data);
+        if(bufnum < 0){
+            return ERR_FOREIGN_PTR;
+        }
+
+        auto res = er(control.start_reading(&bufnum, p_gen));
+        if(res >= 0){
+            *span = bufnum2span(bufnum);
+        }
+        return res;
+    }
+
+    int start_reading_once(Span* span, gen_t* p_gen_seen){ // 1: new message, 0: already seen
+        int bufnum = ptr2bufnum(span->data);
+        if(bufnum < 0){
+            return ERR_FOREIGN_PTR;
+        }
+
+        int res = control.start_reading_once(&bufnum, p_gen_seen);
+        if(res >= 0){
+            *span = bufnum2span(bufnum);
+        }
+        return (res > 0)? 1 : res;
+    }
+
+    errcode_t start_reading_wait(
+            Span* span,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        int bufnum = ptr2bufnum(span->data);
+        if(bufnum < 0){
+            return ERR_FOREIGN_PTR;
+        }
+
+        auto res = er(control.start_reading_wait(&bufnum, timeout));
+        if(res >= 0){
+            *span = bufnum2span(bufnum);
+        }
+        return res;
+    }
+
+    int // returns 1 if updated, 0 on timeout
+    wait_for_update(
+            const Span& seen,
+            std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()
+    ){
+        return control.wait_for_update(std::max(0, ptr2bufnum(seen.data)), timeout);
+    }
+
+    void set_wait_spin(unsigned spin){ control.set_wait_spin(spin); }
+
+    errcode_t pop(Span* span){
+        int bufnum = ptr2bufnum(span->data);
+        if(bufnum < 0){
+            return ERR_FOREIGN_PTR;
+        }
+
+        auto res = er(control.pop(&bufnum));
+        if(res >= 0){
+            *span = bufnum2span(bufnum);
+        }
+        return res;
+    }
+
+    errcode_t free(Span* span){
+        int bufnum = ptr2bufnum(span->data);
+        if(bufnum < 0){
+            return ERR_FOREIGN_PTR;
+        }
+
+        auto res = er(control.free(&bufnum));
+        if(res >= 0){
+            *span = Span{nullptr, 0};
+        }
+        return res;
+    }
+
+    errcode_t consume(Span* span){
+        int bufnum = ptr2bufnum(span->data);
+        if(bufnum < 0){
+            return ERR_FOREIGN_PTR;
+        }
+
+        auto res = er(control.consume(&bufnum));
+        if(res >= 0){
+            *span = Span{nullptr, 0};
+        }
+        return res;
+    }
+
+    // commits the previous span (if any, span->size bytes), takes a slot of at least capacity bytes;
+    // span->size is set to the capacity of the slot
+    errcode_t start_writing(Span* span, size_t capacity){
+        int bufnum = ptr2bufnum(span->data);
+        if(bufnum < 0){
+            return ERR_FOREIGN_PTR;
+        }
+
+        if(bufnum > 0 && set_size(bufnum, span->size) < 0){
+            return ERR_SIZE;
+        }
+
+        auto res = er(control.start_writing(&bufnum));
+        if(res >= 0){
+            res = fit(bufnum, capacity);
+            *span = (res >= 0)? Span{slot(bufnum), caps_[bufnum - 1]} : Span{nullptr, 0};
+        }else if(bufnum == 0){
+            *span = Span{nullptr, 0}; // committed, but no free buffer (NTupleBufferControlFA)
+        }
+        return res;
+    }
+
+    errcode_t commit(Span* span){ // span->size: the length of the message
+        int bufnum = ptr2bufnum(span->data);
+        if(bufnum < 0){
+            return ERR_FOREIGN_PTR;
+        }
+
+        if(bufnum > 0 && set_size(bufnum, span->size) < 0){
+            return ERR_SIZE;
+        }
+
+        auto res = er(control.commit(&bufnum));
+        if(res >= 0){
+            *span = Span{nullptr, 0};
+        }
+        return res;
+    }
+
+    SpanTransacion start_transaction(size_t capacity){
+        CCTransaction tr = control.start_transaction();
+        SpanTransacion ret = {tr.errcode, bufnum2span(tr.old_buf), Span{nullptr, 0}};
+
+        if(tr.errcode == 0){
+            ret.errcode = fit(tr.new_buf, std::max(capacity, ret.old_buf.size));
+            if(ret.errcode < 0){ // (new buffer is released by fit())
+                int old_bufnum = tr.old_buf;
+                control.free(&old_bufnum);
+                ret.old_buf = Span{nullptr, 0};
+            }else{
+                ret.new_buf = Span{slot(tr.new_buf), caps_[tr.new_buf - 1]};
+            }
+        }
+
+        return ret;
+    }
+
+    int // returns 0 on success, 1 on failure (see NTupleBufferControl::commit_transaction()), negative on error
+    commit_transaction(SpanTransacion& tra, bool force){
+        if(tra.errcode != 0){
+            return -144;
+        }
+
+        CCTransaction cctra = {
+                0,
+                ptr2bufnum(tra.old_buf.data),
+                ptr2bufnum(tra.new_buf.data)
+        };
+
+        if(cctra.old_buf < 0 || cctra.new_buf <= 0){
+            return ERR_FOREIGN_PTR;
+        }
+
+        if(set_size(cctra.new_buf, tra.new_buf.size) < 0){
+            return ERR_SIZE;
+        }
+
+        return control.commit_transaction(cctra, force);
+    }
+
+    gen_t generation(const Span& span){ return control.generation(std::max(0, ptr2bufnum(span.data))); }
+    uint64_t commit_time(const Span& span){ return control.commit_time(std::max(0, ptr2bufnum(span.data))); }
+
+    ControlCode& get_control(){ return control; }
+
+
+protected:
+
+    errcode_t er(int fr){return std::min(0, fr);}
+
+    void* slot(int bufnum){ return slots_[bufnum - 1].load(std::memory_order_relaxed); }
+
+    // the slot is referenced by the caller, so it is not reallocated meanwhile;
+    // other slots may be, hence atomic pointers
+    int ptr2bufnum(void* ptr){
+        if(ptr == nullptr){
+            return 0;
+        }
+
+        for(unsigned i = 0; i < NBUFS; ++i){
+            if(slots_[i].load(std::memory_order_relaxed) == ptr){
+                return i + 1;
+            }
+        }
+
+        return -1;
+    }
+
+    Span bufnum2span(int bufnum){
+        return (bufnum > 0)
+            ? Span{slot(bufnum), sizes_[bufnum - 1].load(std::memory_order_relaxed)}
+            : Span{nullptr, 0};
+    }
+
+    // the size is read by readers referencing the slot after the (release) commit
+    int set_size(int bufnum, size_t size){
+        if(size > caps_[bufnum - 1]){
+            return -1;
+        }
+        sizes_[bufnum - 1].store(size, std::memory_order_relaxed);
+        return 0;
+    }
+
+    // grows the slot taken by the writer (nobody else references it) up to the capacity requested;
+    // the slot is released on allocation failure
+    errcode_t fit(int bufnum, size_t capacity){
+        size_t cap = std::max(capacity, min_capacity_.load(std::memory_order_relaxed));
+        if(caps_[bufnum - 1] >= cap){
+            return 0;
+        }
+
+        cap = std::max(cap, caps_[bufnum - 1] + caps_[bufnum - 1] / 2); // (amortized growth)
+        void* p = ::operator new(cap, std::nothrow);
+        if(p == nullptr){
+            control.free(&bufnum);
+            return ERR_NO_MEMORY;
+        }
+
+        ::operator delete(slots_[bufnum - 1].exchange(p, std::memory_order_relaxed)); // (published by commit)
+        caps_[bufnum - 1] = cap;
+        sizes_[bufnum - 1].store(0, std::memory_order_relaxed);
+        return 0;
+    }
+
+    // read-mostly data first, the control structure on its own cache line(s) then
+    std::atomic<void*> slots_[NBUFS] = {};
+    std::atomic<size_t> sizes_[NBUFS] = {}; // size of committed message
+    size_t caps_[NBUFS] = {}; // capacity of slots (accessed by the writer owning the slot)
+    std::atomic<size_t> min_capacity_ = {0};
+    alignas(cache_line_size) ControlCode control;
+    char control_pad_[cache_line_size - sizeof(ControlCode) % cache_line_size]; // nothing else on the last line
+};
+
+} // namespace
+
+#endif
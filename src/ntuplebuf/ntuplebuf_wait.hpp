@@ -0,0 +1,274 @@
+/*
+Parking place for readers waiting for new data in an ntuple buffer.
+
+Waiters register themselves in waiters_ and sleep on seq_ (futex on Linux, condition variable elsewhere).
+The producer calls notify() after publishing; it only reads waiters_ unless somebody waits,
+so publishing makes no syscall (and no write to a shared cache line) while nobody waits.
+It is not free though: the read needs a seq_cst fence (unless the publishing RMW is seq_cst)
+and a seq_cst load on every commit. Buffers that never wait skip notify() altogether
+(NoWait memory order policy, see ntuplebuf.hpp).
+
+Futex operations are not "private", so the WaitPoint also works when placed in memory shared between
+processes (see ntuplebuf_shm.hpp). Both of them are slow path anyway (only when somebody waits).
+The condition variable fallback is not process-shared.
+
+Lost wakeup is excluded by the usual "Dekker" pairing of seq_cst fences:
+  waiter:   waiters_++    fence   check data
+  producer: publish data  fence   check waiters_
+at least one of them sees the other's write.
+
+Instead of sleeping, a waiter may queue a WaitNode (add_node()): notify() takes all queued nodes and
+calls their fire() once, in the producer's thread and without a syscall (e.g. fire() posts a coroutine
+to an executor). A node shall stay alive until it has fired or remove_node() has taken it back;
+fire() is called outside the lock of the node list, so it may queue the node again.
+ */
+
+#ifndef ntuplebuf_wait_hpp
+#define ntuplebuf_wait_hpp
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+
+#ifdef __linux__
+#   include <linux/futex.h>
+#   include <sys/syscall.h>
+#   include <unistd.h>
+#   include <ctime>
+#else
+#   include <mutex>
+#   include <condition_variable>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#   include <immintrin.h>
+#endif
+
+
+namespace ntuplebuf {
+
+
+inline void cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+
+// one-shot asynchronous waiter (see WaitPoint::add_node())
+struct WaitNode
+{
+    void (*fire)(WaitNode* self) = nullptr; // called once by the notifying producer
+    WaitNode* next = nullptr;               // (owned by the WaitPoint while queued)
+};
+
+
+struct WaitPoint
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // shall be called by the producer after data is published;
+    // seq_cst_done: the publishing RMW was seq_cst (so the fence is not needed)
+    void notify(bool seq_cst_done){
+        if(!seq_cst_done){
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+
+        if(waiters_.load(std::memory_order_seq_cst) == 0){
+            return; // fast path: nobody waits
+        }
+
+        if(nodes_.load(std::memory_order_relaxed) != nullptr){
+            fire_nodes();
+        }
+
+        if(sleepers_.load(std::memory_order_seq_cst) != 0){
+            seq_.fetch_add(1, std::memory_order_seq_cst);
+            wake_all();
+        }
+    }
+
+    bool has_waiters() const{
+        return waiters_.load(std::memory_order_relaxed) != 0;
+    }
+
+
+    template<typename Pred>
+    int // returns 1 if updated() became true, 0 on timeout
+    wait(
+            Pred updated, // bool(); shall load data with seq_cst
+            std::chrono::nanoseconds timeout,
+            unsigned spin // number of polls before parking
+    ){
+        if(updated()){
+            return 1;
+        }
+
+        for(unsigned i = 0; i < spin; ++i){
+            cpu_relax();
+            if(updated()){
+                return 1;
+            }
+        }
+
+        bool forever = (timeout == std::chrono::nanoseconds::max());
+        Clock::time_point deadline = forever? Clock::time_point::max() : Clock::now() + timeout;
+
+        sleepers_.fetch_add(1, std::memory_order_seq_cst);
+        waiters_.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        int ret = 0;
+        for(;;){
+            uint32_t seq = seq_.load(std::memory_order_seq_cst);
+
+            if(updated()){
+                ret = 1;
+                break;
+            }
+
+            std::chrono::nanoseconds left = std::chrono::nanoseconds::max();
+            if(!forever){
+                left = deadline - Clock::now();
+                if(left.count() <= 0){
+                    break; // timeout
+                }
+            }
+
+            sleep(seq, left);
+        }
+
+        waiters_.fetch_sub(1, std::memory_order_seq_cst);
+        sleepers_.fetch_sub(1, std::memory_order_seq_cst);
+        return ret;
+    }
+
+
+    template<typename Pred>
+    bool // returns true if the node is queued (fires on a notification), false if updated() is true already
+    add_node(
+            WaitNode* node,
+            Pred updated // bool(); shall load data with seq_cst
+    ){
+        lock_nodes();
+        node->next = nodes_.load(std::memory_order_relaxed);
+        nodes_.store(node, std::memory_order_relaxed);
+        waiters_.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        bool queued = !updated();
+        if(!queued){ // (still the head: notify() takes nodes under the lock only)
+            nodes_.store(node->next, std::memory_order_relaxed);
+            waiters_.fetch_sub(1, std::memory_order_seq_cst);
+        }
+        unlock_nodes();
+        return queued;
+    }
+
+    // returns true if the node has been taken back, false if it is not queued (fired or firing)
+    bool remove_node(WaitNode* node){
+        bool found = false;
+        lock_nodes();
+        WaitNode* prev = nullptr;
+        for(WaitNode* n = nodes_.load(std::memory_order_relaxed); n != nullptr; prev = n, n = n->next){
+            if(n == node){
+                if(prev == nullptr){
+                    nodes_.store(n->next, std::memory_order_relaxed);
+                }else{
+                    prev->next = n->next;
+                }
+                waiters_.fetch_sub(1, std::memory_order_seq_cst);
+                found = true;
+                break;
+            }
+        }
+        unlock_nodes();
+        return found;
+    }
+
+
+private:
+    void lock_nodes(){
+        uint32_t unlocked = 0;
+        while(!nodes_lock_.compare_exchange_weak(unlocked, 1, std::memory_order_acquire)){
+            unlocked = 0;
+            cpu_relax();
+        }
+    }
+
+    void unlock_nodes(){ nodes_lock_.store(0, std::memory_order_release); }
+
+    void fire_nodes(){
+        lock_nodes();
+        WaitNode* n = nodes_.load(std::memory_order_relaxed);
+        nodes_.store(nullptr, std::memory_order_relaxed);
+        unsigned count = 0;
+        for(WaitNode* i = n; i != nullptr; i = i->next){
+            ++count;
+        }
+        waiters_.fetch_sub(count, std::memory_order_seq_cst);
+        unlock_nodes();
+
+        while(n != nullptr){
+            WaitNode* next = n->next; // (fire() may reuse or free the node)
+            n->fire(n);
+            n = next;
+        }
+    }
+
+#ifdef __linux__
+    void wake_all(){
+        syscall(SYS_futex, futex_addr(), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    // returns when seq_ != seq, on timeout, on signal or spuriously
+    void sleep(uint32_t seq, std::chrono::nanoseconds left){
+        struct timespec ts;
+        struct timespec* pts = nullptr;
+        if(left != std::chrono::nanoseconds::max()){
+            ts.tv_sec = (time_t)(left.count() / 1000000000);
+            ts.tv_nsec = (long)(left.count() % 1000000000);
+            pts = &ts;
+        }
+        syscall(SYS_futex, futex_addr(), FUTEX_WAIT, seq, pts, nullptr, 0);
+    }
+
+    uint32_t* futex_addr(){
+        static_assert(sizeof(seq_) == sizeof(uint32_t), "futex needs 32-bit word");
+        return reinterpret_cast<uint32_t*>(&seq_);
+    }
+#else
+    void wake_all(){
+        std::lock_guard<std::mutex> lk(mux_);
+        condvar_.notify_all();
+    }
+
+    void sleep(uint32_t seq, std::chrono::nanoseconds left){
+        std::unique_lock<std::mutex> lk(mux_);
+        auto changed = [&](){ return seq_.load() != seq; };
+        if(left == std::chrono::nanoseconds::max()){
+            condvar_.wait(lk, changed);
+        }else{
+            condvar_.wait_for(lk, left, changed);
+        }
+    }
+
+    std::mutex mux_;
+    std::condition_variable condvar_;
+#endif
+
+    std::atomic<uint32_t> seq_ = {0};      // incremented on every notification with sleepers present
+    std::atomic<uint32_t> waiters_ = {0};  // number of parked (or parking) readers and queued nodes
+    std::atomic<uint32_t> sleepers_ = {0}; // number of parked (or parking) readers
+
+    std::atomic<WaitNode*> nodes_ = {nullptr}; // queued nodes (changed under nodes_lock_)
+    std::atomic<uint32_t> nodes_lock_ = {0};
+};
+
+
+} // namespace
+
+#endif
@@ -5,7 +5,12 @@
 #include <condition_variable>
 #include <vector>
 #include <cstdlib>
+#include <cstdint>
 #include <memory>
+#include <random>
+#include <chrono>
+
+#include <ucontext.h>
 
 
 namespace lf_test_utils {
@@ -143,5 +148,263 @@ protected:
 };
 
 
+/*
+Deterministic interleaving of participants (tasks) run as stackful coroutines (ucontext) on the calling
+thread: a task runs until its next yeld() point, then the scheduler chooses the task to continue.
+No OS thread switches and no locks, so runs are orders of magnitude faster than with
+SequentialThreadsSched, and a run is fully defined by its sequence of choices (trace), which can be
+replayed. There is no limit on the number of tasks.
+
+A scenario is created anew for every run (stateless exploration) and tells what its tasks do and
+which invariants hold after every step (a step is a task run from one yeld() to the next one).
+Tasks shall be bounded (e.g. loops of fixed length): a run longer than max_steps is counted as
+incomplete (livelock) and abandoned.
+
+    run_random()    seed-driven random choices (switch_prob: probability to switch task at a yeld point)
+    run_bounded()   systematic depth-first exploration of all interleavings with at most max_preemptions
+                    preemptions (switches away from a task which could continue), as CHESS does;
+                    small bounds already reach most of the bugs
+    replay()        the run given by the trace (e.g. of the first violation found)
+
+An abandoned run (violation, livelock) does not unwind the stacks of its tasks.
+ */
+struct CoroScenario{
+    virtual unsigned num_tasks() const = 0;
+    virtual void task(unsigned i) = 0;
+    virtual bool invariant(){ return true; }   // after every step; false: violation
+    virtual bool check_final(){ return true; } // after all tasks have finished
+    virtual ~CoroScenario(){}
+};
+
+class CoroutineSched{
+public:
+
+    struct Result{
+        uint64_t runs = 0;
+        uint64_t steps = 0;
+        uint64_t violations = 0;
+        uint64_t incomplete = 0;  // abandoned after max_steps
+        bool complete = false;    // run_bounded(): all interleavings within the bound explored
+        std::vector<unsigned> trace; // choices (task numbers) of the first violation
+        double seconds = 0;
+    };
+
+    explicit CoroutineSched(size_t stack_size = 64 * 1024, uint64_t max_steps = 100000)
+    : stack_size_(stack_size), max_steps_(max_steps)
+    {}
+
+    // yield point of a task (does nothing outside of tasks)
+    static void yeld(){
+        CoroutineSched* s = current();
+        if(s != nullptr && s->cur_ >= 0){
+            swapcontext(&s->ctx_[s->cur_], &s->main_);
+        }
+    }
+
+    // a run is in progress on this thread (in a task or in the scheduler itself, e.g. checking invariants)
+    static bool running(){ return current() != nullptr; }
+
+
+    template<typename Factory> // std::unique_ptr<CoroScenario> Factory()
+    Result run_random(Factory factory, uint64_t seed, uint64_t runs, double switch_prob = 0.5){
+        Result res;
+        auto t0 = std::chrono::steady_clock::now();
+
+        for(uint64_t r = 0; r < runs; ++r){
+            std::mt19937_64 rnd(seed + r);
+            std::uniform_real_distribution<double> coin(0.0, 1.0);
+
+            auto choose = [&](int cur, const std::vector<unsigned>& runnable) -> unsigned {
+                if(cur >= 0 && done_[cur] == 0 && coin(rnd) >= switch_prob){
+                    return (unsigned)cur;
+                }
+                return runnable[rnd() % runnable.size()];
+            };
+
+            run_one(factory, choose, res);
+        }
+
+        res.seconds = seconds_since(t0);
+        return res;
+    }
+
+    template<typename Factory>
+    Result run_bounded(Factory factory, unsigned max_preemptions, uint64_t max_runs = UINT64_MAX){
+        Result res;
+        auto t0 = std::chrono::steady_clock::now();
+
+        // decision points of the current path: option 0 continues the current task (or takes the first
+        // runnable one if the current task has finished), other options are the rest of runnable tasks
+        struct Decision{ unsigned k; unsigned n; bool preempts; };
+        std::vector<Decision> path;
+
+        for(;;){
+            size_t depth = 0;
+            auto choose = [&](int cur, const std::vector<unsigned>& runnable) -> unsigned {
+                bool cur_runnable = cur >= 0 && done_[cur] == 0;
+                if(depth == path.size()){
+                    path.push_back(Decision{0, (unsigned)runnable.size(), cur_runnable});
+                }
+
+                unsigned k = path[depth++].k;
+                unsigned dflt = cur_runnable? (unsigned)cur : runnable[0];
+                if(k == 0){
+                    return dflt;
+                }
+
+                for(unsigned t: runnable){ // k-th of the others
+                    if(t != dflt && --k == 0){
+                        return t;
+                    }
+                }
+                return dflt; // (unreachable for deterministic scenarios)
+            };
+
+            run_one(factory, choose, res);
+            path.resize(std::min(path.size(), depth)); // (an abandoned run is not explored deeper)
+
+            if(res.runs >= max_runs){
+                break;
+            }
+            if(!next_path(path, max_preemptions)){
+                res.complete = true;
+                break;
+            }
+        }
+
+        res.seconds = seconds_since(t0);
+        return res;
+    }
+
+    template<typename Factory>
+    Result replay(Factory factory, const std::vector<unsigned>& trace){
+        Result res;
+        size_t i = 0;
+        auto choose = [&](int cur, const std::vector<unsigned>& runnable) -> unsigned {
+            return (i < trace.size())? trace[i++] : (cur >= 0 && done_[cur] == 0)? (unsigned)cur : runnable[0];
+        };
+        run_one(factory, choose, res);
+        return res;
+    }
+
+
+private:
+
+    static CoroutineSched*& current(){
+        static thread_local CoroutineSched* s = nullptr;
+        return s;
+    }
+
+    static double seconds_since(std::chrono::steady_clock::time_point t0){
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    }
+
+    static void trampoline(){
+        CoroutineSched* s = current();
+        s->scenario_->task((unsigned)s->cur_);
+        s->done_[s->cur_] = 1; // (returns to main_ via uc_link)
+    }
+
+    template<typename Factory, typename Choose>
+    void run_one(Factory& factory, Choose& choose, Result& res){
+        std::unique_ptr<CoroScenario> scenario = factory();
+        unsigned n = scenario->num_tasks();
+
+        scenario_ = scenario.get();
+        current() = this;
+        cur_ = -1;
+        ctx_.assign(n, ucontext_t());
+        done_.assign(n, 0);
+        while(stacks_.size() < n){
+            stacks_.emplace_back(new char[stack_size_]);
+        }
+
+        for(unsigned i = 0; i < n; ++i){
+            getcontext(&ctx_[i]);
+            ctx_[i].uc_stack.ss_sp = stacks_[i].get();
+            ctx_[i].uc_stack.ss_size = stack_size_;
+            ctx_[i].uc_link = &main_;
+            makecontext(&ctx_[i], &CoroutineSched::trampoline, 0);
+        }
+
+        std::vector<unsigned> trace;
+        std::vector<unsigned> runnable;
+        bool ok = true;
+        uint64_t steps = 0;
+        int last = -1;
+
+        for(;;){
+            runnable.clear();
+            for(unsigned i = 0; i < n; ++i){
+                if(done_[i] == 0){
+                    runnable.push_back(i);
+                }
+            }
+            if(runnable.empty()){
+                ok = scenario->check_final();
+                break;
+            }
+
+            if(steps++ >= max_steps_){
+                ++res.incomplete;
+                break;
+            }
+
+            unsigned next = choose(last, runnable);
+            trace.push_back(next);
+
+            cur_ = (int)next;
+            swapcontext(&main_, &ctx_[next]);
+            cur_ = -1;
+            last = (int)next;
+
+            if(!scenario->invariant()){
+                ok = false;
+                break;
+            }
+        }
+
+        ++res.runs;
+        res.steps += steps;
+        if(!ok){
+            if(res.violations++ == 0){
+                res.trace = trace;
+            }
+        }
+
+        current() = nullptr;
+        scenario_ = nullptr;
+    }
+
+    // the next path in depth-first order within the preemption bound; false if there is none
+    template<typename Path>
+    static bool next_path(Path& path, unsigned max_preemptions){
+        while(!path.empty()){
+            unsigned used = 0;
+            for(size_t i = 0; i + 1 < path.size(); ++i){
+                used += (path[i].k > 0 && path[i].preempts)? 1 : 0;
+            }
+
+            auto& d = path.back();
+            if(d.k + 1 < d.n && used + (d.preempts? 1 : 0) <= max_preemptions){
+                ++d.k;
+                return true;
+            }
+            path.pop_back();
+        }
+        return false;
+    }
+
+    size_t stack_size_;
+    uint64_t max_steps_;
+    CoroScenario* scenario_ = nullptr;
+    int cur_ = -1; // running task (-1: the scheduler)
+    ucontext_t main_;
+    std::vector<ucontext_t> ctx_;
+    std::vector<char> done_;
+    std::vector<std::unique_ptr<char[]>> stacks_;
+};
+
+
 } // namespace
 #endif